@@ -0,0 +1,79 @@
+#include "sim_mem.h"
+
+char main_memory[MEMORY_SIZE];
+
+#define EXEC_FILE_NAME "bench_exec_file"
+#define SWAP_FILE_NAME "bench_swap_file"
+
+#define TEXT_SIZE 128
+#define DATA_SIZE 128
+#define BSS_SIZE 128
+#define STACK_HEAP_SIZE 128
+
+#define PAGE_SIZE 8
+
+#define BSS_MASK 2048
+
+#define ITERATIONS 100000000L
+
+double elapsed_ns(struct timespec start, struct timespec end) {
+	return (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+}
+
+int create_exec_file() {
+	char content[TEXT_SIZE + DATA_SIZE];
+	for (int i = 0; i < TEXT_SIZE + DATA_SIZE; i++)
+		content[i] = 'a' + i % 26;
+
+	int fd = open(EXEC_FILE_NAME, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (fd < 0) {
+		perror("couldn't create exec file\n");
+		return 1;
+	}
+	if (write(fd, content, sizeof(content)) < 0) {
+		perror("writing error to exec file\n");
+		close(fd);
+		return 1;
+	}
+	close(fd);
+	return 0;
+}
+
+/**
+ * @brief measure the latency of load and store hits on pages already in memory.
+ *
+ */
+int main() {
+	char exec_file[200] = EXEC_FILE_NAME;
+	char swap_file[200] = SWAP_FILE_NAME;
+
+	if (create_exec_file())
+		return 1;
+
+	sim_mem mem_sm(exec_file, swap_file, TEXT_SIZE, DATA_SIZE, BSS_SIZE, STACK_HEAP_SIZE, PAGE_SIZE);
+
+	// bring in a handful of bss pages so every access below is a hit.
+	int resident = 4;
+	for (int i = 0; i < resident; i++)
+		mem_sm.store(BSS_MASK + i * PAGE_SIZE, 'x');
+
+	struct timespec start, end;
+	volatile char sink = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (long i = 0; i < ITERATIONS; i++)
+		sink = mem_sm.load(BSS_MASK + (i % (resident * PAGE_SIZE)));
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	printf("load hit:  %.2f ns\n", elapsed_ns(start, end) / ITERATIONS);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (long i = 0; i < ITERATIONS; i++)
+		mem_sm.store(BSS_MASK + (i % (resident * PAGE_SIZE)), (char)i);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	printf("store hit: %.2f ns\n", elapsed_ns(start, end) / ITERATIONS);
+
+	(void)sink;
+	unlink(EXEC_FILE_NAME);
+	unlink(SWAP_FILE_NAME);
+	return 0;
+}
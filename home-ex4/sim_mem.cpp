@@ -5,52 +5,12 @@
 
 #define DEFAULT_SWAP_INDEX -1
 
-#define TEXT_INDEX 0
-#define DATA_INDEX 1
-#define BSS_INDEX 2
-#define STACK_HEAP_INDEX 3
-
-#define OUTER_PAGE_AMOUNT 4
-
 #define INNER_PAGE_MASK_CALC 1023
 #define OUTER_PAGE_MASK 3072
 
 #define LOAD_OP 0
 #define STORE_OP 1
 
-void custom_queue::enqueue(int value) {
-	this->remove(value);
-	if (this->size >= MEMORY_SIZE)
-		return;
-
-	this->values[this->size++] = value;
-}
-
-void custom_queue::remove(int value) {
-	int index = -1;
-	for (int i = 0; i < this->size; i++) {
-		if (this->values[i] == value) {
-			index = i;
-			break;
-		}
-	}
-
-	if (index < 0)
-		return;
-
-	this->size--;
-	for (int i = index; i < this->size; i++) {
-		this->values[i] = this->values[i + 1];
-	}
-}
-
-int custom_queue::peek() {
-	if (this->size <= 0)
-		return -1;
-
-	return this->values[0];
-}
-
 int get_value_from_mask(int address, int mask) {
 	address = address & mask;
 	while (mask > 0 && (mask & 1) == 0) {
@@ -60,7 +20,16 @@ int get_value_from_mask(int address, int mask) {
 	return address;
 }
 
-void sim_mem::init_sizes_arr(int arr[]) {
+int get_shift_from_mask(int mask) {
+	int shift = 0;
+	while (mask > 0 && (mask & 1) == 0) {
+		mask = mask >> 1;
+		shift++;
+	}
+	return shift;
+}
+
+void sim_mem::init_sizes_arr(unsigned int arr[]) {
 	arr[TEXT_INDEX] = this->text_size / this->page_size;
 	arr[DATA_INDEX] = this->data_size / this->page_size;
 	arr[BSS_INDEX] = this->bss_size / this->page_size;
@@ -68,7 +37,7 @@ void sim_mem::init_sizes_arr(int arr[]) {
 }
 
 int sim_mem::init_alloc_memory() {
-	int nums[OUTER_PAGE_AMOUNT] = { 0 };
+	unsigned int* nums = this->inner_page_amount;
 	this->init_sizes_arr(nums);
 
 	this->page_table = (page_descriptor**)calloc(sizeof(page_descriptor*), OUTER_PAGE_AMOUNT);
@@ -98,9 +67,8 @@ int sim_mem::init_alloc_memory() {
 		return ERROR;
 	}
 
-	this->last_recently_used = (custom_queue*)calloc(sizeof(custom_queue), 1);
-
-	if (this->last_recently_used == NULL) {
+	this->frame_last_used = (unsigned long*)calloc(sizeof(unsigned long), MEMORY_SIZE / this->page_size);
+	if (this->frame_last_used == NULL) {
 		perror("memory allocation error - least recently used\n");
 		return ERROR;
 	}
@@ -141,6 +109,9 @@ void sim_mem::init_masks() {
 	}
 
 	this->inner_page_mask = (this->frame_offset_mask ^ INNER_PAGE_MASK_CALC) & INNER_PAGE_MASK_CALC;
+
+	this->outer_page_shift = get_shift_from_mask(this->outer_page_mask);
+	this->inner_page_shift = get_shift_from_mask(this->inner_page_mask);
 }
 
 void sim_mem::destroy() {
@@ -160,7 +131,7 @@ void sim_mem::destroy() {
 	free(this->page_table);
 	free(this->used_frames_main_memory);
 	free(this->used_frames_swap);
-	free(this->last_recently_used);
+	free(this->frame_last_used);
 }
 
 sim_mem::sim_mem(char exe_file_name[], char swap_file_name[], int text_size,
@@ -179,7 +150,8 @@ sim_mem::sim_mem(char exe_file_name[], char swap_file_name[], int text_size,
 	this->page_table = NULL;
 	this->used_frames_main_memory = NULL;
 	this->used_frames_swap = NULL;
-	this->last_recently_used = NULL;
+	this->frame_last_used = NULL;
+	this->access_clock = 0;
 
 	this->num_of_pages = 0;
 
@@ -212,12 +184,9 @@ sim_mem::~sim_mem() {
 }
 
 int sim_mem::find_page_using_frame(int frame, int& outer, int& inner) {
-	int nums[OUTER_PAGE_AMOUNT] = { 0 };
-	this->init_sizes_arr(nums);
-
 	page_descriptor* p = NULL;
 	for (int o = 0; o < OUTER_PAGE_AMOUNT; o++) {
-		for (int i = 0; i < nums[o]; i++) {
+		for (int i = 0; i < (int)this->inner_page_amount[o]; i++) {
 			p = &this->page_table[o][i];
 			if (p->valid == true && p->frame == frame) {
 				outer = o;
@@ -282,9 +251,14 @@ int sim_mem::find_empty_frame() {
 		}
 	}
 
-	int frame = this->last_recently_used->peek();
+	// every frame is in use, evict the one with the oldest access.
+	int frame = -1;
+	for (int i = 0; i < frame_amount; i++) {
+		if (frame < 0 || this->frame_last_used[i] < this->frame_last_used[frame])
+			frame = i;
+	}
 	if (frame < 0) {
-		fprintf(stderr, "there is no free frame in memory AND the queue of used frames is empty, should NEVER get to this error.\n");
+		fprintf(stderr, "there is no free frame in memory AND there are no used frames, should NEVER get to this error.\n");
 		return -1;
 	}
 
@@ -309,7 +283,6 @@ void sim_mem::update_page_table_swapped(int outer, int inner, int swap_frame) {
 		this->used_frames_swap[swap_frame] = true;
 
 	this->used_frames_main_memory[frame] = false;
-	this->last_recently_used->remove(frame);
 }
 
 void sim_mem::update_page_table_added_to_memory(int outer, int inner, int frame) {
@@ -324,7 +297,7 @@ void sim_mem::update_page_table_added_to_memory(int outer, int inner, int frame)
 	if (swap_frame >= 0)
 		this->used_frames_swap[swap_frame] = false;
 
-	this->last_recently_used->enqueue(frame);
+	this->touch_frame(frame);
 }
 
 int sim_mem::copy_page_from_exe(int outer, int inner) {
@@ -392,7 +365,7 @@ int sim_mem::init_new_page(int outer, int inner) {
 
 int sim_mem::setup_page(int outer, int inner, int op) {
 	if (page_table[outer][inner].valid) {
-		this->last_recently_used->enqueue(page_table[outer][inner].frame);
+		this->touch_frame(page_table[outer][inner].frame);
 		return SUCCESS;
 	}
 
@@ -434,10 +407,7 @@ bool sim_mem::is_valid_address(int outer, int inner, int offset) {
 		return false;
 	}
 
-	int nums[OUTER_PAGE_AMOUNT] = { 0 };
-	this->init_sizes_arr(nums);
-
-	if (inner < 0 || inner >= nums[outer]) {
+	if (inner < 0 || inner >= (int)this->inner_page_amount[outer]) {
 		fprintf(stderr, "illegal inner address.\n");
 		return false;
 	}
@@ -450,7 +420,7 @@ bool sim_mem::is_valid_address(int outer, int inner, int offset) {
 	return true;
 }
 
-char sim_mem::load(int address) {
+char sim_mem::load_slow(int address) {
 	int outer = get_value_from_mask(address, this->outer_page_mask);
 	int inner = get_value_from_mask(address, this->inner_page_mask);
 	int frame_offset = get_value_from_mask(address, this->frame_offset_mask);
@@ -467,7 +437,7 @@ char sim_mem::load(int address) {
 	return main_memory[frame_start + frame_offset];
 }
 
-void sim_mem::store(int address, char value) {
+void sim_mem::store_slow(int address, char value) {
 	int outer = get_value_from_mask(address, this->outer_page_mask);
 	int inner = get_value_from_mask(address, this->inner_page_mask);
 	int frame_offset = get_value_from_mask(address, this->frame_offset_mask);
@@ -476,6 +446,11 @@ void sim_mem::store(int address, char value) {
 		return;
 	}
 
+	if (outer == TEXT_INDEX) {
+		fprintf(stderr, "attempt to write to exec file\n");
+		return;
+	}
+
 	if (this->setup_page(outer, inner, STORE_OP)) {
 		return;
 	}
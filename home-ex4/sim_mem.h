@@ -17,18 +17,14 @@
 
 #define MEMORY_SIZE 200
 
-extern char main_memory[MEMORY_SIZE];
+#define TEXT_INDEX 0
+#define DATA_INDEX 1
+#define BSS_INDEX 2
+#define STACK_HEAP_INDEX 3
 
-class custom_queue {
-private:
-	int size;
-	int values[MEMORY_SIZE];
+#define OUTER_PAGE_AMOUNT 4
 
-public:
-	int peek();
-	void enqueue(int value);
-	void remove(int value);
-};
+extern char main_memory[MEMORY_SIZE];
 
 typedef struct page_descriptor {
 	bool valid;
@@ -53,10 +49,16 @@ class sim_mem {
 	int inner_page_mask;	// inner page mask
 	int frame_offset_mask;	// frame offset mask
 
+	int outer_page_shift;	// shift right after masking to get the outer index
+	int inner_page_shift;	// shift right after masking to get the inner index
+
+	unsigned int inner_page_amount[OUTER_PAGE_AMOUNT];	// amount of pages in each inner page table.
+
 	bool* used_frames_main_memory;	// boolean array representing currently being used portions of memory.
 	bool* used_frames_swap;			// boolean array representing currently being used portions of swap file.
 
-	custom_queue* last_recently_used;	// queue of last recently page currently in memory
+	unsigned long access_clock;			// logical clock, advanced on every access
+	unsigned long* frame_last_used;		// access_clock value of the last access to each frame, for LRU
 	page_descriptor** page_table;		// pointer to page table
 
 	/**
@@ -76,7 +78,7 @@ class sim_mem {
 	int init_alloc_memory();
 
 	/**
-	 * @brief initilize outer_page_mask, inner_page_mask, frame_offset_mask.
+	 * @brief initilize outer_page_mask, inner_page_mask, frame_offset_mask and their shifts.
 	 *
 	 */
 	void init_masks();
@@ -151,7 +153,32 @@ class sim_mem {
 	 * @brief initialize an array with the sizes of each inner page table.
 	 *
 	 */
-	void init_sizes_arr(int arr[]);
+	void init_sizes_arr(unsigned int arr[]);
+
+	/**
+	 * @brief return the page descriptor of a resident page at the address,
+	 * or NULL if the address is illegal or the page is not in memory.
+	 * never prints, it is the fast path of load and store.
+	 *
+	 */
+	page_descriptor* find_resident_page(int address);
+
+	/**
+	 * @brief mark a frame as the most recently used one.
+	 *
+	 */
+	void touch_frame(int frame);
+
+	/**
+	 * @brief slow path of load, validates the address and handles page faults.
+	 *
+	 */
+	char load_slow(int address);
+	/**
+	 * @brief slow path of store, validates the address and handles page faults.
+	 *
+	 */
+	void store_slow(int address, char value);
 
 public:
 	sim_mem(char exe_file_name[], char swap_file_name[], int text_size,
@@ -167,4 +194,41 @@ public:
 	~sim_mem();
 };
 
+inline void sim_mem::touch_frame(int frame) {
+	this->frame_last_used[frame] = ++this->access_clock;
+}
+
+inline page_descriptor* sim_mem::find_resident_page(int address) {
+	unsigned int outer = (unsigned int)(address & this->outer_page_mask) >> this->outer_page_shift;
+	unsigned int inner = (unsigned int)(address & this->inner_page_mask) >> this->inner_page_shift;
+	unsigned int offset = (unsigned int)(address & this->frame_offset_mask);
+
+	// bitwise or, so both range checks cost a single branch.
+	if ((inner >= this->inner_page_amount[outer]) | (offset >= (unsigned int)this->page_size))
+		return NULL;
+
+	page_descriptor* page = &this->page_table[outer][inner];
+	return page->valid ? page : NULL;
+}
+
+inline char sim_mem::load(int address) {
+	page_descriptor* page = this->find_resident_page(address);
+	if (__builtin_expect(page == NULL, 0))
+		return this->load_slow(address);
+
+	this->touch_frame(page->frame);
+	return main_memory[page->frame * this->page_size + (address & this->frame_offset_mask)];
+}
+
+inline void sim_mem::store(int address, char value) {
+	page_descriptor* page = this->find_resident_page(address);
+	// text pages are read only, let the slow path report it.
+	bool is_text = ((unsigned int)(address & this->outer_page_mask) >> this->outer_page_shift) == TEXT_INDEX;
+	if (__builtin_expect(page == NULL || is_text, 0))
+		return this->store_slow(address, value);
+
+	this->touch_frame(page->frame);
+	main_memory[page->frame * this->page_size + (address & this->frame_offset_mask)] = value;
+}
+
 #endif
\ No newline at end of file
@@ -0,0 +1,280 @@
+#ifndef BLOCK_BITMAP_H
+#define BLOCK_BITMAP_H
+
+#include <stdint.h>
+#include <vector>
+
+#define BITMAP_WORD_BITS 64
+
+// ============================================================================
+// BlockBitmap - one bit per block (1 = occupied), kept in 64-bit words.
+//               A summary level holds one bit per word, set when the word is
+//               full, so allocation skips fully used regions 4096 blocks at a
+//               time. Allocation is next-fit: it continues from where the
+//               previous one stopped instead of rescanning from block 0.
+class BlockBitmap {
+    int size;
+    int free_blocks;
+    int hint;       // word to start the next search from
+
+    std::vector<uint64_t> words;
+    std::vector<uint64_t> summary;
+
+public:
+    BlockBitmap() {
+        reset(0);
+    }
+
+    // All blocks free. Bits past the last block are kept set, so they are
+    // never handed out.
+    void reset(int _size) {
+        size = _size;
+        free_blocks = _size;
+        hint = 0;
+        words.assign(wordCount(), 0);
+        summary.assign((words.size() + BITMAP_WORD_BITS - 1) / BITMAP_WORD_BITS, 0);
+
+        int tail = size % BITMAP_WORD_BITS;
+        if (tail != 0) {
+            words.back() = ~0ULL << tail;
+            updateSummary(words.size() - 1);
+        }
+
+        // summary bits of words that don't exist are kept set as well.
+        int summaryTail = words.size() % BITMAP_WORD_BITS;
+        if (summaryTail != 0)
+            summary.back() |= ~0ULL << summaryTail;
+    }
+
+    int getSize() {
+        return size;
+    }
+
+    int getFreeBlocks() {
+        return free_blocks;
+    }
+
+    int wordCount() {
+        return (size + BITMAP_WORD_BITS - 1) / BITMAP_WORD_BITS;
+    }
+
+    // The words, exactly as they are stored on disk.
+    uint64_t* data() {
+        return words.data();
+    }
+
+    uint64_t getWord(int word) {
+        return words[word];
+    }
+
+    // Call after the words were overwritten through data().
+    void rebuild() {
+        free_blocks = 0;
+        for (int w = 0; w < (int)words.size(); w++) {
+            free_blocks += __builtin_popcountll(~words[w]);
+            updateSummary(w);
+        }
+        hint = 0;
+    }
+
+    bool test(int block) {
+        return (words[block / BITMAP_WORD_BITS] >> (block % BITMAP_WORD_BITS)) & 1;
+    }
+
+    void set(int block) {
+        uint64_t& word = words[block / BITMAP_WORD_BITS];
+        uint64_t bit = 1ULL << (block % BITMAP_WORD_BITS);
+        if (word & bit)
+            return;
+
+        word |= bit;
+        free_blocks--;
+        updateSummary(block / BITMAP_WORD_BITS);
+    }
+
+    void clear(int block) {
+        uint64_t& word = words[block / BITMAP_WORD_BITS];
+        uint64_t bit = 1ULL << (block % BITMAP_WORD_BITS);
+        if (!(word & bit))
+            return;
+
+        word &= ~bit;
+        free_blocks++;
+        updateSummary(block / BITMAP_WORD_BITS);
+        if (block / BITMAP_WORD_BITS < hint)
+            hint = block / BITMAP_WORD_BITS;
+    }
+
+    // Marks the first free block at or after the hint as occupied and
+    // returns it, wrapping around once. Returns -1 if the bitmap is full.
+    int allocate() {
+        if (free_blocks == 0)
+            return -1;
+
+        int word = findFreeWord(hint, summary.size());
+        if (word < 0)
+            word = findFreeWord(0, hint / BITMAP_WORD_BITS + 1);
+        if (word < 0)
+            return -1;
+
+        int block = word * BITMAP_WORD_BITS + __builtin_ctzll(~words[word]);
+        set(block);
+        hint = word;
+        return block;
+    }
+
+    // Allocates up to `want` contiguous blocks and returns how many were
+    // taken, the first of them in `start`. Prefers the run beginning at
+    // `goal`, then the first long enough run after it (wrapping around),
+    // and settles for the longest run seen. Returns 0 if the bitmap is full.
+    int allocateRun(int goal, int want, int& start) {
+        if (free_blocks == 0 || want <= 0)
+            return 0;
+
+        if (goal < 0 || goal >= size)
+            goal = hint * BITMAP_WORD_BITS;
+
+        int bestStart = -1;
+        int bestLength = 0;
+        if (!findRun(goal, size, want, bestStart, bestLength))
+            findRun(0, goal, want, bestStart, bestLength);
+
+        start = bestStart;
+        setRange(start, bestLength);
+        hint = (start + bestLength) / BITMAP_WORD_BITS;
+        if (hint >= (int)words.size())
+            hint = 0;
+        return bestLength;
+    }
+
+    // The longest free run that starts in [from, to) and ends by `to`, its
+    // first block in `start`. Returns 0 if there is none.
+    int longestRun(int from, int to, int& start) {
+        int bestLength = 0;
+        int block = from;
+        while (block < to) {
+            block = nextFree(block);
+            if (block < 0 || block >= to)
+                break;
+
+            int length = runLength(block, to - block);
+            if (length > bestLength) {
+                start = block;
+                bestLength = length;
+            }
+            block += length;
+        }
+        return bestLength;
+    }
+
+    void setRange(int start, int length) {
+        changeRange(start, length, true);
+    }
+
+    void clearRange(int start, int length) {
+        changeRange(start, length, false);
+        if (length > 0 && start / BITMAP_WORD_BITS < hint)
+            hint = start / BITMAP_WORD_BITS;
+    }
+
+private:
+    // Looks at the free runs starting in [from, to). Returns true once a run
+    // of `want` blocks is found, otherwise leaves the longest in best*.
+    bool findRun(int from, int to, int want, int& bestStart, int& bestLength) {
+        int block = from;
+        while (block < to) {
+            block = nextFree(block);
+            if (block < 0 || block >= to)
+                return false;
+
+            int length = runLength(block, want);
+            if (length > bestLength) {
+                bestStart = block;
+                bestLength = length;
+            }
+            if (length >= want)
+                return true;
+            block += length;
+        }
+        return false;
+    }
+
+    // First free block at or after `from`, or -1.
+    int nextFree(int from) {
+        int word = from / BITMAP_WORD_BITS;
+        uint64_t bits = ~words[word] & (~0ULL << (from % BITMAP_WORD_BITS));
+        if (bits != 0)
+            return word * BITMAP_WORD_BITS + __builtin_ctzll(bits);
+
+        word = findFreeWord(word + 1, summary.size());
+        if (word < 0)
+            return -1;
+        return word * BITMAP_WORD_BITS + __builtin_ctzll(~words[word]);
+    }
+
+    // Amount of free blocks from `start` on, counting at most `max`.
+    int runLength(int start, int max) {
+        int length = 0;
+        int block = start;
+        while (length < max && block < size) {
+            uint64_t bits = words[block / BITMAP_WORD_BITS] >> (block % BITMAP_WORD_BITS);
+            int freeBits = bits == 0 ? BITMAP_WORD_BITS - block % BITMAP_WORD_BITS : __builtin_ctzll(bits);
+            length += freeBits;
+            block += freeBits;
+            if (bits != 0)
+                break;
+        }
+        return length < max ? length : max;
+    }
+
+    void changeRange(int start, int length, bool used) {
+        int block = start;
+        int end = start + length;
+        while (block < end) {
+            int word = block / BITMAP_WORD_BITS;
+            int offset = block % BITMAP_WORD_BITS;
+            int count = BITMAP_WORD_BITS - offset < end - block ? BITMAP_WORD_BITS - offset : end - block;
+            uint64_t mask = (count == BITMAP_WORD_BITS ? ~0ULL : ((1ULL << count) - 1)) << offset;
+
+            int changed = __builtin_popcountll(used ? (~words[word] & mask) : (words[word] & mask));
+            if (used) {
+                words[word] |= mask;
+                free_blocks -= changed;
+            }
+            else {
+                words[word] &= ~mask;
+                free_blocks += changed;
+            }
+            updateSummary(word);
+            block += count;
+        }
+    }
+
+    // Searches the summary for a word with a free bit, from the word
+    // `from` up to the summary word `summaryEnd` (exclusive).
+    int findFreeWord(int from, int summaryEnd) {
+        int s = from / BITMAP_WORD_BITS;
+        if (s >= summaryEnd)
+            return -1;
+
+        // ignore the words before `from` in the first summary word.
+        uint64_t notFull = ~summary[s] & (~0ULL << (from % BITMAP_WORD_BITS));
+        while (true) {
+            if (notFull != 0)
+                return s * BITMAP_WORD_BITS + __builtin_ctzll(notFull);
+            if (++s >= summaryEnd)
+                return -1;
+            notFull = ~summary[s];
+        }
+    }
+
+    void updateSummary(int word) {
+        uint64_t bit = 1ULL << (word % BITMAP_WORD_BITS);
+        if (words[word] == ~0ULL)
+            summary[word / BITMAP_WORD_BITS] |= bit;
+        else
+            summary[word / BITMAP_WORD_BITS] &= ~bit;
+    }
+};
+
+#endif
@@ -0,0 +1,472 @@
+#ifndef BLOCK_CACHE_H
+#define BLOCK_CACHE_H
+
+#include <vector>
+#include <unordered_map>
+#include <unordered_set>
+#include <algorithm>
+#include <memory>
+#include <mutex>
+
+#include "block_device.h"
+
+// the most blocks a write-back puts into one disk request.
+#define CACHE_MAX_WRITE_RUN 64
+
+// ============================================================================
+// BlockCache - a fixed amount of disk blocks kept in memory.
+//              Writes only dirty the cached copy (write-back), a dirty block
+//              reaches the disk when it is evicted or on sync().
+//              Eviction uses the CLOCK algorithm (second chance).
+//              Pinned blocks are never written back, they hold journaled
+//              changes that aren't committed yet. When every block is
+//              pinned the cache grows past its capacity until unpinAll().
+//              Dirty blocks that are consecutive on the disk are written
+//              back together, one disk request for the run.
+//              Held blocks (hold() / release()) are never evicted either,
+//              so a pointer into one stays good until it is released. A
+//              cached block never moves in memory.
+//              Every call holds the cache lock, except for the disk request
+//              of readRun / writeRun / prefetch, so those of several threads
+//              overlap.
+class BlockCache {
+    struct CacheEntry {
+        long block;
+        bool valid;
+        bool dirty;
+        bool referenced;
+        bool pinned;
+        int holds;
+    };
+
+    BlockDevice* device;
+
+    int capacity;
+    int block_size;
+    int clock_hand;
+
+    std::vector<CacheEntry> entries;
+    std::vector<char> data;         // the first `capacity` slots
+    std::vector<std::unique_ptr<char[]> > extra;    // the slots past them
+    std::unordered_map<long, int> index;
+    std::mutex lock;
+
+    long hits;
+    long misses;
+    long writebacks;
+    long write_runs;
+    long prefetched;
+    int dirty_blocks;
+    int pinned_blocks;
+    int held_blocks;
+
+public:
+    BlockCache(BlockDevice* _device, int _capacity) {
+        device = _device;
+        capacity = _capacity > 0 ? _capacity : 1;
+        block_size = 0;
+        clock_hand = 0;
+        hits = 0;
+        misses = 0;
+        writebacks = 0;
+        write_runs = 0;
+        prefetched = 0;
+        dirty_blocks = 0;
+        pinned_blocks = 0;
+        held_blocks = 0;
+    }
+
+    // Drops every cached block WITHOUT writing it back, and starts caching
+    // blocks of a new size. Used when the disk is formatted, no block may
+    // be held.
+    void reset(int _block_size) {
+        std::lock_guard<std::mutex> guard(lock);
+        block_size = _block_size;
+        clock_hand = 0;
+        dirty_blocks = 0;
+        pinned_blocks = 0;
+        held_blocks = 0;
+        entries.assign(capacity, CacheEntry{ -1, false, false, false, false, 0 });
+        data.assign((size_t)capacity * block_size, 0);
+        extra.clear();
+        index.clear();
+    }
+
+    bool read(long block, int offset, char* buf, int len) {
+        std::lock_guard<std::mutex> guard(lock);
+        char* cached = getBlock(block, false);
+        if (cached == nullptr)
+            return false;
+
+        memcpy(buf, cached + offset, len);
+        return true;
+    }
+
+    // With pin, the block is kept from being written back until
+    // unpinAll(), from the same step on.
+    bool write(long block, int offset, const char* buf, int len, bool pin = false) {
+        std::lock_guard<std::mutex> guard(lock);
+        // a write of the whole block doesn't need the old content.
+        char* cached = getBlock(block, offset == 0 && len == block_size);
+        if (cached == nullptr)
+            return false;
+
+        memcpy(cached + offset, buf, len);
+        markDirty(index[block]);
+        if (pin)
+            pinSlot(index[block]);
+        return true;
+    }
+
+    // Like write(), for a block whose content outside the range is not used
+    // any more: the rest of the block is zeroed, a block that isn't cached
+    // isn't read.
+    bool writeNew(long block, int offset, const char* buf, int len) {
+        std::lock_guard<std::mutex> guard(lock);
+        char* cached = getBlock(block, true);
+        if (cached == nullptr)
+            return false;
+
+        memset(cached, 0, block_size);
+        if (len > 0)
+            memcpy(cached + offset, buf, len);
+        markDirty(index[block]);
+        return true;
+    }
+
+    // The cached copy of a block, loaded if needed, kept in the cache and
+    // in place until release(). Holds of a block add up. Writes to the
+    // block still go to this copy. Returns nullptr if it can't be read.
+    const char* hold(long block) {
+        std::lock_guard<std::mutex> guard(lock);
+        char* cached = getBlock(block, false);
+        if (cached == nullptr)
+            return nullptr;
+
+        CacheEntry& entry = entries[index[block]];
+        if (entry.holds++ == 0)
+            held_blocks++;
+        return cached;
+    }
+
+    void release(long block) {
+        std::lock_guard<std::mutex> guard(lock);
+        auto it = index.find(block);
+        if (it == index.end() || entries[it->second].holds == 0)
+            return;
+        if (--entries[it->second].holds == 0)
+            held_blocks--;
+    }
+
+    // Loads the blocks of [block, block + count) that aren't cached with one
+    // disk read, ahead of their use. They enter unreferenced, so CLOCK takes
+    // them first if they are never used. Only for blocks nobody writes
+    // meanwhile: a cached block that goes while the disk is read may be
+    // newer than what was read, so blocks cached at the start are skipped.
+    bool prefetch(long block, int count) {
+        std::unique_lock<std::mutex> guard(lock);
+        while (count > 0 && index.count(block))
+            block++, count--;
+        while (count > 0 && index.count(block + count - 1))
+            count--;
+        if (count == 0)
+            return true;
+
+        std::unordered_set<long> cachedBefore;
+        for (int i = 0; i < count; i++) {
+            if (index.count(block + i))
+                cachedBefore.insert(block + i);
+        }
+        guard.unlock();
+        std::vector<char> buf((size_t)count * block_size);
+        if (!device->readAt((off_t)block * block_size, buf.data(), buf.size()))
+            return false;
+
+        guard.lock();
+        for (int i = 0; i < count; i++) {
+            if (index.count(block + i) || cachedBefore.count(block + i))
+                continue;
+
+            int slot = findVictim();
+            if (slot < 0)
+                return false;
+            memcpy(entryData(slot), &buf[(size_t)i * block_size], block_size);
+            entries[slot] = CacheEntry{ block + i, true, false, false, false, 0 };
+            index[block + i] = slot;
+            prefetched++;
+        }
+        return true;
+    }
+
+    // Reads `count` consecutive blocks with one disk read, straight into buf.
+    // Dirty cached blocks of the range are written back first, pinned ones
+    // are copied over what was read instead.
+    bool readRun(long block, int count, char* buf) {
+        struct iovec iov = { buf, (size_t)count * block_size };
+        return readRunV(block, count, &iov, 1);
+    }
+
+    // Like readRun, into the buffers of iov one after the other, which hold
+    // `count` blocks together.
+    bool readRunV(long block, int count, const struct iovec* iov, int iovcnt) {
+        std::unique_lock<std::mutex> guard(lock);
+        for (int i = 0; i < count; i++) {
+            auto it = index.find(block + i);
+            if (it != index.end() && entries[it->second].dirty && !entries[it->second].pinned
+                && !writeBack(it->second))
+                return false;
+        }
+        guard.unlock();
+        if (!device->readVAt((off_t)block * block_size, iov, iovcnt))
+            return false;
+
+        guard.lock();
+        for (int i = 0; pinned_blocks > 0 && i < count; i++) {
+            auto it = index.find(block + i);
+            if (it != index.end() && entries[it->second].pinned)
+                copyToBuffers(iov, (size_t)i * block_size, entryData(it->second));
+        }
+        return true;
+    }
+
+    // Writes `count` consecutive blocks with one disk write, cached copies of
+    // the range are updated so they stay coherent.
+    bool writeRun(long block, int count, const char* buf) {
+        if (!device->writeAt((off_t)block * block_size, buf, (size_t)count * block_size))
+            return false;
+
+        std::lock_guard<std::mutex> guard(lock);
+        for (int i = 0; i < count; i++) {
+            auto it = index.find(block + i);
+            if (it == index.end())
+                continue;
+
+            memcpy(entryData(it->second), buf + (size_t)i * block_size, block_size);
+            if (entries[it->second].dirty) {
+                entries[it->second].dirty = false;
+                dirty_blocks--;
+            }
+        }
+        return true;
+    }
+
+    // Writes every dirty block back to the disk and makes it durable.
+    bool sync() {
+        if (!flush())
+            return false;
+        return device->sync();
+    }
+
+    // Writes every dirty block that isn't pinned back to the disk, keeping
+    // them cached. Goes by block number, so runs of them are found whole.
+    bool flush() {
+        std::lock_guard<std::mutex> guard(lock);
+        std::vector<long> dirty;
+        for (CacheEntry& entry : entries) {
+            if (entry.valid && entry.dirty && !entry.pinned)
+                dirty.push_back(entry.block);
+        }
+        std::sort(dirty.begin(), dirty.end());
+        for (long block : dirty) {
+            int slot = index[block];
+            if (entries[slot].dirty && !writeBack(slot))
+                return false;
+        }
+        return true;
+    }
+
+    // Lets pinned blocks be written back again, and shrinks the cache back
+    // to its capacity, or to the last held block past it.
+    bool unpinAll() {
+        std::lock_guard<std::mutex> guard(lock);
+        for (CacheEntry& entry : entries)
+            entry.pinned = false;
+        pinned_blocks = 0;
+
+        int size = capacity;
+        for (int slot = capacity; slot < (int)entries.size(); slot++) {
+            if (!entries[slot].valid)
+                continue;
+            if (entries[slot].dirty && !writeBack(slot))
+                return false;
+            if (entries[slot].holds > 0) {
+                size = slot + 1;
+                continue;
+            }
+            index.erase(entries[slot].block);
+            entries[slot].valid = false;
+        }
+        entries.resize(size);
+        extra.resize(size - capacity);
+        clock_hand %= size;
+        return true;
+    }
+
+    long getHits() {
+        return hits;
+    }
+
+    long getMisses() {
+        return misses;
+    }
+
+    long getWritebacks() {
+        return writebacks;
+    }
+
+    // disk requests the write-backs took.
+    long getWriteRuns() {
+        return write_runs;
+    }
+
+    long getPrefetched() {
+        return prefetched;
+    }
+
+    double getHitRatio() {
+        long total = hits + misses;
+        return total == 0 ? 0 : (double)hits / total;
+    }
+
+    int getDirtyBlocks() {
+        return dirty_blocks;
+    }
+
+    int getCapacity() {
+        return capacity;
+    }
+
+    int getPinnedBlocks() {
+        return pinned_blocks;
+    }
+
+    int getHeldBlocks() {
+        return held_blocks;
+    }
+
+private:
+    char* entryData(int slot) {
+        if (slot >= capacity)
+            return extra[slot - capacity].get();
+        return &data[(size_t)slot * block_size];
+    }
+
+    // Copies a block to the byte `at` of the buffers of iov, taken one after
+    // the other.
+    void copyToBuffers(const struct iovec* iov, size_t at, const char* src) {
+        for (; at >= iov->iov_len; iov++)
+            at -= iov->iov_len;
+        for (size_t left = block_size; left > 0; iov++, at = 0) {
+            size_t n = std::min(left, iov->iov_len - at);
+            memcpy((char*)iov->iov_base + at, src, n);
+            src += n;
+            left -= n;
+        }
+    }
+
+    // Returns the cached copy of a block, loading it if needed.
+    // With skipRead, a missing block is not read from the disk because the
+    // caller is about to overwrite all of it.
+    char* getBlock(long block, bool skipRead) {
+        auto it = index.find(block);
+        if (it != index.end()) {
+            hits++;
+            entries[it->second].referenced = true;
+            return entryData(it->second);
+        }
+
+        misses++;
+        int slot = findVictim();
+        if (slot < 0)
+            return nullptr;
+
+        char* cached = entryData(slot);
+        if (!skipRead && !device->readAt((off_t)block * block_size, cached, block_size))
+            return nullptr;
+
+        entries[slot] = CacheEntry{ block, true, false, true, false, 0 };
+        index[block] = slot;
+        return cached;
+    }
+
+    // Grows the cache when no block can go. A block both pinned and held
+    // counts twice, which at worst grows it early.
+    int findVictim() {
+        if (pinned_blocks + held_blocks >= (int)entries.size()) {
+            entries.push_back(CacheEntry{ -1, false, false, false, false, 0 });
+            extra.emplace_back(new char[block_size]);
+            return entries.size() - 1;
+        }
+
+        while (true) {
+            CacheEntry& entry = entries[clock_hand];
+            int slot = clock_hand;
+            clock_hand = (clock_hand + 1) % entries.size();
+
+            if (!entry.valid)
+                return slot;
+
+            if (entry.pinned || entry.holds > 0)
+                continue;
+
+            if (entry.referenced) {
+                entry.referenced = false;
+                continue;
+            }
+
+            if (entry.dirty && !writeBack(slot))
+                return -1;
+
+            index.erase(entry.block);
+            entry.valid = false;
+            return slot;
+        }
+    }
+
+    void pinSlot(int slot) {
+        if (!entries[slot].pinned) {
+            entries[slot].pinned = true;
+            pinned_blocks++;
+        }
+    }
+
+    void markDirty(int slot) {
+        if (!entries[slot].dirty) {
+            entries[slot].dirty = true;
+            dirty_blocks++;
+        }
+    }
+
+    // Writes the block back, together with the dirty blocks that follow it
+    // on the disk, up to CACHE_MAX_WRITE_RUN of them.
+    bool writeBack(int slot) {
+        std::vector<int> run(1, slot);
+        while ((int)run.size() < CACHE_MAX_WRITE_RUN) {
+            auto it = index.find(entries[slot].block + run.size());
+            if (it == index.end() || !entries[it->second].dirty || entries[it->second].pinned)
+                break;
+            run.push_back(it->second);
+        }
+
+        bool written;
+        if (run.size() == 1)
+            written = device->writeAt((off_t)entries[slot].block * block_size, entryData(slot), block_size);
+        else {
+            std::vector<char> buf(run.size() * block_size);
+            for (size_t i = 0; i < run.size(); i++)
+                memcpy(&buf[i * block_size], entryData(run[i]), block_size);
+            written = device->writeAt((off_t)entries[slot].block * block_size, buf.data(), buf.size());
+        }
+        if (!written)
+            return false;
+
+        for (int member : run)
+            entries[member].dirty = false;
+        dirty_blocks -= run.size();
+        writebacks += run.size();
+        write_runs++;
+        return true;
+    }
+};
+
+#endif
@@ -0,0 +1,381 @@
+#ifndef BLOCK_DEVICE_H
+#define BLOCK_DEVICE_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+#include <atomic>
+#include <mutex>
+#include <shared_mutex>
+
+// how the disk image is accessed.
+#define DEVICE_PREAD 0          // pread / pwrite
+#define DEVICE_STDIO 1          // buffered stdio, fseek + fread / fwrite
+#define DEVICE_MMAP 2           // the whole image mapped into memory
+
+// access pattern hints for a range of the image.
+#define DEVICE_ADVISE_NORMAL 0
+#define DEVICE_ADVISE_SEQUENTIAL 1
+#define DEVICE_ADVISE_RANDOM 2
+
+// ============================================================================
+// BlockDevice - the disk image. With DEVICE_PREAD it is accessed only with
+//               positioned I/O (pread / pwrite), so there is no shared
+//               seek position and any byte range costs a single system call.
+//               DEVICE_STDIO goes through one FILE*, its seek position is
+//               guarded by a lock. DEVICE_MMAP maps the image, reads and
+//               writes are a memcpy; the mapping grows with the image, and
+//               sync() msyncs the range written since the last one.
+class BlockDevice {
+    int fd;
+    int backend;
+
+    FILE* file;             // DEVICE_STDIO
+    std::mutex file_lock;
+
+    char* map;              // DEVICE_MMAP
+    std::atomic<long> map_size;
+    std::shared_mutex map_lock;     // held alone while the mapping grows
+    std::mutex dirty_lock;
+    long dirty_start;       // written since the last sync(), empty when
+    long dirty_end;         // dirty_start >= dirty_end
+
+    std::atomic<long> reads;
+    std::atomic<long> writes;
+    std::atomic<long> bytes_read;
+    std::atomic<long> bytes_written;
+
+public:
+    BlockDevice(const char* path, int _backend = DEVICE_PREAD) {
+        fd = open(path, O_RDWR | O_CREAT, 0666);
+        backend = _backend;
+        file = nullptr;
+        map = nullptr;
+        map_size = 0;
+        dirty_start = 0;
+        dirty_end = 0;
+        reads = 0;
+        writes = 0;
+        bytes_read = 0;
+        bytes_written = 0;
+
+        if (fd < 0)
+            return;
+        if (backend == DEVICE_STDIO) {
+            file = fdopen(dup(fd), "r+");
+            if (file == nullptr) {
+                close(fd);
+                fd = -1;
+            }
+        }
+        else if (backend == DEVICE_MMAP) {
+            struct stat st;
+            if (fstat(fd, &st) != 0 || (st.st_size > 0 && !mapImage(st.st_size))) {
+                close(fd);
+                fd = -1;
+            }
+        }
+    }
+
+    ~BlockDevice() {
+        if (file != nullptr)
+            fclose(file);
+        if (map != nullptr)
+            munmap(map, map_size.load());
+        if (fd >= 0)
+            close(fd);
+    }
+
+    bool isOpen() {
+        return fd >= 0;
+    }
+
+    int getBackend() {
+        return backend;
+    }
+
+    // Reads len bytes at offset. Bytes past the end of the image read as zero.
+    bool readAt(off_t offset, void* buf, size_t len) {
+        reads++;
+        bytes_read += len;
+        if (backend == DEVICE_STDIO)
+            return readFile(offset, (char*)buf, len);
+        if (backend == DEVICE_MMAP)
+            return readMap(offset, (char*)buf, len);
+
+        char* out = (char*)buf;
+        while (len > 0) {
+            ssize_t ret_val = pread(fd, out, len, offset);
+            if (ret_val < 0) {
+                if (errno == EINTR)
+                    continue;
+                return false;
+            }
+            if (ret_val == 0) {
+                memset(out, 0, len);
+                return true;
+            }
+            out += ret_val;
+            offset += ret_val;
+            len -= ret_val;
+        }
+        return true;
+    }
+
+    // Like readAt, into the iovcnt buffers of iov one after the other. With
+    // DEVICE_PREAD that is one preadv.
+    bool readVAt(off_t offset, const struct iovec* iov, int iovcnt) {
+        if (backend != DEVICE_PREAD) {
+            for (int i = 0; i < iovcnt; i++) {
+                if (!readAt(offset, iov[i].iov_base, iov[i].iov_len))
+                    return false;
+                offset += iov[i].iov_len;
+            }
+            return true;
+        }
+
+        reads++;
+        for (int i = 0; i < iovcnt; i++)
+            bytes_read += iov[i].iov_len;
+        std::vector<struct iovec> left(iov, iov + iovcnt);
+        size_t first = 0;
+        while (first < left.size()) {
+            int count = std::min(left.size() - first, (size_t)IOV_MAX);
+            ssize_t ret_val = preadv(fd, &left[first], count, offset);
+            if (ret_val < 0) {
+                if (errno == EINTR)
+                    continue;
+                return false;
+            }
+            if (ret_val == 0) {
+                for (; first < left.size(); first++)
+                    memset(left[first].iov_base, 0, left[first].iov_len);
+                return true;
+            }
+            offset += ret_val;
+            while (first < left.size() && (size_t)ret_val >= left[first].iov_len) {
+                ret_val -= left[first].iov_len;
+                first++;
+            }
+            if (first < left.size()) {
+                left[first].iov_base = (char*)left[first].iov_base + ret_val;
+                left[first].iov_len -= ret_val;
+            }
+        }
+        return true;
+    }
+
+    bool writeAt(off_t offset, const void* buf, size_t len) {
+        writes++;
+        bytes_written += len;
+        if (backend == DEVICE_STDIO)
+            return writeFile(offset, (const char*)buf, len);
+        if (backend == DEVICE_MMAP)
+            return writeMap(offset, (const char*)buf, len);
+
+        const char* in = (const char*)buf;
+        while (len > 0) {
+            ssize_t ret_val = pwrite(fd, in, len, offset);
+            if (ret_val < 0) {
+                if (errno == EINTR)
+                    continue;
+                return false;
+            }
+            in += ret_val;
+            offset += ret_val;
+            len -= ret_val;
+        }
+        return true;
+    }
+
+    bool sync() {
+        if (backend == DEVICE_STDIO) {
+            std::lock_guard<std::mutex> guard(file_lock);
+            if (fflush(file) != 0)
+                return false;
+        }
+        else if (backend == DEVICE_MMAP) {
+            std::shared_lock<std::shared_mutex> mapGuard(map_lock);
+            long start;
+            long end;
+            {
+                std::lock_guard<std::mutex> guard(dirty_lock);
+                start = dirty_start;
+                end = dirty_end;
+                dirty_start = 0;
+                dirty_end = 0;
+            }
+            // msync wants a page aligned start.
+            start -= start % sysconf(_SC_PAGESIZE);
+            if (start < end && msync(map + start, end - start, MS_SYNC) != 0)
+                return false;
+        }
+        return fdatasync(fd) == 0;
+    }
+
+    // Makes [offset, offset + len) read as zeros without writing it: the
+    // range is punched out of the image file, which gives its storage back,
+    // and the image grows to cover it if it is shorter. Zeros are written
+    // where the file system can't punch holes.
+    bool discard(off_t offset, size_t len) {
+        writes++;
+        struct stat st;
+        if (fstat(fd, &st) != 0)
+            return false;
+        if (st.st_size < (off_t)(offset + len)) {
+            if (backend == DEVICE_MMAP) {
+                std::unique_lock<std::shared_mutex> guard(map_lock);
+                if (!growImage(offset + len))
+                    return false;
+            }
+            else if (ftruncate(fd, offset + len) != 0)
+                return false;
+            len = std::max((off_t)0, std::min((off_t)(offset + len), st.st_size) - offset);
+        }
+        if (len == 0)
+            return true;
+
+        // buffered writes of the range must not land after the punch.
+        std::unique_lock<std::mutex> guard(file_lock, std::defer_lock);
+        if (backend == DEVICE_STDIO) {
+            guard.lock();
+            if (fflush(file) != 0)
+                return false;
+        }
+        if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, len) == 0)
+            return true;
+        if (errno != EOPNOTSUPP && errno != ENOSYS)
+            return false;
+        if (guard.owns_lock())
+            guard.unlock();
+
+        char zeros[1 << 16] = { 0 };
+        for (size_t done = 0; done < len; done += sizeof(zeros)) {
+            if (!writeAt(offset + done, zeros, std::min(len - done, sizeof(zeros))))
+                return false;
+        }
+        return true;
+    }
+
+    // Tells the kernel how [offset, offset + len) is going to be read, for
+    // its read-ahead. madvise on a mapped image, posix_fadvise otherwise.
+    void advise(off_t offset, size_t len, int advice) {
+        if (backend == DEVICE_MMAP) {
+            std::shared_lock<std::shared_mutex> guard(map_lock);
+            long start = offset - offset % sysconf(_SC_PAGESIZE);
+            long end = std::min((long)(offset + len), map_size.load());
+            if (start < end)
+                madvise(map + start, end - start, advice == DEVICE_ADVISE_SEQUENTIAL ? MADV_SEQUENTIAL
+                    : advice == DEVICE_ADVISE_RANDOM ? MADV_RANDOM : MADV_NORMAL);
+            return;
+        }
+        posix_fadvise(fd, offset, len, advice == DEVICE_ADVISE_SEQUENTIAL ? POSIX_FADV_SEQUENTIAL
+            : advice == DEVICE_ADVISE_RANDOM ? POSIX_FADV_RANDOM : POSIX_FADV_NORMAL);
+    }
+
+    // amount of readAt / writeAt requests so far.
+    long getReads() {
+        return reads;
+    }
+
+    long getWrites() {
+        return writes;
+    }
+
+    // bytes asked for by readAt / readVAt.
+    long getBytesRead() {
+        return bytes_read;
+    }
+
+    // bytes written by writeAt, discards don't count.
+    long getBytesWritten() {
+        return bytes_written;
+    }
+
+private:
+    bool readFile(off_t offset, char* buf, size_t len) {
+        std::lock_guard<std::mutex> guard(file_lock);
+        if (fseeko(file, offset, SEEK_SET) != 0)
+            return false;
+        size_t done = fread(buf, 1, len, file);
+        if (done < len) {
+            if (ferror(file))
+                return false;
+            memset(buf + done, 0, len - done);
+        }
+        return true;
+    }
+
+    bool writeFile(off_t offset, const char* buf, size_t len) {
+        std::lock_guard<std::mutex> guard(file_lock);
+        if (fseeko(file, offset, SEEK_SET) != 0)
+            return false;
+        return fwrite(buf, 1, len, file) == len;
+    }
+
+    bool readMap(off_t offset, char* buf, size_t len) {
+        std::shared_lock<std::shared_mutex> guard(map_lock);
+        size_t mapped = offset >= map_size ? 0 : std::min((long)len, map_size - (long)offset);
+        if (mapped > 0)
+            memcpy(buf, map + offset, mapped);
+        memset(buf + mapped, 0, len - mapped);
+        return true;
+    }
+
+    bool writeMap(off_t offset, const char* buf, size_t len) {
+        if ((long)(offset + len) > map_size) {
+            std::unique_lock<std::shared_mutex> guard(map_lock);
+            if ((long)(offset + len) > map_size && !growImage(offset + len))
+                return false;
+        }
+
+        std::shared_lock<std::shared_mutex> guard(map_lock);
+        memcpy(map + offset, buf, len);
+
+        std::lock_guard<std::mutex> dirtyGuard(dirty_lock);
+        if (dirty_start >= dirty_end) {
+            dirty_start = offset;
+            dirty_end = offset + len;
+        }
+        else {
+            dirty_start = std::min(dirty_start, (long)offset);
+            dirty_end = std::max(dirty_end, (long)(offset + len));
+        }
+        return true;
+    }
+
+    // The image file becomes `size` bytes long, and mapped whole.
+    bool growImage(long size) {
+        if (ftruncate(fd, size) != 0)
+            return false;
+        if (map == nullptr)
+            return mapImage(size);
+
+        void* moved = mremap(map, map_size.load(), size, MREMAP_MAYMOVE);
+        if (moved == MAP_FAILED)
+            return false;
+        map = (char*)moved;
+        map_size = size;
+        return true;
+    }
+
+    bool mapImage(long size) {
+        void* mapped = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (mapped == MAP_FAILED)
+            return false;
+        map = (char*)mapped;
+        map_size = size;
+        return true;
+    }
+};
+
+#endif
@@ -0,0 +1,101 @@
+#ifndef CLUSTER_CACHE_H
+#define CLUSTER_CACHE_H
+
+#include <list>
+#include <vector>
+#include <memory>
+#include <unordered_map>
+#include <mutex>
+#include <atomic>
+
+// ============================================================================
+// ClusterCache - the decompressed content of recently used compressed
+//                clusters, by the disk block the cluster starts at. Holds a
+//                fixed amount of clusters and forgets the least recently
+//                used one first. A cluster is handed out as a shared
+//                pointer, so one that is forgotten stays good for whoever
+//                still has it. Every call holds the cache lock.
+class ClusterCache {
+    typedef std::shared_ptr<const std::vector<char> > Cluster;
+
+    struct Entry {
+        long block;
+        Cluster data;
+    };
+
+    int capacity;
+    std::list<Entry> lru;       // most recently used first
+    std::unordered_map<long, std::list<Entry>::iterator> index;
+    std::mutex lock;
+
+    std::atomic<long> hits;
+    std::atomic<long> misses;
+
+public:
+    ClusterCache(int _capacity) {
+        capacity = _capacity > 0 ? _capacity : 1;
+        hits = 0;
+        misses = 0;
+    }
+
+    // The cluster starting at block, or nullptr when it isn't cached.
+    Cluster lookup(long block) {
+        std::lock_guard<std::mutex> guard(lock);
+        auto it = index.find(block);
+        if (it == index.end()) {
+            misses++;
+            return nullptr;
+        }
+
+        hits++;
+        lru.splice(lru.begin(), lru, it->second);
+        return it->second->data;
+    }
+
+    void insert(long block, Cluster data) {
+        std::lock_guard<std::mutex> guard(lock);
+        auto it = index.find(block);
+        if (it != index.end()) {
+            it->second->data = data;
+            lru.splice(lru.begin(), lru, it->second);
+            return;
+        }
+
+        if ((int)lru.size() >= capacity) {
+            index.erase(lru.back().block);
+            lru.pop_back();
+        }
+        lru.push_front(Entry{ block, data });
+        index[block] = lru.begin();
+    }
+
+    void erase(long block) {
+        std::lock_guard<std::mutex> guard(lock);
+        auto it = index.find(block);
+        if (it == index.end())
+            return;
+
+        lru.erase(it->second);
+        index.erase(it);
+    }
+
+    void clear() {
+        std::lock_guard<std::mutex> guard(lock);
+        lru.clear();
+        index.clear();
+    }
+
+    int getCapacity() {
+        return capacity;
+    }
+
+    long getHits() {
+        return hits;
+    }
+
+    long getMisses() {
+        return misses;
+    }
+};
+
+#endif
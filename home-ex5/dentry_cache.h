@@ -0,0 +1,128 @@
+#ifndef DENTRY_CACHE_H
+#define DENTRY_CACHE_H
+
+#include <list>
+#include <string>
+#include <unordered_map>
+#include <mutex>
+#include <atomic>
+
+#define DENTRY_CACHE_SHARDS 16
+
+// ============================================================================
+// DentryCache - recently resolved names, (directory inode, name) -> the slot
+//               of their directory entry. Holds a fixed amount of names and
+//               forgets the least recently used one first.
+//               Names are spread over shards by their hash, each with its own
+//               lock and LRU list, so lookups of different names from several
+//               threads rarely wait for each other.
+class DentryCache {
+    struct Key {
+        int parent;
+        std::string name;
+
+        bool operator==(const Key& other) const {
+            return parent == other.parent && name == other.name;
+        }
+    };
+
+    struct KeyHash {
+        size_t operator()(const Key& key) const {
+            return std::hash<std::string>()(key.name) * 31 + key.parent;
+        }
+    };
+
+    struct Entry {
+        Key key;
+        int slot;
+    };
+
+    struct Shard {
+        std::mutex lock;
+        std::list<Entry> lru;       // most recently used first
+        std::unordered_map<Key, std::list<Entry>::iterator, KeyHash> index;
+    };
+
+    int capacity;               // of each shard
+    Shard shards[DENTRY_CACHE_SHARDS];
+
+    std::atomic<long> hits;
+    std::atomic<long> misses;
+
+public:
+    DentryCache(int _capacity) {
+        capacity = _capacity / DENTRY_CACHE_SHARDS > 0 ? _capacity / DENTRY_CACHE_SHARDS : 1;
+        hits = 0;
+        misses = 0;
+    }
+
+    bool lookup(int parent, const std::string& name, int& slot) {
+        Key key{ parent, name };
+        Shard& shard = shardOf(key);
+        std::lock_guard<std::mutex> guard(shard.lock);
+        auto it = shard.index.find(key);
+        if (it == shard.index.end()) {
+            misses++;
+            return false;
+        }
+
+        hits++;
+        shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+        slot = it->second->slot;
+        return true;
+    }
+
+    void insert(int parent, const std::string& name, int slot) {
+        Key key{ parent, name };
+        Shard& shard = shardOf(key);
+        std::lock_guard<std::mutex> guard(shard.lock);
+        auto it = shard.index.find(key);
+        if (it != shard.index.end()) {
+            it->second->slot = slot;
+            shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+            return;
+        }
+
+        if ((int)shard.lru.size() >= capacity) {
+            shard.index.erase(shard.lru.back().key);
+            shard.lru.pop_back();
+        }
+        shard.lru.push_front(Entry{ key, slot });
+        shard.index[key] = shard.lru.begin();
+    }
+
+    void erase(int parent, const std::string& name) {
+        Key key{ parent, name };
+        Shard& shard = shardOf(key);
+        std::lock_guard<std::mutex> guard(shard.lock);
+        auto it = shard.index.find(key);
+        if (it == shard.index.end())
+            return;
+
+        shard.lru.erase(it->second);
+        shard.index.erase(it);
+    }
+
+    void clear() {
+        for (Shard& shard : shards) {
+            std::lock_guard<std::mutex> guard(shard.lock);
+            shard.lru.clear();
+            shard.index.clear();
+        }
+    }
+
+    long getHits() {
+        return hits;
+    }
+
+    long getMisses() {
+        return misses;
+    }
+
+private:
+    Shard& shardOf(const Key& key) {
+        return shards[KeyHash()(key) % DENTRY_CACHE_SHARDS];
+    }
+};
+
+#endif
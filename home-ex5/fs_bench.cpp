@@ -0,0 +1,911 @@
+#include "fs_disk.h"
+
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <thread>
+
+#define BENCH_BLOCK_SIZE 16
+#define BENCH_FILE_SIZE 300
+#define BENCH_ITERATIONS 20000
+
+#define BITMAP_BENCH_BLOCKS (1 << 24)
+#define BITMAP_BENCH_FULL 0.99
+#define BITMAP_BENCH_ALLOCATIONS 1000000
+#define LINEAR_BENCH_ALLOCATIONS 2000
+
+#define SEQ_BENCH_BLOCK_SIZE 4096
+#define SEQ_BENCH_DISK_SIZE (256L << 20)
+#define SEQ_BENCH_FILE_SIZE (64 << 20)
+#define SEQ_BENCH_WRITE_SIZE (1 << 20)
+
+#define RANDOM_BENCH_READ_SIZE 4096
+#define RANDOM_BENCH_READS 100000
+#define PREFIX_BENCH_READS 200
+
+#define FD_BENCH_BLOCK_SIZE 4096
+#define FD_BENCH_DISK_SIZE (256L << 20)
+#define FD_BENCH_FILES 16000
+#define FD_BENCH_CYCLES 1000000
+
+#define DIR_BENCH_LOOKUPS 1000000
+
+#define THREAD_BENCH_MAX_THREADS 8
+#define THREAD_BENCH_FILE_SIZE (16 << 20)
+#define THREAD_BENCH_READ_SIZE (256 << 10)
+#define THREAD_BENCH_PASSES 8
+
+#define AGED_BENCH_FILES 32
+#define AGED_BENCH_FILE_SIZE (4 << 20)
+#define AGED_BENCH_APPEND_SIZE (16 << 10)
+
+#define RECORD_BENCH_FILE_SIZE (16 << 20)
+#define RECORD_BENCH_RECORD_SIZE 64
+
+#define TINY_BENCH_FILES 8000
+#define TINY_BENCH_MAX_SIZE 32
+
+#define FORMAT_BENCH_DISK_SIZE (1L << 30)
+#define FORMAT_BENCH_FILE_SIZE (512 << 20)
+
+#define SPAN_BENCH_CALL_SIZE (64 << 10)
+#define SPAN_BENCH_IOVECS 16
+#define SPAN_BENCH_HOT_SIZE (128 << 10)
+#define SPAN_BENCH_HOT_READS 1000000
+
+#define DEDUP_BENCH_FILES 32
+#define DEDUP_BENCH_FILE_SIZE (4 << 20)
+#define DEDUP_BENCH_CHANGED_BLOCKS 16
+
+#define COMPRESS_BENCH_FILE_SIZE (64 << 20)
+
+#define JOURNAL_BENCH_OPS 20000
+#define JOURNAL_BENCH_FILE_SIZE 1000
+
+double secondsSince(chrono::steady_clock::time_point start) {
+    return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+// The disk I/O of the original fsDisk: an fseek and a one byte fwrite /
+// fread on the image for every byte of the file.
+void perByteIO(FILE* image, char* data, char* readBuf, double& writeSeconds, double& readSeconds) {
+    auto start = chrono::steady_clock::now();
+    for (int i = 0; i < BENCH_FILE_SIZE; i++) {
+        int ret_val = fseek(image, i, SEEK_SET);
+        ret_val = fwrite(&data[i], 1, 1, image);
+        assert(ret_val == 1);
+    }
+    writeSeconds += secondsSince(start);
+
+    start = chrono::steady_clock::now();
+    for (int i = 0; i < BENCH_FILE_SIZE; i++) {
+        int ret_val = fseek(image, i, SEEK_SET);
+        ret_val = fread(&readBuf[i], 1, 1, image);
+        assert(ret_val == 1);
+    }
+    readSeconds += secondsSince(start);
+}
+
+// Measures file write and read throughput through the fsDisk API, against
+// the same bytes moved one at a time as the original fsDisk did.
+int benchFileIO() {
+    char data[BENCH_FILE_SIZE];
+    char readBuf[BENCH_FILE_SIZE + 1];
+    for (int i = 0; i < BENCH_FILE_SIZE; i++)
+        data[i] = 'a' + i % 26;
+
+    fsDisk* fs = new fsDisk();
+    fs->fsFormat(BENCH_BLOCK_SIZE);
+
+    double writeSeconds = 0;
+    double readSeconds = 0;
+    for (int i = 0; i < BENCH_ITERATIONS; i++) {
+        int fd = fs->CreateFile("bench");
+
+        auto start = chrono::steady_clock::now();
+        int written = fs->WriteToFile(fd, data, BENCH_FILE_SIZE);
+        writeSeconds += secondsSince(start);
+
+        start = chrono::steady_clock::now();
+        int read = fs->ReadFromFile(fd, readBuf, BENCH_FILE_SIZE);
+        readSeconds += secondsSince(start);
+
+        if (written != BENCH_FILE_SIZE || read != BENCH_FILE_SIZE || memcmp(data, readBuf, BENCH_FILE_SIZE) != 0) {
+            cerr << "ERR - bench data mismatch" << endl;
+            return 1;
+        }
+
+        fs->CloseFile(fd);
+        fs->DelFile("bench");
+    }
+
+    FILE* image = tmpfile();
+    assert(image);
+    double perByteWriteSeconds = 0;
+    double perByteReadSeconds = 0;
+    for (int i = 0; i < BENCH_ITERATIONS; i++) {
+        perByteIO(image, data, readBuf, perByteWriteSeconds, perByteReadSeconds);
+        if (memcmp(data, readBuf, BENCH_FILE_SIZE) != 0) {
+            cerr << "ERR - bench data mismatch" << endl;
+            return 1;
+        }
+    }
+    fclose(image);
+
+    double megabytes = (double)BENCH_FILE_SIZE * BENCH_ITERATIONS / (1024 * 1024);
+    cout << "write: " << megabytes / writeSeconds << " MB/s, per byte: " << megabytes / perByteWriteSeconds << " MB/s" << endl;
+    cout << "read:  " << megabytes / readSeconds << " MB/s, per byte: " << megabytes / perByteReadSeconds << " MB/s" << endl;
+    fs->printCacheStats();
+
+    delete fs;
+    return 0;
+}
+
+// Allocate / free churn on a large, nearly full bitmap, against a linear
+// scan from block 0 over an int per block.
+int benchBitmap() {
+    mt19937 rng(1);
+    BlockBitmap bitmap;
+    bitmap.reset(BITMAP_BENCH_BLOCKS);
+    vector<int> linear(BITMAP_BENCH_BLOCKS, 0);
+
+    vector<int> used;
+    for (int i = 0; i < BITMAP_BENCH_BLOCKS * BITMAP_BENCH_FULL; i++) {
+        int block = bitmap.allocate();
+        linear[block] = 1;
+        used.push_back(block);
+    }
+    shuffle(used.begin(), used.end(), rng);
+    vector<int> usedLinear = used;
+
+    auto start = chrono::steady_clock::now();
+    for (int i = 0; i < BITMAP_BENCH_ALLOCATIONS; i++) {
+        int index = rng() % used.size();
+        bitmap.clear(used[index]);
+        used[index] = bitmap.allocate();
+    }
+    double seconds = secondsSince(start);
+    cout << "bitmap allocations: " << BITMAP_BENCH_ALLOCATIONS / seconds << " /s" << endl;
+
+    start = chrono::steady_clock::now();
+    for (int i = 0; i < LINEAR_BENCH_ALLOCATIONS; i++) {
+        int index = rng() % usedLinear.size();
+        linear[usedLinear[index]] = 0;
+        int block = 0;
+        while (linear[block] != 0)
+            block++;
+        linear[block] = 1;
+        usedLinear[index] = block;
+    }
+    seconds = secondsSince(start);
+    cout << "linear allocations: " << LINEAR_BENCH_ALLOCATIONS / seconds << " /s" << endl;
+    return 0;
+}
+
+// Writes a large file in big appends and reads it back whole, once with
+// direct / indirect pointers and once with extents.
+int benchSequential(const char* name, int features) {
+    vector<char> data(SEQ_BENCH_FILE_SIZE);
+    vector<char> readBuf(SEQ_BENCH_FILE_SIZE + 1);
+    for (int i = 0; i < SEQ_BENCH_FILE_SIZE; i++)
+        data[i] = 'a' + i % 26;
+
+    fsDisk* fs = new fsDisk();
+    fs->fsFormat(SEQ_BENCH_BLOCK_SIZE, SEQ_BENCH_DISK_SIZE, features);
+    int fd = fs->CreateFile("seq");
+
+    long writes = fs->getDeviceWrites();
+    auto start = chrono::steady_clock::now();
+    for (int i = 0; i < SEQ_BENCH_FILE_SIZE; i += SEQ_BENCH_WRITE_SIZE) {
+        if (fs->WriteToFile(fd, &data[i], SEQ_BENCH_WRITE_SIZE) != SEQ_BENCH_WRITE_SIZE) {
+            cerr << "ERR - bench write failed" << endl;
+            return 1;
+        }
+    }
+    fs->sync();
+    double writeSeconds = secondsSince(start);
+    writes = fs->getDeviceWrites() - writes;
+
+    long reads = fs->getDeviceReads();
+    start = chrono::steady_clock::now();
+    int read = fs->ReadFromFile(fd, readBuf.data(), SEQ_BENCH_FILE_SIZE);
+    double readSeconds = secondsSince(start);
+    reads = fs->getDeviceReads() - reads;
+
+    if (read != SEQ_BENCH_FILE_SIZE || memcmp(data.data(), readBuf.data(), SEQ_BENCH_FILE_SIZE) != 0) {
+        cerr << "ERR - bench data mismatch" << endl;
+        return 1;
+    }
+
+    double megabytes = (double)SEQ_BENCH_FILE_SIZE / (1024 * 1024);
+    cout << name << " write: " << megabytes / writeSeconds << " MB/s, read: " << megabytes / readSeconds << " MB/s" << endl;
+    cout << name << " disk requests: " << writes << " writes, " << reads << " reads" << endl;
+
+    delete fs;
+    return 0;
+}
+
+// Small reads at random offsets of a large file with ReadAt, against
+// reading the file from its start up to the offset with ReadFromFile.
+int benchRandomRead() {
+    vector<char> data(SEQ_BENCH_FILE_SIZE);
+    vector<char> readBuf(SEQ_BENCH_FILE_SIZE + 1);
+    for (int i = 0; i < SEQ_BENCH_FILE_SIZE; i++)
+        data[i] = 'a' + i % 26;
+
+    fsDisk* fs = new fsDisk();
+    fs->fsFormat(SEQ_BENCH_BLOCK_SIZE, SEQ_BENCH_DISK_SIZE, FS_FEATURE_EXTENTS);
+    int fd = fs->CreateFile("random");
+    fs->WriteToFile(fd, data.data(), SEQ_BENCH_FILE_SIZE);
+
+    mt19937 rng(1);
+    auto start = chrono::steady_clock::now();
+    for (int i = 0; i < RANDOM_BENCH_READS; i++) {
+        long offset = rng() % (SEQ_BENCH_FILE_SIZE - RANDOM_BENCH_READ_SIZE);
+        if (fs->ReadAt(fd, offset, readBuf.data(), RANDOM_BENCH_READ_SIZE) != RANDOM_BENCH_READ_SIZE
+            || memcmp(readBuf.data(), &data[offset], RANDOM_BENCH_READ_SIZE) != 0) {
+            cerr << "ERR - bench data mismatch" << endl;
+            return 1;
+        }
+    }
+    double seconds = secondsSince(start);
+    cout << "ReadAt: " << RANDOM_BENCH_READS / seconds << " reads/s" << endl;
+
+    start = chrono::steady_clock::now();
+    for (int i = 0; i < PREFIX_BENCH_READS; i++) {
+        long offset = rng() % (SEQ_BENCH_FILE_SIZE - RANDOM_BENCH_READ_SIZE);
+        fs->ReadFromFile(fd, readBuf.data(), offset + RANDOM_BENCH_READ_SIZE);
+    }
+    seconds = secondsSince(start);
+    cout << "ReadFromFile up to the offset: " << PREFIX_BENCH_READS / seconds << " reads/s" << endl;
+
+    delete fs;
+    return 0;
+}
+
+// Close / reopen cycles while thousands of other files stay open.
+int benchDescriptors() {
+    fsDisk* fs = new fsDisk();
+    fs->fsFormat(FD_BENCH_BLOCK_SIZE, FD_BENCH_DISK_SIZE);
+
+    vector<int> fds;
+    for (int i = 0; i < FD_BENCH_FILES; i++)
+        fds.push_back(fs->CreateFile("f" + to_string(i)));
+
+    mt19937 rng(1);
+    auto start = chrono::steady_clock::now();
+    for (int i = 0; i < FD_BENCH_CYCLES; i++) {
+        int file = rng() % FD_BENCH_FILES;
+        fs->CloseFile(fds[file]);
+        fds[file] = fs->OpenFile("f" + to_string(file));
+        if (fds[file] < 0) {
+            cerr << "ERR - bench open failed" << endl;
+            return 1;
+        }
+    }
+    double seconds = secondsSince(start);
+    cout << FD_BENCH_FILES << " open files, close + open: " << FD_BENCH_CYCLES / seconds << " /s" << endl;
+
+    delete fs;
+    return 0;
+}
+
+// Name lookups (open + close) in a directory of a few entries and in one
+// of thousands, and a listing of the big one.
+int benchDirectories() {
+    fsDisk* fs = new fsDisk();
+    fs->fsFormat(FD_BENCH_BLOCK_SIZE, FD_BENCH_DISK_SIZE);
+    fs->MkDir("small");
+    fs->MkDir("big");
+
+    int sizes[] = { 16, FD_BENCH_FILES - 100 };
+    string dirs[] = { "small", "big" };
+    mt19937 rng(1);
+    for (int d = 0; d < 2; d++) {
+        for (int i = 0; i < sizes[d]; i++)
+            fs->CloseFile(fs->CreateFile(dirs[d] + "/f" + to_string(i)));
+
+        auto start = chrono::steady_clock::now();
+        for (int i = 0; i < DIR_BENCH_LOOKUPS; i++) {
+            int fd = fs->OpenFile(dirs[d] + "/f" + to_string(rng() % sizes[d]));
+            if (fd < 0) {
+                cerr << "ERR - bench open failed" << endl;
+                return 1;
+            }
+            fs->CloseFile(fd);
+        }
+        double seconds = secondsSince(start);
+        cout << sizes[d] << " entries: " << DIR_BENCH_LOOKUPS / seconds << " lookups/s" << endl;
+    }
+
+    int cookie = 0;
+    int listed = 0;
+    string name;
+    auto start = chrono::steady_clock::now();
+    while (fs->ReadDir("big", cookie, name) == 1)
+        listed++;
+    double seconds = secondsSince(start);
+    cout << "listed " << listed << " entries: " << listed / seconds << " entries/s" << endl;
+    fs->printCacheStats();
+
+    delete fs;
+    return 0;
+}
+
+// CopyFile of a large file, against reading it and writing it to a new
+// file, then a small write to the copy, which copies the block it touches.
+int benchCopy() {
+    vector<char> data(SEQ_BENCH_FILE_SIZE);
+    for (int i = 0; i < SEQ_BENCH_FILE_SIZE; i++)
+        data[i] = 'a' + i % 26;
+
+    fsDisk* fs = new fsDisk();
+    fs->fsFormat(SEQ_BENCH_BLOCK_SIZE, SEQ_BENCH_DISK_SIZE, FS_FEATURE_EXTENTS);
+    int fd = fs->CreateFile("src");
+    fs->WriteToFile(fd, data.data(), SEQ_BENCH_FILE_SIZE);
+    fs->CloseFile(fd);
+    fs->sync();
+
+    auto start = chrono::steady_clock::now();
+    if (fs->CopyFile("src", "reflink") < 0) {
+        cerr << "ERR - bench copy failed" << endl;
+        return 1;
+    }
+    fs->sync();
+    double seconds = secondsSince(start);
+    cout << "CopyFile: " << seconds * 1000 << " ms" << endl;
+
+    vector<char> readBuf(SEQ_BENCH_FILE_SIZE + 1);
+    start = chrono::steady_clock::now();
+    int src = fs->OpenFile("src");
+    int dest = fs->CreateFile("copy");
+    fs->ReadFromFile(src, readBuf.data(), SEQ_BENCH_FILE_SIZE);
+    fs->WriteToFile(dest, readBuf.data(), SEQ_BENCH_FILE_SIZE);
+    fs->sync();
+    seconds = secondsSince(start);
+    cout << "read + write: " << seconds * 1000 << " ms" << endl;
+
+    int copy = fs->OpenFile("reflink");
+    char patch[] = "patched";
+    start = chrono::steady_clock::now();
+    fs->WriteAt(copy, SEQ_BENCH_FILE_SIZE / 2, patch, strlen(patch));
+    seconds = secondsSince(start);
+    cout << "first write to the copy: " << seconds * 1000000 << " us" << endl;
+
+    fs->ReadAt(src, 0, readBuf.data(), SEQ_BENCH_FILE_SIZE);
+    if (memcmp(data.data(), readBuf.data(), SEQ_BENCH_FILE_SIZE) != 0) {
+        cerr << "ERR - bench source changed" << endl;
+        return 1;
+    }
+
+    delete fs;
+    return 0;
+}
+
+// Small files created, written, closed and deleted: without the journal
+// and nothing made durable, without it and a sync() after each file, and
+// with it, committing in batches.
+int benchJournal(const char* name, int features, bool syncEach) {
+    fsDisk* fs = new fsDisk();
+    fs->fsFormat(FD_BENCH_BLOCK_SIZE, FD_BENCH_DISK_SIZE, features | FS_FEATURE_EXTENTS);
+    string data(JOURNAL_BENCH_FILE_SIZE, 'j');
+    int ops = syncEach ? JOURNAL_BENCH_OPS / 10 : JOURNAL_BENCH_OPS;
+
+    auto start = chrono::steady_clock::now();
+    for (int i = 0; i < ops; i++) {
+        int fd = fs->CreateFile("f" + to_string(i));
+        if (fd < 0 || fs->WriteToFile(fd, &data[0], data.size()) != (int)data.size()) {
+            cerr << "ERR - bench write failed" << endl;
+            return 1;
+        }
+        fs->CloseFile(fd);
+        if (i >= 50)
+            fs->DelFile("f" + to_string(i - 50));
+        if (syncEach)
+            fs->sync();
+    }
+    fs->sync();
+    double seconds = secondsSince(start);
+    cout << name << ": " << ops / seconds << " files/s, " << fs->getJournalCommits() << " commits" << endl;
+
+    delete fs;
+    return 0;
+}
+
+// Threads reading files of their own with ReadAt, 1 to 8 of them at once.
+// The total is the same for every amount of threads, so the rate shows how
+// the reads spread over the cores.
+int benchThreads() {
+    vector<char> data(THREAD_BENCH_FILE_SIZE);
+    for (int i = 0; i < THREAD_BENCH_FILE_SIZE; i++)
+        data[i] = 'a' + i % 26;
+
+    fsDisk* fs = new fsDisk();
+    fs->fsFormat(SEQ_BENCH_BLOCK_SIZE, SEQ_BENCH_DISK_SIZE, FS_FEATURE_EXTENTS);
+    vector<int> fds;
+    for (int i = 0; i < THREAD_BENCH_MAX_THREADS; i++) {
+        fds.push_back(fs->CreateFile("t" + to_string(i)));
+        fs->WriteToFile(fds.back(), data.data(), THREAD_BENCH_FILE_SIZE);
+    }
+    fs->sync();
+
+    cout << thread::hardware_concurrency() << " cores" << endl;
+    long total = (long)THREAD_BENCH_MAX_THREADS * THREAD_BENCH_PASSES * THREAD_BENCH_FILE_SIZE;
+    for (int threads = 1; threads <= THREAD_BENCH_MAX_THREADS; threads *= 2) {
+        long perThread = total / threads;
+        atomic<bool> failed(false);
+        vector<thread> workers;
+        auto start = chrono::steady_clock::now();
+        for (int t = 0; t < threads; t++) {
+            workers.emplace_back([&, t]() {
+                vector<char> buf(THREAD_BENCH_READ_SIZE);
+                for (long done = 0; done < perThread; done += THREAD_BENCH_READ_SIZE) {
+                    long offset = done % THREAD_BENCH_FILE_SIZE;
+                    if (fs->ReadAt(fds[t], offset, buf.data(), THREAD_BENCH_READ_SIZE) != THREAD_BENCH_READ_SIZE)
+                        failed = true;
+                }
+            });
+        }
+        for (thread& worker : workers)
+            worker.join();
+        double seconds = secondsSince(start);
+        if (failed) {
+            cerr << "ERR - bench read failed" << endl;
+            return 1;
+        }
+        cout << threads << " threads: " << total / seconds / (1024 * 1024) << " MB/s" << endl;
+    }
+
+    delete fs;
+    return 0;
+}
+
+// The same workload on each way of accessing the disk image: a large file
+// written and read back in 1MB calls, then random 4KB reads of it.
+int benchDevice(const char* name, int backend) {
+    vector<char> data(SEQ_BENCH_FILE_SIZE);
+    vector<char> readBuf(SEQ_BENCH_WRITE_SIZE);
+    for (int i = 0; i < SEQ_BENCH_FILE_SIZE; i++)
+        data[i] = 'a' + i % 26;
+
+    remove(DISK_SIM_FILE);
+    fsDisk* fs = new fsDisk(DEFAULT_CACHE_BLOCKS, backend);
+    fs->fsFormat(SEQ_BENCH_BLOCK_SIZE, SEQ_BENCH_DISK_SIZE, FS_FEATURE_EXTENTS);
+    int fd = fs->CreateFile("device");
+
+    auto start = chrono::steady_clock::now();
+    for (int i = 0; i < SEQ_BENCH_FILE_SIZE; i += SEQ_BENCH_WRITE_SIZE)
+        fs->WriteToFile(fd, &data[i], SEQ_BENCH_WRITE_SIZE);
+    fs->sync();
+    double writeSeconds = secondsSince(start);
+
+    fs->AdviseFile(fd, DEVICE_ADVISE_SEQUENTIAL);
+    start = chrono::steady_clock::now();
+    for (int i = 0; i < SEQ_BENCH_FILE_SIZE; i += SEQ_BENCH_WRITE_SIZE) {
+        if (fs->ReadAt(fd, i, readBuf.data(), SEQ_BENCH_WRITE_SIZE) != SEQ_BENCH_WRITE_SIZE
+            || memcmp(readBuf.data(), &data[i], SEQ_BENCH_WRITE_SIZE) != 0) {
+            cerr << "ERR - bench data mismatch" << endl;
+            return 1;
+        }
+    }
+    double readSeconds = secondsSince(start);
+
+    fs->AdviseFile(fd, DEVICE_ADVISE_RANDOM);
+    mt19937 rng(1);
+    start = chrono::steady_clock::now();
+    for (int i = 0; i < RANDOM_BENCH_READS; i++) {
+        long offset = rng() % (SEQ_BENCH_FILE_SIZE - RANDOM_BENCH_READ_SIZE);
+        fs->ReadAt(fd, offset, readBuf.data(), RANDOM_BENCH_READ_SIZE);
+    }
+    double randomSeconds = secondsSince(start);
+
+    double megabytes = (double)SEQ_BENCH_FILE_SIZE / (1024 * 1024);
+    cout << name << ": write " << megabytes / writeSeconds << " MB/s, read " << megabytes / readSeconds
+        << " MB/s, 4KB ReadAt " << RANDOM_BENCH_READS / randomSeconds << " reads/s" << endl;
+
+    delete fs;
+    return 0;
+}
+
+// Ages an image the way logs and downloads do: files growing side by side
+// in small appends, then every third one deleted and replaced by a new one
+// that grows in the holes. Then every file is read back sequentially, cold.
+int benchAged(const char* name, int features) {
+    vector<char> data(AGED_BENCH_APPEND_SIZE);
+    vector<char> readBuf(SEQ_BENCH_WRITE_SIZE);
+    for (int i = 0; i < AGED_BENCH_APPEND_SIZE; i++)
+        data[i] = 'a' + i % 26;
+
+    fsDisk* fs = new fsDisk();
+    fs->fsFormat(SEQ_BENCH_BLOCK_SIZE, SEQ_BENCH_DISK_SIZE, features);
+
+    vector<string> files;
+    vector<string> growing;
+    for (int i = 0; i < AGED_BENCH_FILES; i++)
+        growing.push_back("aged" + to_string(i));
+    for (int round = 0; round < 2; round++) {
+        vector<int> fds;
+        for (string& file : growing)
+            fds.push_back(fs->CreateFile(file));
+        for (long done = 0; done < AGED_BENCH_FILE_SIZE; done += AGED_BENCH_APPEND_SIZE) {
+            for (int fd : fds)
+                fs->WriteToFile(fd, data.data(), AGED_BENCH_APPEND_SIZE);
+        }
+        for (int fd : fds)
+            fs->CloseFile(fd);
+        files.insert(files.end(), growing.begin(), growing.end());
+
+        growing.clear();
+        for (int i = 0; round == 0 && i < (int)files.size(); i += 3) {
+            fs->DelFile(files[i]);
+            growing.push_back(files[i] + "b");
+        }
+        for (int i = 0; round == 0 && i < (int)growing.size(); i++)
+            files.erase(find(files.begin(), files.end(), growing[i].substr(0, growing[i].size() - 1)));
+    }
+    fs->sync();
+    delete fs;
+
+    fs = new fsDisk();
+    long deviceReads = fs->getDeviceReads();
+    long total = 0;
+    auto start = chrono::steady_clock::now();
+    for (string& file : files) {
+        int fd = fs->OpenFile(file);
+        for (long offset = 0; offset < AGED_BENCH_FILE_SIZE; offset += SEQ_BENCH_WRITE_SIZE) {
+            if (fs->ReadAt(fd, offset, readBuf.data(), SEQ_BENCH_WRITE_SIZE) != SEQ_BENCH_WRITE_SIZE) {
+                cerr << "ERR - bench read failed" << endl;
+                return 1;
+            }
+            total += SEQ_BENCH_WRITE_SIZE;
+        }
+        fs->CloseFile(fd);
+    }
+    double seconds = secondsSince(start);
+    deviceReads = fs->getDeviceReads() - deviceReads;
+
+    cout << name << ": read " << total / seconds / (1024 * 1024) << " MB/s, " << deviceReads << " disk reads" << endl;
+    fs->printFragmentation(false);
+
+    delete fs;
+    return 0;
+}
+
+// Many small appends to one file, then the file read back in records of
+// the same size, with the disk requests each side took.
+int benchRecords(const char* name, int features) {
+    char record[RECORD_BENCH_RECORD_SIZE];
+    char readBuf[RECORD_BENCH_RECORD_SIZE];
+    for (int i = 0; i < RECORD_BENCH_RECORD_SIZE; i++)
+        record[i] = 'a' + i % 26;
+
+    fsDisk* fs = new fsDisk();
+    fs->fsFormat(SEQ_BENCH_BLOCK_SIZE, SEQ_BENCH_DISK_SIZE, features);
+    int fd = fs->CreateFile("records");
+
+    long deviceWrites = fs->getDeviceWrites();
+    auto start = chrono::steady_clock::now();
+    for (long done = 0; done < RECORD_BENCH_FILE_SIZE; done += RECORD_BENCH_RECORD_SIZE)
+        fs->WriteToFile(fd, record, RECORD_BENCH_RECORD_SIZE);
+    fs->sync();
+    double writeSeconds = secondsSince(start);
+    deviceWrites = fs->getDeviceWrites() - deviceWrites;
+
+    fs->CloseFile(fd);
+    delete fs;
+    fs = new fsDisk();
+    fd = fs->OpenFile("records");
+
+    long deviceReads = fs->getDeviceReads();
+    start = chrono::steady_clock::now();
+    for (long done = 0; done < RECORD_BENCH_FILE_SIZE; done += RECORD_BENCH_RECORD_SIZE) {
+        if (fs->Read(fd, readBuf, RECORD_BENCH_RECORD_SIZE) != RECORD_BENCH_RECORD_SIZE
+            || memcmp(readBuf, record, RECORD_BENCH_RECORD_SIZE) != 0) {
+            cerr << "ERR - bench data mismatch" << endl;
+            return 1;
+        }
+    }
+    double readSeconds = secondsSince(start);
+    deviceReads = fs->getDeviceReads() - deviceReads;
+
+    long records = RECORD_BENCH_FILE_SIZE / RECORD_BENCH_RECORD_SIZE;
+    cout << name << ": " << records / writeSeconds << " appends/s (" << deviceWrites << " disk writes), "
+        << records / readSeconds << " reads/s (" << deviceReads << " disk reads)" << endl;
+
+    delete fs;
+    return 0;
+}
+
+// A namespace of config and marker files of a few bytes each: created,
+// then read back cold, with the blocks they took and the disk reads.
+int benchTiny(const char* name, int features) {
+    char data[TINY_BENCH_MAX_SIZE];
+    char readBuf[TINY_BENCH_MAX_SIZE + 1];
+    for (int i = 0; i < TINY_BENCH_MAX_SIZE; i++)
+        data[i] = 'a' + i % 26;
+
+    fsDisk* fs = new fsDisk();
+    fs->fsFormat(SEQ_BENCH_BLOCK_SIZE, SEQ_BENCH_DISK_SIZE, features);
+    fs->MkDir("etc");
+
+    auto start = chrono::steady_clock::now();
+    for (int i = 0; i < TINY_BENCH_FILES; i++) {
+        int fd = fs->CreateFile("etc/conf" + to_string(i));
+        fs->WriteToFile(fd, data, i % (TINY_BENCH_MAX_SIZE + 1));
+        fs->CloseFile(fd);
+    }
+    fs->sync();
+    double writeSeconds = secondsSince(start);
+    delete fs;
+
+    fs = new fsDisk();
+    long deviceReads = fs->getDeviceReads();
+    start = chrono::steady_clock::now();
+    for (int i = 0; i < TINY_BENCH_FILES; i++) {
+        int fd = fs->OpenFile("etc/conf" + to_string(i));
+        int size = i % (TINY_BENCH_MAX_SIZE + 1);
+        if (fs->ReadFromFile(fd, readBuf, TINY_BENCH_MAX_SIZE) != size || memcmp(readBuf, data, size) != 0) {
+            cerr << "ERR - bench data mismatch" << endl;
+            return 1;
+        }
+        fs->CloseFile(fd);
+    }
+    double readSeconds = secondsSince(start);
+    deviceReads = fs->getDeviceReads() - deviceReads;
+
+    cout << name << ": " << TINY_BENCH_FILES / writeSeconds << " files written/s, "
+        << TINY_BENCH_FILES / readSeconds << " files read/s (" << deviceReads << " disk reads)" << endl;
+    fs->printFragmentation(false);
+
+    delete fs;
+    return 0;
+}
+
+// Formats a large image, then deletes a file that fills half of it. Its
+// blocks are preallocated, so only the mapping is written.
+int benchFormat(const char* name, int features) {
+    fsDisk* fs = new fsDisk();
+    auto start = chrono::steady_clock::now();
+    fs->fsFormat(SEQ_BENCH_BLOCK_SIZE, FORMAT_BENCH_DISK_SIZE, features);
+    double formatSeconds = secondsSince(start);
+
+    int fd = fs->CreateFile("big");
+    if (fs->Preallocate(fd, FORMAT_BENCH_FILE_SIZE) < 0) {
+        cerr << "ERR - bench preallocate failed" << endl;
+        return 1;
+    }
+    fs->CloseFile(fd);
+    fs->sync();
+
+    start = chrono::steady_clock::now();
+    fs->DelFile("big");
+    fs->sync();
+    double deleteSeconds = secondsSince(start);
+
+    cout << name << ": format " << formatSeconds * 1000 << " ms, delete of "
+        << (FORMAT_BENCH_FILE_SIZE >> 20) << "MB " << deleteSeconds * 1000 << " ms" << endl;
+    delete fs;
+    return 0;
+}
+
+// A 64MB file read front to back in 64KB calls with ReadAt, with ReadVAt
+// into 16 buffers of 4KB and with ReadSpans, then 4KB reads at random
+// offsets of a cached 128KB region with ReadAt and with ReadSpans.
+int benchSpans() {
+    vector<char> data(SEQ_BENCH_FILE_SIZE);
+    vector<char> readBuf(SPAN_BENCH_CALL_SIZE);
+    for (int i = 0; i < SEQ_BENCH_FILE_SIZE; i++)
+        data[i] = 'a' + i % 26;
+
+    fsDisk* fs = new fsDisk();
+    fs->fsFormat(SEQ_BENCH_BLOCK_SIZE, SEQ_BENCH_DISK_SIZE, FS_FEATURE_EXTENTS);
+    int fd = fs->CreateFile("spans");
+    fs->WriteToFile(fd, data.data(), SEQ_BENCH_FILE_SIZE);
+
+    struct iovec iov[SPAN_BENCH_IOVECS];
+    int iovSize = SPAN_BENCH_CALL_SIZE / SPAN_BENCH_IOVECS;
+    for (int i = 0; i < SPAN_BENCH_IOVECS; i++) {
+        iov[i].iov_base = readBuf.data() + i * iovSize;
+        iov[i].iov_len = iovSize;
+    }
+
+    const char* names[] = { "ReadAt", "ReadVAt", "ReadSpans" };
+    for (int method = 0; method < 3; method++) {
+        auto start = chrono::steady_clock::now();
+        for (long offset = 0; offset < SEQ_BENCH_FILE_SIZE; ) {
+            vector<fsSpan> spans;
+            int got;
+            if (method == 0)
+                got = fs->ReadAt(fd, offset, readBuf.data(), SPAN_BENCH_CALL_SIZE);
+            else if (method == 1)
+                got = fs->ReadVAt(fd, offset, iov, SPAN_BENCH_IOVECS);
+            else
+                got = fs->ReadSpans(fd, offset, SPAN_BENCH_CALL_SIZE, spans);
+            bool same = got > 0;
+            long at = offset;
+            for (fsSpan& span : spans) {
+                same = same && memcmp(span.data(), &data[at], span.len) == 0;
+                at += span.len;
+            }
+            if (method < 2)
+                same = same && memcmp(readBuf.data(), &data[offset], got) == 0;
+            fs->ReleaseSpans(spans);
+            if (!same) {
+                cerr << "ERR - bench data mismatch" << endl;
+                return 1;
+            }
+            offset += got;
+        }
+        double seconds = secondsSince(start);
+        cout << names[method] << ", 64KB calls: " << SEQ_BENCH_FILE_SIZE / seconds / (1 << 20) << " MB/s" << endl;
+    }
+
+    mt19937 rng(1);
+    for (int method = 0; method < 3; method += 2) {
+        auto start = chrono::steady_clock::now();
+        long sum = 0;
+        for (int i = 0; i < SPAN_BENCH_HOT_READS; i++) {
+            long offset = rng() % (SPAN_BENCH_HOT_SIZE - RANDOM_BENCH_READ_SIZE);
+            if (method == 0) {
+                fs->ReadAt(fd, offset, readBuf.data(), RANDOM_BENCH_READ_SIZE);
+                sum += readBuf[0];
+                continue;
+            }
+            vector<fsSpan> spans;
+            fs->ReadSpans(fd, offset, RANDOM_BENCH_READ_SIZE, spans);
+            sum += spans[0].data()[0];
+            fs->ReleaseSpans(spans);
+        }
+        double seconds = secondsSince(start);
+        if (sum == 0)
+            cerr << "ERR - bench data mismatch" << endl;
+        cout << names[method] << ", cached 4KB reads: " << SPAN_BENCH_HOT_READS / seconds << " reads/s" << endl;
+    }
+
+    delete fs;
+    return 0;
+}
+
+// Near-identical files: each a copy of the same 4MB with 16 blocks of its
+// own, written in 64KB calls. Reports the blocks they took and the bytes
+// that went to the image.
+int benchDedup(const char* name, int features) {
+    vector<char> data(DEDUP_BENCH_FILE_SIZE);
+    mt19937 rng(1);
+    for (char& c : data)
+        c = 'a' + rng() % 26;
+
+    fsDisk* fs = new fsDisk();
+    fs->fsFormat(SEQ_BENCH_BLOCK_SIZE, SEQ_BENCH_DISK_SIZE, features);
+    long freeBlocks = fs->getFreeBlocks();
+    long bytesWritten = fs->getDeviceBytesWritten();
+
+    auto start = chrono::steady_clock::now();
+    for (int i = 0; i < DEDUP_BENCH_FILES; i++) {
+        vector<char> file = data;
+        for (int k = 0; k < DEDUP_BENCH_CHANGED_BLOCKS; k++) {
+            long block = rng() % (DEDUP_BENCH_FILE_SIZE / SEQ_BENCH_BLOCK_SIZE);
+            memcpy(&file[block * SEQ_BENCH_BLOCK_SIZE], &i, sizeof(i));
+        }
+        int fd = fs->CreateFile("copy" + to_string(i));
+        for (long offset = 0; offset < DEDUP_BENCH_FILE_SIZE; offset += SPAN_BENCH_CALL_SIZE) {
+            if (fs->WriteToFile(fd, &file[offset], SPAN_BENCH_CALL_SIZE) != SPAN_BENCH_CALL_SIZE) {
+                cerr << "ERR - bench write failed" << endl;
+                return 1;
+            }
+        }
+        fs->CloseFile(fd);
+    }
+    fs->sync();
+    double seconds = secondsSince(start);
+
+    long total = (long)DEDUP_BENCH_FILES * DEDUP_BENCH_FILE_SIZE;
+    long used = freeBlocks - fs->getFreeBlocks();
+    bytesWritten = fs->getDeviceBytesWritten() - bytesWritten;
+    cout << name << ": " << total / seconds / (1 << 20) << " MB/s, " << used << " blocks used ("
+        << total / SEQ_BENCH_BLOCK_SIZE << " written), " << (bytesWritten >> 20) << "MB to the disk, "
+        << fs->getDedupedBlocks() << " blocks deduped" << endl;
+    delete fs;
+    return 0;
+}
+
+// A 64MB file of text made of a small vocabulary, written in 64KB calls,
+// then read back cold in 1MB calls. Reports MB/s of the file's bytes both
+// ways and the blocks it covers per block it took.
+int benchCompress(const char* name, int features) {
+    const char* words[] = { "the ", "file ", "system ", "block ", "cluster ", "of ", "a ", "compressed ", "read ",
+        "write ", "disk ", "cache ", "\n" };
+    vector<char> data;
+    mt19937 rng(1);
+    while ((long)data.size() < COMPRESS_BENCH_FILE_SIZE) {
+        const char* word = words[rng() % (sizeof(words) / sizeof(words[0]))];
+        data.insert(data.end(), word, word + strlen(word));
+    }
+    data.resize(COMPRESS_BENCH_FILE_SIZE);
+
+    fsDisk* fs = new fsDisk();
+    fs->fsFormat(SEQ_BENCH_BLOCK_SIZE, SEQ_BENCH_DISK_SIZE, features);
+    long freeBlocks = fs->getFreeBlocks();
+    auto start = chrono::steady_clock::now();
+    int fd = fs->CreateFile("text");
+    for (long offset = 0; offset < COMPRESS_BENCH_FILE_SIZE; offset += SPAN_BENCH_CALL_SIZE) {
+        if (fs->WriteToFile(fd, &data[offset], SPAN_BENCH_CALL_SIZE) != SPAN_BENCH_CALL_SIZE) {
+            cerr << "ERR - bench write failed" << endl;
+            return 1;
+        }
+    }
+    fs->CloseFile(fd);
+    fs->sync();
+    double writeSeconds = secondsSince(start);
+    long used = freeBlocks - fs->getFreeBlocks();
+    delete fs;
+
+    fs = new fsDisk();
+    vector<char> readBuf(SEQ_BENCH_WRITE_SIZE);
+    start = chrono::steady_clock::now();
+    fd = fs->OpenFile("text");
+    for (long offset = 0; offset < COMPRESS_BENCH_FILE_SIZE; offset += SEQ_BENCH_WRITE_SIZE) {
+        if (fs->ReadAt(fd, offset, readBuf.data(), SEQ_BENCH_WRITE_SIZE) != SEQ_BENCH_WRITE_SIZE
+            || memcmp(readBuf.data(), &data[offset], SEQ_BENCH_WRITE_SIZE) != 0) {
+            cerr << "ERR - bench read failed" << endl;
+            return 1;
+        }
+    }
+    fs->CloseFile(fd);
+    double readSeconds = secondsSince(start);
+
+    cout << name << ": write " << COMPRESS_BENCH_FILE_SIZE / writeSeconds / (1 << 20) << " MB/s, read "
+        << COMPRESS_BENCH_FILE_SIZE / readSeconds / (1 << 20) << " MB/s, ratio "
+        << (double)COMPRESS_BENCH_FILE_SIZE / SEQ_BENCH_BLOCK_SIZE / used << " (" << used << " blocks)" << endl;
+    delete fs;
+    return 0;
+}
+
+// usage: fs_bench [io | bitmap | seq | random | fd | dir | copy | journal | threads | device | records | aged | tiny | format | spans | dedup | compress]
+int main(int argc, char* argv[]) {
+    string bench = argc > 1 ? argv[1] : "io";
+
+    if (bench == "io")
+        return benchFileIO();
+    if (bench == "bitmap")
+        return benchBitmap();
+    if (bench == "seq")
+        return benchSequential("pointers", 0) || benchSequential("extents", FS_FEATURE_EXTENTS);
+    if (bench == "random")
+        return benchRandomRead();
+    if (bench == "fd")
+        return benchDescriptors();
+    if (bench == "dir")
+        return benchDirectories();
+    if (bench == "copy")
+        return benchCopy();
+    if (bench == "journal")
+        return benchJournal("no journal", 0, false) || benchJournal("no journal, sync each", 0, true)
+            || benchJournal("journal", FS_FEATURE_JOURNAL, false);
+    if (bench == "threads")
+        return benchThreads();
+    if (bench == "device")
+        return benchDevice("stdio", DEVICE_STDIO) || benchDevice("pread", DEVICE_PREAD)
+            || benchDevice("mmap", DEVICE_MMAP);
+    if (bench == "records")
+        return benchRecords("pointers", 0) || benchRecords("extents", FS_FEATURE_EXTENTS);
+    if (bench == "aged")
+        return benchAged("pointers", 0) || benchAged("extents", FS_FEATURE_EXTENTS);
+    if (bench == "tiny")
+        return benchTiny("blocks", 0) || benchTiny("inline", FS_FEATURE_INLINE);
+    if (bench == "format")
+        return benchFormat("pointers", 0) || benchFormat("extents", FS_FEATURE_EXTENTS)
+            || benchFormat("pointers, journal", FS_FEATURE_JOURNAL);
+    if (bench == "spans")
+        return benchSpans();
+    if (bench == "dedup")
+        return benchDedup("extents", FS_FEATURE_EXTENTS) || benchDedup("extents, dedup", FS_FEATURE_EXTENTS | FS_FEATURE_DEDUP)
+            || benchDedup("pointers, dedup", FS_FEATURE_DEDUP);
+    if (bench == "compress")
+        return benchCompress("extents", FS_FEATURE_EXTENTS)
+            || benchCompress("extents, compressed", FS_FEATURE_EXTENTS | FS_FEATURE_COMPRESS)
+            || benchCompress("pointers, compressed", FS_FEATURE_COMPRESS);
+
+    cerr << "usage: fs_bench [io | bitmap | seq | random | fd | dir | copy | journal | threads | device | records | aged | tiny | format | spans | dedup | compress]" << endl;
+    return 1;
+}
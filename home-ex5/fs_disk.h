@@ -0,0 +1,4843 @@
+#ifndef FS_DISK_H
+#define FS_DISK_H
+
+#include <iostream>
+#include <vector>
+#include <queue>
+#include <map>
+#include <set>
+#include <unordered_map>
+#include <algorithm>
+#include <assert.h>
+#include <string.h>
+#include <cmath>
+#include <sys/types.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <atomic>
+#include <mutex>
+#include <shared_mutex>
+#include <condition_variable>
+
+#include "block_device.h"
+#include "block_cache.h"
+#include "block_bitmap.h"
+#include "dentry_cache.h"
+#include "cluster_cache.h"
+#include "lz_codec.h"
+#include "journal.h"
+
+using namespace std;
+
+#define DISK_SIZE 512           // default size of the data region
+#define DIRECT_BLOCKS 3
+#define DEFAULT_CACHE_BLOCKS 64
+#define LIST_CHUNK_SIZE (1 << 20)
+#define DEFAULT_DENTRY_CACHE 4096
+#define DEFAULT_CLUSTER_CACHE 64
+
+// ============================================================================
+// On-disk layout of the disk image, every region starts on a block boundary:
+//
+//   | superblock | free bitmap | inode table | directory | ref counts | fingerprints | clusters | journal | data blocks |
+//
+// The size of the data region is chosen at format time. Block numbers kept
+// in inodes and in pointer blocks are relative to its start.
+//
+// Pointer blocks hold block numbers of pointer_size bytes, the smallest of
+// 1, 2 or 4 bytes that addresses every data block. An entry stores the block
+// number plus one, so a zero entry is an unused one.
+//
+// With FS_FEATURE_EXTENTS, files map their blocks with extents instead:
+// runs of (logical block, physical block, length). Up to FS_ROOT_EXTENTS
+// sit in the inode, more are kept in a tree of blocks, each starting with
+// an fsExtentHeader followed by entries. Entries of leaves (depth 0) are
+// extents, entries of index nodes hold the first logical block of a child
+// and the child's block number in `physical`.
+//
+// The directory region is one hash table of fsDirEntry slots for the whole
+// disk, keyed by (directory inode, name) and probed linearly. It has at
+// least twice as many slots as there are inodes, and removal shifts the
+// entries after the removed one back (no tombstones), so probes stay short.
+// The entries of one directory are also linked through next / prev,
+// starting at the directory's first_entry, so a directory is listed without
+// walking the table. Inode 0 is the root directory.
+//
+// The reference count table has a uint16_t per data block: how many files
+// refer to the block beyond the first one. CopyFile shares the blocks of
+// the source instead of copying them, and a file copies a shared block
+// only when it writes to it. Zero for every block nobody shares, so files
+// that were never copied don't look at the table at all.
+//
+// With FS_FEATURE_DEDUP, the fingerprint table has a uint64_t per data
+// block: the hash of the block's content, or 0 for a block that isn't in
+// the dedup index. A block written whole whose content is already in an
+// indexed block is mapped to that block, with a reference count, instead
+// of being written. Every file of such a disk is FS_INODE_SHARED.
+//
+// With FS_FEATURE_COMPRESS, files are FS_INODE_COMPRESSED and are written
+// a cluster of FS_CLUSTER_BLOCKS blocks at a time. A cluster that
+// compresses into fewer blocks is stored as an fsClusterHeader followed by
+// the LZ stream (lz_codec.h), in the first blocks of the cluster's range,
+// the rest of the range is a hole. Any other cluster is stored as it is.
+// The cluster bitmap has a bit per data block, set for the first block of
+// every compressed cluster, so the mapping of the file stays as it is.
+//
+// With FS_FEATURE_JOURNAL, every metadata block an operation changes (the
+// regions above, pointer blocks and extent tree blocks) goes to the
+// journal before it is written in place, see journal.h. File data is not
+// journaled, after a crash the metadata is consistent but the last data
+// written may be missing.
+//
+// With FS_FEATURE_INLINE, a file of up to inline_size bytes keeps its data
+// in its inode record, where the pointers or the extent root would be, and
+// has no blocks. It moves to blocks when it grows past that.
+#define FS_MAGIC 0x4d495346
+#define FS_VERSION 9
+
+#define FS_FEATURE_EXTENTS 1
+#define FS_FEATURE_JOURNAL 2
+#define FS_FEATURE_INLINE 4
+#define FS_FEATURE_DEDUP 8
+#define FS_FEATURE_COMPRESS 16
+
+#define FS_SUPERBLOCK_SIZE 128
+#define FS_INODE_SIZE 64
+#define FS_DIR_ENTRY_SIZE 64
+#define FS_NAME_LEN (FS_DIR_ENTRY_SIZE - 20)
+// the inode table has a record per FS_BYTES_PER_INODE of data, but at least
+// one per data block up to FS_MIN_INODES, so the small disks of the exercise
+// don't run out of inodes before they run out of blocks.
+#define FS_MIN_INODES 1024
+#define FS_BYTES_PER_INODE 16384
+
+#define FS_INODE_FREE 0
+#define FS_INODE_FILE 1
+#define FS_INODE_DIR 2
+
+#define FS_ROOT_INODE 0
+
+#define FS_DIR_SLOT_FREE 0
+#define FS_DIR_SLOT_USED 1
+
+#define FS_INODE_EXTENTS 1      // inode flag, blocks are mapped by extents
+#define FS_INODE_SHARED 2       // inode flag, blocks may be shared with other files
+#define FS_INODE_INLINE 4       // inode flag, the data is in the record
+#define FS_INODE_COMPRESSED 8   // inode flag, the data is stored in clusters
+
+#define FS_MAX_EXTRA_REFS 0xffff
+
+#define FS_ROOT_EXTENTS 3
+#define FS_MIN_EXTENT_BLOCK_SIZE 64
+
+// a fingerprint takes 8 bytes of the table per block.
+#define FS_MIN_DEDUP_BLOCK_SIZE 64
+
+// compressed files are stored in clusters of this many blocks, 64KB with
+// 4KB blocks. The header of a compressed cluster goes into its first block.
+#define FS_CLUSTER_BLOCKS 16
+#define FS_MIN_COMPRESS_BLOCK_SIZE 64
+
+// the most data an inode record holds, its whole mapping root.
+#define FS_INLINE_DATA_SIZE 40
+
+// the journal takes a 16th of the data region, within these bounds.
+#define FS_MIN_JOURNAL_SIZE (1L << 20)
+#define FS_MAX_JOURNAL_SIZE (32L << 20)
+
+// reads and writes of at least this many contiguous bytes bypass the cache.
+#define FS_DIRECT_IO_BYTES (64 * 1024)
+
+// sequential reads fetch the blocks ahead of them, in a window that starts
+// at FS_READAHEAD_MIN_BLOCKS and doubles up to FS_READAHEAD_MAX_BYTES, or a
+// quarter of the cache.
+#define FS_READAHEAD_MIN_BLOCKS 4
+#define FS_READAHEAD_MAX_BYTES (128 * 1024)
+
+// the data region is split into allocation groups of this many blocks. A
+// new file starts in the group of its inode and grows on from its last
+// block. When that block is taken, the file goes on in the middle of the
+// longest free run of its group, if the run has FS_SPREAD_BLOCKS or more,
+// so files that grow at the same time don't interleave.
+#define FS_GROUP_BLOCKS 8192
+#define FS_SPREAD_BLOCKS 256
+
+// appends are kept in memory up to this many bytes per file before they
+// get their blocks, see appendData().
+#define FS_DELAYED_MAX_BYTES (256 * 1024)
+
+struct fsSuperBlock {
+    uint32_t magic;
+    uint32_t version;
+    int32_t block_size;
+    int32_t features;           // FS_FEATURE_ flags chosen at format time
+    int32_t pointer_size;       // bytes per block number in pointer blocks
+    int64_t disk_size;          // bytes in the data region
+    int32_t data_blocks;        // amount of blocks in the data region
+    int32_t max_inodes;         // amount of records in the inode table
+    int32_t bitmap_block;       // first block of each region
+    int32_t inode_table_block;
+    int32_t directory_block;
+    int32_t data_block;
+    int32_t dir_slots;          // slots in the directory hash table, a power of 2
+    int32_t refcount_block;
+    int32_t journal_block;
+    int64_t journal_size;       // bytes, 0 without FS_FEATURE_JOURNAL
+    int32_t inline_size;        // bytes, 0 without FS_FEATURE_INLINE
+    int32_t fingerprint_block;  // 0 without FS_FEATURE_DEDUP
+    int32_t cluster_block;      // 0 without FS_FEATURE_COMPRESS
+};
+
+struct fsExtent {
+    int32_t logical;
+    int32_t physical;
+    int32_t length;
+};
+
+struct fsExtentHeader {
+    uint16_t entries;
+    uint16_t depth;
+};
+
+struct fsExtentRoot {
+    fsExtentHeader header;
+    fsExtent entries[FS_ROOT_EXTENTS];
+};
+
+struct fsPointerRoot {
+    int32_t directBlocks[DIRECT_BLOCKS];
+    int32_t singleInDirect;
+    int32_t doubleInDirect;
+};
+
+struct fsDirRoot {
+    int32_t first_entry;        // slot of the first entry, -1 when empty
+    int32_t entries;
+};
+
+struct fsInodeRecord {
+    int16_t type;
+    int16_t flags;
+    int32_t dir_slot;           // slot of the inode's own directory entry
+    int64_t fileSize;
+    int32_t block_in_use;
+    int32_t data_blocks;
+    union {
+        fsPointerRoot pointers;
+        fsExtentRoot extents;
+        fsDirRoot dir;
+        char inline_data[FS_INLINE_DATA_SIZE];
+    };
+};
+
+// the start of a compressed cluster, the LZ stream follows it.
+struct fsClusterHeader {
+    uint32_t raw_bytes;         // of the cluster, the rest of it is zeros
+    uint32_t packed_bytes;      // of the stream
+};
+
+struct fsDirEntry {
+    char name[FS_NAME_LEN];
+    int32_t state;              // FS_DIR_SLOT_
+    int32_t parent;             // inode of the directory holding the entry
+    int32_t inode;
+    int32_t next;               // slots of the other entries of the directory
+    int32_t prev;
+};
+
+static_assert(sizeof(fsSuperBlock) <= FS_SUPERBLOCK_SIZE, "superblock doesn't fit its region");
+static_assert(sizeof(fsInodeRecord) <= FS_INODE_SIZE, "inode doesn't fit its record");
+static_assert(sizeof(fsExtentRoot) <= FS_INLINE_DATA_SIZE, "inline data is smaller than the mapping root");
+static_assert(sizeof(fsDirEntry) == FS_DIR_ENTRY_SIZE, "directory entry has the wrong size");
+
+// Function to convert decimal to binary char
+char decToBinary(int n) {
+    return static_cast<char>(n);
+}
+
+// #define SYS_CALL
+// ============================================================================
+// Where the reads of a file stand, for read-ahead. Reads share the lock of
+// the inode, so this is only a hint that concurrent reads may race on.
+struct ReadAheadState {
+    atomic<int> next;       // the block a sequential read goes on with
+    atomic<int> end;        // the first block not read ahead
+    atomic<int> window;     // blocks read ahead the last time
+};
+
+// A piece of a file handed out by ReadSpans, len bytes at data(). It points
+// into a block of the block cache, which keeps the block where it is until
+// ReleaseSpans. A hole points at zeros, an inline file gets a copy. A
+// compressed cluster is decompressed, the span keeps it.
+struct fsSpan {
+    const char* ptr;
+    int len;
+    long block;                         // the held cache block, -1 for none
+    char bytes[FS_INLINE_DATA_SIZE];
+    shared_ptr<const vector<char> > cluster;
+
+    const char* data() const {
+        return ptr != nullptr ? ptr : bytes;
+    }
+};
+
+class fsInode {
+    long fileSize;
+    int block_in_use;       // data blocks and mapping blocks
+    int data_blocks;        // pointer mapped files: the slots of the block
+                            // map, holes included. Extent mapped: the blocks.
+
+    int directBlock1;
+    int directBlock2;
+    int directBlock3;
+
+    int singleInDirect;
+    int doubleInDirect;
+    int block_size;
+
+    int inode_number;
+    int type;
+    int flags;
+    int dir_slot;
+
+    // directories only.
+    fsDirRoot dir;
+
+    // inline files only, zero past the end of the file.
+    char inlineData[FS_INLINE_DATA_SIZE];
+
+    // extent mapped inodes only, the tree below the root is read on first use.
+    fsExtentRoot extentRoot;
+    atomic<bool> extents_loaded;
+    vector<fsExtent> extents;       // every extent of the file, by logical block
+    vector<int> extentTreeBlocks;
+
+    // pointer mapped inodes only, the block of every data block, resolved
+    // on first use so lookups skip the pointer blocks from then on.
+    atomic<bool> block_map_loaded;
+    vector<int> blockMap;
+
+    ReadAheadState readAhead;
+
+    // appended bytes that have no blocks yet, and the blocks set aside for
+    // them. Only touched under the lock of the inode, alone.
+    vector<char> delayed;
+    int reserved_blocks;
+
+    // reads of the file share it, writes hold it alone.
+    shared_mutex lock;
+
+
+public:
+    fsInode(int _block_size, int _inode_number, int _flags = 0, int _type = FS_INODE_FILE) {
+        inode_number = _inode_number;
+        type = _type;
+        flags = _flags;
+        dir_slot = -1;
+        dir.first_entry = -1;
+        dir.entries = 0;
+        memset(inlineData, 0, sizeof(inlineData));
+        memset(&extentRoot, 0, sizeof(extentRoot));
+        extents_loaded = true;
+        block_map_loaded = true;
+        readAhead.next = 0;
+        readAhead.end = 0;
+        readAhead.window = 0;
+        reserved_blocks = 0;
+        fileSize = 0;
+        block_in_use = 0;
+        data_blocks = 0;
+        block_size = _block_size;
+        directBlock1 = -1;
+        directBlock2 = -1;
+        directBlock3 = -1;
+        singleInDirect = -1;
+        doubleInDirect = -1;
+    }
+
+    fsInode(int _block_size, int _inode_number, const fsInodeRecord& record) {
+        inode_number = _inode_number;
+        type = record.type;
+        flags = record.flags;
+        dir_slot = record.dir_slot;
+        dir.first_entry = -1;
+        dir.entries = 0;
+        block_size = _block_size;
+        fileSize = record.fileSize;
+        block_in_use = record.block_in_use;
+        data_blocks = record.data_blocks;
+        directBlock1 = -1;
+        directBlock2 = -1;
+        directBlock3 = -1;
+        singleInDirect = -1;
+        doubleInDirect = -1;
+        memset(inlineData, 0, sizeof(inlineData));
+        memset(&extentRoot, 0, sizeof(extentRoot));
+        extents_loaded = false;
+        block_map_loaded = data_blocks == 0;
+        readAhead.next = 0;
+        readAhead.end = 0;
+        readAhead.window = 0;
+        reserved_blocks = 0;
+
+        if (isDirectory()) {
+            dir = record.dir;
+            return;
+        }
+
+        if (isInline()) {
+            memcpy(inlineData, record.inline_data, sizeof(inlineData));
+            extents_loaded = true;
+            return;
+        }
+
+        if (isExtentMapped()) {
+            extentRoot = record.extents;
+            return;
+        }
+
+        directBlock1 = record.pointers.directBlocks[0];
+        directBlock2 = record.pointers.directBlocks[1];
+        directBlock3 = record.pointers.directBlocks[2];
+        singleInDirect = record.pointers.singleInDirect;
+        doubleInDirect = record.pointers.doubleInDirect;
+    }
+
+    void toRecord(fsInodeRecord& record) {
+        memset(&record, 0, sizeof(record));
+        record.type = type;
+        record.flags = flags;
+        record.dir_slot = dir_slot;
+        record.fileSize = fileSize;
+        record.block_in_use = block_in_use;
+        record.data_blocks = data_blocks;
+
+        if (isDirectory()) {
+            record.dir = dir;
+            return;
+        }
+
+        if (isInline()) {
+            memcpy(record.inline_data, inlineData, sizeof(inlineData));
+            return;
+        }
+
+        if (isExtentMapped()) {
+            record.extents = extentRoot;
+            return;
+        }
+
+        record.pointers.directBlocks[0] = directBlock1;
+        record.pointers.directBlocks[1] = directBlock2;
+        record.pointers.directBlocks[2] = directBlock3;
+        record.pointers.singleInDirect = singleInDirect;
+        record.pointers.doubleInDirect = doubleInDirect;
+    }
+
+    bool isExtentMapped() {
+        return flags & FS_INODE_EXTENTS;
+    }
+
+    bool isDirectory() {
+        return type == FS_INODE_DIR;
+    }
+
+    bool isShared() {
+        return flags & FS_INODE_SHARED;
+    }
+
+    void setShared() {
+        flags |= FS_INODE_SHARED;
+    }
+
+    bool isInline() {
+        return flags & FS_INODE_INLINE;
+    }
+
+    char* getInlineData() {
+        return inlineData;
+    }
+
+    bool isCompressed() {
+        return flags & FS_INODE_COMPRESSED;
+    }
+
+    // The file is mapped by blocks from now on, and is empty.
+    void clearInline() {
+        flags &= ~FS_INODE_INLINE;
+        memset(inlineData, 0, sizeof(inlineData));
+        fileSize = 0;
+    }
+
+    int getDirSlot() {
+        return dir_slot;
+    }
+
+    void setDirSlot(int slot) {
+        dir_slot = slot;
+    }
+
+    fsDirRoot& getDir() {
+        return dir;
+    }
+
+    fsExtentRoot& getExtentRoot() {
+        return extentRoot;
+    }
+
+    bool areExtentsLoaded() {
+        return extents_loaded;
+    }
+
+    void setExtentsLoaded() {
+        extents_loaded = true;
+    }
+
+    bool isBlockMapLoaded() {
+        return block_map_loaded;
+    }
+
+    void setBlockMapLoaded() {
+        block_map_loaded = true;
+    }
+
+    vector<int>& getBlockMap() {
+        return blockMap;
+    }
+
+    ReadAheadState& getReadAhead() {
+        return readAhead;
+    }
+
+    // Keeps a loaded block map in step with the pointers, -1 for a hole.
+    void mapBlock(int index, int block) {
+        if (!block_map_loaded)
+            return;
+        if (index >= (int)blockMap.size())
+            blockMap.resize(index + 1, -1);
+        blockMap[index] = block;
+    }
+
+    shared_mutex& getLock() {
+        return lock;
+    }
+
+    vector<fsExtent>& getExtents() {
+        return extents;
+    }
+
+    vector<int>& getExtentTreeBlocks() {
+        return extentTreeBlocks;
+    }
+
+    int getInodeNumber() {
+        return inode_number;
+    }
+
+    long getFileSize() {
+        return fileSize;
+    }
+
+    // the size callers see, with the appends that have no blocks yet.
+    long getSize() {
+        return fileSize + delayed.size();
+    }
+
+    vector<char>& getDelayed() {
+        return delayed;
+    }
+
+    int getReservedBlocks() {
+        return reserved_blocks;
+    }
+
+    void setReservedBlocks(int blocks) {
+        reserved_blocks = blocks;
+    }
+
+    void addFileSize(long add) {
+        fileSize += add;
+    }
+
+    void setFileSize(long size) {
+        fileSize = size;
+    }
+
+    int getDirectBlock(int index) {
+        switch (index) {
+        case 0:
+            return directBlock1;
+        case 1:
+            return directBlock2;
+        case 2:
+            return directBlock3;
+        }
+        return -1;
+    }
+
+    void setDirectBlock(int index, int block) {
+        switch (index) {
+        case 0:
+            directBlock1 = block;
+            return;
+        case 1:
+            directBlock2 = block;
+            return;
+        case 2:
+            directBlock3 = block;
+            return;
+        }
+    }
+
+    int getSingleIndirect() {
+        return singleInDirect;
+    }
+
+    void setSingleIndirect(int block) {
+        singleInDirect = block;
+    }
+
+    int getDoubleIndirect() {
+        return doubleInDirect;
+    }
+
+    void setDoubleIndirect(int block) {
+        doubleInDirect = block;
+    }
+
+    int getDataBlocks() {
+        return data_blocks;
+    }
+
+    void addDataBlocks(int add) {
+        data_blocks += add;
+        addTotalBlocks(add);
+    }
+
+    // Pointer mapped files only, the block map gets `count` slots. New
+    // ones are holes, the blocks of dropped ones must be unmapped before.
+    void setDataBlocks(int count) {
+        data_blocks = count;
+        if (block_map_loaded)
+            blockMap.resize(count, -1);
+    }
+
+    int getTotalBlocks() {
+        return block_in_use;
+    }
+
+    void addTotalBlocks(int add) {
+        block_in_use += add;
+    }
+};
+
+// ============================================================================
+// A descriptor refers to its file by inode number, so copying one is cheap.
+// A closed descriptor refers to no file.
+class FileDescriptor {
+    int inode;
+    bool inUse;
+    long position;      // where Read and Write continue from
+
+public:
+    FileDescriptor(int _inode) {
+        inode = _inode;
+        inUse = true;
+        position = 0;
+    }
+
+    int getInodeNumber() {
+        return inode;
+    }
+
+    long getPosition() {
+        return position;
+    }
+
+    void setPosition(long _position) {
+        position = _position;
+    }
+
+    bool isInUse() {
+        return (inUse);
+    }
+
+    void close() {
+        inode = -1;
+        inUse = false;
+        position = 0;
+    }
+};
+
+#define DISK_SIM_FILE "DISK_SIM_FILE.txt"
+// ============================================================================
+class fsDisk {
+    BlockDevice sim_disk;
+
+    // BlockCache - every block access goes through it, the disk is only
+    //              touched on a miss, on eviction of a dirty block and on sync.
+    BlockCache cache;
+
+    bool is_formated;
+
+    fsSuperBlock superBlock;
+
+    // BitVector - bit vector, indicate which block in the disk is free
+    //              or not.  (i.e. if BitVector.test(0) == 1 , means that the 
+    //             first block is occupied. 
+    int BitVectorSize;
+    BlockBitmap BitVector;
+
+    int block_size;
+    long disk_size;
+
+    // block_size zeros, the spans of holes point at them.
+    vector<char> zeroBlock;
+
+    // Unix directories are lists of association structures, 
+    // each of which contains one filename and one inode number.
+    // Here they live in the directory hash table on disk, names resolved
+    // lately are kept in the dentry cache.
+    DentryCache dentries;
+
+    // Inodes - indexed by inode number, an inode is read from the inode
+    //          table the first time it is used. nullptr until then.
+    vector<fsInode*> Inodes;
+
+    // inode numbers with a free record in the inode table.
+    vector<int> FreeInodes;
+
+    // OpenFileDescriptors --  when you open a file, 
+    // the operating system creates an entry to represent that file
+    // This entry number is the file descriptor. 
+    vector< FileDescriptor > OpenFileDescriptors;
+
+    // closed descriptors, the last one closed is reused first.
+    vector<int> FreeFileDescriptors;
+
+    // inode number -> the descriptor it is open with.
+    unordered_map<int, int> OpenInodes;
+
+    // Journal - the metadata changes of the operations since the last
+    //           commit. Inactive without FS_FEATURE_JOURNAL.
+    Journal journal;
+
+    // (first block, amount) freed since the last commit. They stay taken
+    // in the BitVector until the commit frees them, so that nothing is
+    // written over them while the committed state still uses them.
+    vector< pair<int, int> > FreedBlocks;
+
+    // Delayed allocation - blocks set aside for appends that have no blocks
+    // yet, and the inodes with such appends. Under meta_lock.
+    long ReservedBlocks;
+    set<int> DelayedInodes;
+
+    // Deduplication - fingerprint -> the block the index has for it, and
+    // the fingerprint of every data block (the fingerprint table), 0 for a
+    // block that isn't in the index. Empty without FS_FEATURE_DEDUP.
+    // DedupedBlocks counts the blocks writes didn't write. Under meta_lock.
+    unordered_map<uint64_t, int> Fingerprints;
+    vector<uint64_t> BlockFingerprints;
+    long DedupedBlocks;
+
+    // Compression - the cluster bitmap, a bit per data block set for the
+    // first block of every compressed cluster, under meta_lock. Empty
+    // without FS_FEATURE_COMPRESS. Decompressed clusters are kept in
+    // clusterCache by that block, only while its bit is set.
+    vector<uint64_t> ClusterStarts;
+    ClusterCache clusterCache;
+
+    // Locks - calls that change the namespace (create, delete, copy,
+    //         rename, directories) and format / sync hold fs_lock alone,
+    //         every other call shares it. The data of a file is guarded by
+    //         the lock of its inode. Under those, meta_lock guards the
+    //         BitVector, the reference counts, the dedup index, the cluster
+    //         bitmap and the journal, fd_lock the open file table, and
+    //         inode_lock the loading of inodes. The block cache, the dentry
+    //         cache and the cluster cache lock themselves.
+    //         Taken in this order: fs_lock, inode, meta_lock, fd_lock.
+    shared_mutex fs_lock;
+    recursive_mutex meta_lock;
+    mutex fd_lock;
+    mutex inode_lock;
+    condition_variable_any journal_idle;   // with meta_lock, no operation
+                                           // is in progress
+
+
+public:
+// ------------------------------------------------------------------------
+    // backend is how the disk image is accessed, one of DEVICE_PREAD,
+    // DEVICE_STDIO and DEVICE_MMAP.
+    fsDisk(int cacheBlocks = DEFAULT_CACHE_BLOCKS, int backend = DEVICE_PREAD) : sim_disk(DISK_SIM_FILE, backend),
+        cache(&sim_disk, cacheBlocks),
+        dentries(DEFAULT_DENTRY_CACHE), journal(&sim_disk), clusterCache(DEFAULT_CLUSTER_CACHE) {
+        is_formated = false;
+        block_size = 0;
+        disk_size = 0;
+        ReservedBlocks = 0;
+        DedupedBlocks = 0;
+
+        assert(sim_disk.isOpen());
+        mount();
+    }
+
+    ~fsDisk() {
+        sync();
+        clearDynamicData();
+    }
+
+    // ------------------------------------------------------------------------
+    // Gives the delayed appends their blocks, and writes every dirty cached
+    // block back to the disk, see syncDisk().
+    bool sync() {
+        unique_lock<shared_mutex> guard(fs_lock);
+        return flushAllDelayed() && syncDisk();
+    }
+
+    // whether the disk holds a file system, formatted or mounted.
+    bool isFormatted() {
+        return is_formated;
+    }
+
+    // amount of journal commits so far, each one fdatasync.
+    long getJournalCommits() {
+        return journal.getCommits();
+    }
+
+    // amount of those committed in the middle of an operation, because its
+    // changes didn't fit into the journal otherwise.
+    long getJournalSplits() {
+        return journal.getSplits();
+    }
+
+    // amount of operations committed together, at most.
+    void setJournalBatch(int batch) {
+        journal.setBatch(batch);
+    }
+
+    // amount of requests that reached the disk image so far.
+    long getDeviceReads() {
+        return sim_disk.getReads();
+    }
+
+    long getDeviceWrites() {
+        return sim_disk.getWrites();
+    }
+
+    long getDeviceBytesRead() {
+        return sim_disk.getBytesRead();
+    }
+
+    long getDeviceBytesWritten() {
+        return sim_disk.getBytesWritten();
+    }
+
+    // amount of data blocks that aren't in use.
+    long getFreeBlocks() {
+        lock_guard<recursive_mutex> guard(meta_lock);
+        return BitVector.getFreeBlocks();
+    }
+
+    // amount of blocks written that were found on the disk already, with
+    // FS_FEATURE_DEDUP.
+    long getDedupedBlocks() {
+        lock_guard<recursive_mutex> guard(meta_lock);
+        return DedupedBlocks;
+    }
+
+    void printCacheStats() {
+        cout << "cache: capacity " << cache.getCapacity() << " blocks, hits " << cache.getHits()
+            << ", misses " << cache.getMisses() << ", hit ratio " << cache.getHitRatio()
+            << ", dirty blocks " << cache.getDirtyBlocks() << ", write-backs " << cache.getWritebacks()
+            << " in " << cache.getWriteRuns() << " requests, read ahead " << cache.getPrefetched() << endl;
+        cout << "dentry cache: hits " << dentries.getHits() << ", misses " << dentries.getMisses() << endl;
+        if (isCompressEnabled())
+            cout << "cluster cache: capacity " << clusterCache.getCapacity() << " clusters, hits "
+                << clusterCache.getHits() << ", misses " << clusterCache.getMisses() << endl;
+    }
+
+    // Every file with the amount of runs of contiguous blocks it is in,
+    // then the average over the files. Without perFile only the average.
+    void printFragmentation(bool perFile = true) {
+        unique_lock<shared_mutex> guard(fs_lock);
+        if (!isDiskFormatted())
+            return;
+        flushAllDelayed();
+
+        set<int> freeInodes(FreeInodes.begin(), FreeInodes.end());
+        long files = 0;
+        long blocks = 0;
+        long runs = 0;
+        for (int i = 0; i < superBlock.max_inodes; i++) {
+            if (freeInodes.count(i))
+                continue;
+            fsInode* fsi = getInode(i);
+            if (fsi->isDirectory())
+                continue;
+
+            unique_lock<shared_mutex> inodeGuard(fsi->getLock());
+            vector<fsExtent> fileExtents = dataRuns(fsi);
+            int fileRuns = fileExtents.size();
+            int fileBlocks = 0;
+            for (fsExtent& extent : fileExtents)
+                fileBlocks += extent.length;
+            if (perFile)
+                cout << "fragmentation: " << pathOf(fsi) << " blocks " << fileBlocks
+                    << " extents " << fileRuns << endl;
+            files++;
+            blocks += fileBlocks;
+            runs += fileRuns;
+        }
+        cout << "fragmentation: " << files << " files, " << blocks << " blocks, " << runs << " extents, "
+            << (files == 0 ? 0 : (double)runs / files) << " extents per file" << endl;
+    }
+
+    // ------------------------------------------------------------------------
+    void listAll() {
+        unique_lock<shared_mutex> guard(fs_lock);
+        flushAllDelayed();
+        for (int i = 0; i < (int)OpenFileDescriptors.size(); i++) {
+            bool inUse = OpenFileDescriptors[i].isInUse();
+            cout << "index: " << i << ": FileName: " << (inUse ? entryName(fdInode(i)) : "")
+                << " , isInUse: " << inUse << " file Size: " << fdFileSize(i) << endl;
+        }
+        int ret_val = commitJournal() && cache.flush();
+        assert(ret_val);
+
+        long size = is_formated ? disk_size : DISK_SIZE;
+        vector<char> content(min(size, (long)LIST_CHUNK_SIZE), 0);
+        cout << "Disk content: '";
+        for (long done = 0; done < size; done += content.size()) {
+            long chunk = min(size - done, (long)content.size());
+            if (is_formated) {
+                ret_val = sim_disk.readAt(dataRegionOffset() + done, content.data(), chunk);
+                assert(ret_val);
+            }
+            cout.write(content.data(), chunk);
+        }
+        cout << "'" << endl;
+    }
+
+    // ------------------------------------------------------------------------
+    // features is a mask of FS_FEATURE_ flags, FS_FEATURE_EXTENTS makes new
+    // files map their blocks with extents. With FS_FEATURE_INLINE, files of
+    // up to inlineSize bytes are kept in their inode. FS_FEATURE_DEDUP
+    // shares blocks of equal content between and within files, and
+    // FS_FEATURE_COMPRESS stores files in compressed clusters.
+    void fsFormat(int blockSize = 4, long diskSize = DISK_SIZE, int features = 0,
+        int inlineSize = FS_INLINE_DATA_SIZE) {
+        if (blockSize <= 0 || blockSize > diskSize) {
+            cerr << "ERR - illegal block size" << endl;
+            return;
+        }
+
+        if (diskSize / blockSize > INT32_MAX - 1) {
+            cerr << "ERR - disk has too many blocks" << endl;
+            return;
+        }
+
+        if (blockSize < pointerSizeFor(diskSize / blockSize)) {
+            cerr << "ERR - block size is too small to hold a block number of this disk" << endl;
+            return;
+        }
+
+        if ((features & FS_FEATURE_EXTENTS) && blockSize < FS_MIN_EXTENT_BLOCK_SIZE) {
+            cerr << "ERR - block size is too small for extents" << endl;
+            return;
+        }
+
+        if ((features & FS_FEATURE_DEDUP) && blockSize < FS_MIN_DEDUP_BLOCK_SIZE) {
+            cerr << "ERR - block size is too small for dedup" << endl;
+            return;
+        }
+
+        if ((features & FS_FEATURE_COMPRESS) && blockSize < FS_MIN_COMPRESS_BLOCK_SIZE) {
+            cerr << "ERR - block size is too small for compression" << endl;
+            return;
+        }
+
+        // dedup looks at blocks, a compressed cluster is only understood
+        // whole.
+        if ((features & FS_FEATURE_COMPRESS) && (features & FS_FEATURE_DEDUP)) {
+            cerr << "ERR - compression and dedup can't be used together" << endl;
+            return;
+        }
+
+        if ((features & FS_FEATURE_INLINE) && (inlineSize <= 0 || inlineSize > FS_INLINE_DATA_SIZE)) {
+            cerr << "ERR - illegal inline size" << endl;
+            return;
+        }
+
+        unique_lock<shared_mutex> guard(fs_lock);
+        clearDynamicData();
+        is_formated = false;
+
+        block_size = blockSize;
+        disk_size = diskSize;
+        zeroBlock.assign(block_size, 0);
+        BitVectorSize = disk_size / block_size;
+        initSuperBlock(features, inlineSize);
+
+        BitVector.reset(BitVectorSize);
+        if (features & FS_FEATURE_DEDUP)
+            BlockFingerprints.assign(BitVectorSize, 0);
+        if (features & FS_FEATURE_COMPRESS)
+            ClusterStarts.assign(clusterWords(), 0);
+        Inodes.assign(superBlock.max_inodes, nullptr);
+        for (int i = superBlock.max_inodes - 1; i >= 0; i--)
+            FreeInodes.push_back(i);
+
+        clearDisk();
+        if (!writeMeta(0, (char*)&superBlock, sizeof(superBlock)) || !writeMeta(bitmapOffset(),
+            (char*)BitVector.data(), bitmapBytes())) {
+            cerr << "ERR - could not format the disk" << endl;
+            return;
+        }
+
+        // the first inode handed out is FS_ROOT_INODE.
+        fsInode* root = allocateInode(FS_INODE_DIR);
+        writeInode(root);
+        if (!syncDisk() || ((features & FS_FEATURE_JOURNAL)
+            && !journal.reset(journalOffset(), superBlock.journal_size, block_size))) {
+            cerr << "ERR - could not format the disk" << endl;
+            return;
+        }
+        is_formated = true;
+    }
+
+    // ------------------------------------------------------------------------
+    // Loads the metadata of a formatted disk image, without touching any
+    // file data. Returns false if the image has no file system on it.
+    bool mount() {
+        fsSuperBlock sb;
+        if (!sim_disk.readAt(0, &sb, sizeof(sb)))
+            return false;
+
+        if (sb.magic != FS_MAGIC || sb.version != FS_VERSION || sb.block_size <= 0)
+            return false;
+
+        unique_lock<shared_mutex> guard(fs_lock);
+        clearDynamicData();
+        is_formated = false;
+
+        superBlock = sb;
+        block_size = sb.block_size;
+        disk_size = sb.disk_size;
+        zeroBlock.assign(block_size, 0);
+        BitVectorSize = sb.data_blocks;
+
+        // metadata that was committed but may not be in place yet.
+        int replayed;
+        if ((sb.features & FS_FEATURE_JOURNAL)
+            && !journal.recover(journalOffset(), sb.journal_size, block_size, replayed)) {
+            cerr << "ERR - could not replay the journal" << endl;
+            return false;
+        }
+        cache.reset(block_size);
+
+        BitVector.reset(BitVectorSize);
+        if (!readMeta(bitmapOffset(), (char*)BitVector.data(), bitmapBytes()))
+            return false;
+        BitVector.rebuild();
+        if ((sb.features & FS_FEATURE_DEDUP) && !loadFingerprints())
+            return false;
+        if (sb.features & FS_FEATURE_COMPRESS) {
+            ClusterStarts.assign(clusterWords(), 0);
+            if (!readMeta(clusterOffset(0), (char*)ClusterStarts.data(), ClusterStarts.size() * sizeof(uint64_t)))
+                return false;
+        }
+
+        Inodes.assign(superBlock.max_inodes, nullptr);
+
+        // only the free inodes are collected, inodes and names are read
+        // when they are first used.
+        vector<fsInodeRecord> records(min(superBlock.max_inodes, LIST_CHUNK_SIZE / FS_INODE_SIZE));
+        for (int first = 0; first < superBlock.max_inodes; first += records.size()) {
+            int count = min((int)records.size(), superBlock.max_inodes - first);
+            if (!readMeta(inodeOffset(first), (char*)records.data(), (long)count * sizeof(fsInodeRecord)))
+                return false;
+            for (int i = 0; i < count; i++) {
+                if (records[i].type == FS_INODE_FREE)
+                    FreeInodes.push_back(first + i);
+            }
+        }
+        // lower inode numbers are handed out first.
+        reverse(FreeInodes.begin(), FreeInodes.end());
+
+        is_formated = true;
+        return true;
+    }
+
+    void clearDynamicData() {
+        BitVector.reset(0);
+        journal.disable();
+        FreedBlocks.clear();
+        ReservedBlocks = 0;
+        DelayedInodes.clear();
+        Fingerprints.clear();
+        BlockFingerprints.clear();
+        DedupedBlocks = 0;
+        ClusterStarts.clear();
+        clusterCache.clear();
+
+        for (fsInode* fsi : Inodes)
+            delete fsi;
+
+        dentries.clear();
+        Inodes.clear();
+        FreeInodes.clear();
+        OpenFileDescriptors.clear();
+        FreeFileDescriptors.clear();
+        OpenInodes.clear();
+    }
+
+    // Zeroes the whole image, metadata and data. The image is punched out
+    // rather than written, so this costs the same for any disk size and
+    // only the metadata written by fsFormat takes space again.
+    void clearDisk() {
+        // whatever is cached belongs to the old content of the disk.
+        cache.reset(block_size);
+
+        int ret_val = sim_disk.discard(0, imageSize());
+        assert(ret_val);
+    }
+
+    // ------------------------------------------------------------------------
+    // Paths are names separated by '/', resolved from the root directory
+    // whether or not they start with '/'. "." and ".." are supported.
+    int CreateFile(string fileName) {
+        unique_lock<shared_mutex> guard(fs_lock);
+        Operation op(this);
+        if (!is_formated) {
+            cerr << "ERR - disk not formatted" << endl;
+            return -1;
+        }
+
+        string name;
+        fsInode* dir = lookupParent(fileName, name);
+        if (dir == nullptr)
+            return -1;
+
+        if (findEntry(dir, name) >= 0) {
+            cerr << "ERR - file name already exists" << endl;
+            return -1;
+        }
+
+        if (!isLegalFileName(name))
+            return -1;
+
+        fsInode* fsi = allocateInode(FS_INODE_FILE);
+        if (fsi == nullptr)
+            return -1;
+
+        addEntry(dir, name, fsi);
+        return addDescriptor(fsi);
+    }
+
+    // ------------------------------------------------------------------------
+    int MkDir(string path) {
+        unique_lock<shared_mutex> guard(fs_lock);
+        Operation op(this);
+        if (!isDiskFormatted())
+            return -1;
+
+        string name;
+        fsInode* dir = lookupParent(path, name);
+        if (dir == nullptr)
+            return -1;
+
+        if (findEntry(dir, name) >= 0) {
+            cerr << "ERR - file name already exists" << endl;
+            return -1;
+        }
+
+        if (!isLegalFileName(name))
+            return -1;
+
+        fsInode* fsi = allocateInode(FS_INODE_DIR);
+        if (fsi == nullptr)
+            return -1;
+
+        addEntry(dir, name, fsi);
+        return 1;
+    }
+
+    // ------------------------------------------------------------------------
+    // Removes an empty directory.
+    int RmDir(string path) {
+        unique_lock<shared_mutex> guard(fs_lock);
+        Operation op(this);
+        if (!isDiskFormatted())
+            return -1;
+
+        fsInode* dir;
+        int slot = lookupEntry(path, dir);
+        if (slot < 0) {
+            cerr << "ERR - directory doesn't exist" << endl;
+            return -1;
+        }
+
+        fsInode* fsi = getInode(readDirEntry(slot).inode);
+        if (!fsi->isDirectory()) {
+            cerr << "ERR - not a directory" << endl;
+            return -1;
+        }
+
+        if (fsi->getDir().entries > 0) {
+            cerr << "ERR - directory is not empty" << endl;
+            return -1;
+        }
+
+        removeEntry(dir, slot);
+        releaseInode(fsi);
+        return 1;
+    }
+
+    // ------------------------------------------------------------------------
+    // Streams the names in a directory one call at a time. Start with
+    // cookie 0, every call returns 1 and the next name (directories end
+    // with '/'), or 0 when there are no more. An entry removed between two
+    // calls may end the listing early.
+    int ReadDir(string path, int& cookie, string& name) {
+        shared_lock<shared_mutex> guard(fs_lock);
+        if (!isDiskFormatted())
+            return -1;
+
+        fsInode* dir = lookupPath(path);
+        if (dir == nullptr) {
+            cerr << "ERR - directory doesn't exist" << endl;
+            return -1;
+        }
+
+        if (!dir->isDirectory()) {
+            cerr << "ERR - not a directory" << endl;
+            return -1;
+        }
+
+        int slot = cookie == 0 ? dir->getDir().first_entry : cookie - 1;
+        if (slot < 0)
+            return 0;
+
+        fsDirEntry entry = readDirEntry(slot);
+        if (entry.state != FS_DIR_SLOT_USED || entry.parent != dir->getInodeNumber())
+            return 0;
+
+        name = string(entry.name, strnlen(entry.name, FS_NAME_LEN));
+        if (getInode(entry.inode)->isDirectory())
+            name += "/";
+        cookie = entry.next < 0 ? -1 : entry.next + 1;
+        return 1;
+    }
+
+    // ------------------------------------------------------------------------
+    int OpenFile(string fileName) {
+        shared_lock<shared_mutex> guard(fs_lock);
+        if (!isDiskFormatted())
+            return -1;
+
+        fsInode* fsi = lookupPath(fileName);
+        if (fsi == nullptr) {
+            cerr << "ERR - file doesn't exist" << endl;
+            return -1;
+        }
+
+        if (fsi->isDirectory()) {
+            cerr << "ERR - is a directory" << endl;
+            return -1;
+        }
+
+        return addDescriptor(fsi);
+    }
+
+    // ------------------------------------------------------------------------
+    string CloseFile(int fd) {
+        shared_lock<shared_mutex> guard(fs_lock);
+        if (!isDiskFormatted())
+            return "-1";
+
+        // the appends of the file get their blocks, it can't grow any more.
+        fsInode* fsi = lookupFd(fd);
+        if (fsi != nullptr) {
+            unique_lock<shared_mutex> inodeGuard(fsi->getLock());
+            if (!fsi->getDelayed().empty()) {
+                Operation op(this);
+                flushDelayed(fsi);
+            }
+        }
+
+        lock_guard<mutex> fdGuard(fd_lock);
+        string fileName = findFileNameByFd(fd);
+        if (fileName == "-1") {
+            cerr << "ERR - file descriptor doesn't exis" << endl;
+            return "-1";
+        }
+
+        OpenInodes.erase(OpenFileDescriptors[fd].getInodeNumber());
+        OpenFileDescriptors[fd].close();
+        FreeFileDescriptors.push_back(fd);
+        return fileName;
+    }
+
+    // ------------------------------------------------------------------------
+    int WriteToFile(int fd, char* buf, int len) {
+        shared_lock<shared_mutex> guard(fs_lock);
+        if (!isDiskFormatted())
+            return -1;
+
+        fsInode* fsi = lookupFd(fd);
+        if (fsi == nullptr)
+            return -1;
+
+        unique_lock<shared_mutex> inodeGuard(fsi->getLock());
+        Operation op(this);
+        if (maxFileSize(fsi) <= fsi->getSize()) {
+            cerr << "ERR - file is already full" << endl;
+            return -1;
+        }
+
+        if (appendData(fsi, buf, len) < 0) {
+            return -1;
+        }
+        return len;
+    }
+
+    // ------------------------------------------------------------------------
+    // Maps blocks for the next len bytes of the file up front, as contiguous
+    // as the disk allows, without changing the size of the file. Appends
+    // fill them later. Returns 1, or -1 when there isn't the space.
+    int Preallocate(int fd, long len) {
+        shared_lock<shared_mutex> guard(fs_lock);
+        if (!isDiskFormatted())
+            return -1;
+
+        fsInode* fsi = lookupFd(fd);
+        if (fsi == nullptr)
+            return -1;
+
+        if (len <= 0) {
+            cerr << "ERR - illegal length" << endl;
+            return -1;
+        }
+
+        unique_lock<shared_mutex> inodeGuard(fsi->getLock());
+        Operation op(this);
+        if (!flushDelayed(fsi))
+            return -1;
+
+        long end = min(maxFileSize(fsi), fsi->getFileSize() + len);
+        if (fitsInline(fsi, end))
+            return 1;
+        if (fsi->isInline() && !promoteInline(fsi))
+            return -1;
+
+        int first = dataBlocksForFileSize(fsi->getFileSize());
+        bool mapped = fsi->isExtentMapped() ? mapExtentRange(fsi, first, dataBlocksForFileSize(end))
+            : mapPointerRange(fsi, first, dataBlocksForFileSize(end));
+        return mapped ? 1 : -1;
+    }
+
+    // ------------------------------------------------------------------------
+    // Sets the size of the file. Blocks past the new end are freed, along
+    // with the pointer blocks that map nothing any more, and a file that
+    // grows gets a hole that reads as zeros. Returns 1, or -1.
+    int Truncate(int fd, long size) {
+        shared_lock<shared_mutex> guard(fs_lock);
+        if (!isDiskFormatted())
+            return -1;
+
+        fsInode* fsi = lookupFd(fd);
+        if (fsi == nullptr)
+            return -1;
+
+        if (size < 0) {
+            cerr << "ERR - illegal size" << endl;
+            return -1;
+        }
+
+        unique_lock<shared_mutex> inodeGuard(fsi->getLock());
+        Operation op(this);
+        if (size > maxFileSize(fsi)) {
+            cerr << "ERR - size is past the maximum file size" << endl;
+            return -1;
+        }
+
+        // delayed appends past the new end are dropped without blocks.
+        if (size >= fsi->getFileSize() && size <= fsi->getSize()) {
+            trimDelayed(fsi, size - fsi->getFileSize());
+            return 1;
+        }
+        if (size < fsi->getFileSize())
+            trimDelayed(fsi, 0);
+        else if (!flushDelayed(fsi))
+            return -1;
+        return truncateFile(fsi, size) ? 1 : -1;
+    }
+
+    // ------------------------------------------------------------------------
+    // Frees the blocks [offset, offset + len) covers whole, and zeroes the
+    // rest of it. The range reads as zeros and the size of the file stays.
+    // Returns 1, or -1.
+    int PunchHole(int fd, long offset, long len) {
+        shared_lock<shared_mutex> guard(fs_lock);
+        if (!isDiskFormatted())
+            return -1;
+
+        fsInode* fsi = lookupFd(fd);
+        if (fsi == nullptr)
+            return -1;
+
+        if (offset < 0 || len <= 0) {
+            cerr << "ERR - illegal offset or length" << endl;
+            return -1;
+        }
+
+        unique_lock<shared_mutex> inodeGuard(fsi->getLock());
+        Operation op(this);
+        if (!flushDelayed(fsi))
+            return -1;
+        return punchRange(fsi, offset, min(offset + len, maxFileSize(fsi))) ? 1 : -1;
+    }
+
+    // ------------------------------------------------------------------------
+    // Writes len bytes at offset without moving the file position. Bytes
+    // already in the file are overwritten in place, writing past the end
+    // leaves a gap that reads as zeros. Returns the amount written.
+    int WriteAt(int fd, long offset, char* buf, int len) {
+        shared_lock<shared_mutex> guard(fs_lock);
+        if (!isDiskFormatted())
+            return -1;
+
+        fsInode* fsi = lookupFd(fd);
+        if (fsi == nullptr)
+            return -1;
+
+        return writeFileAt(fsi, offset, buf, len);
+    }
+
+    // ------------------------------------------------------------------------
+    // Reads up to len bytes at offset without moving the file position.
+    // Returns the amount read, 0 at or past the end of the file. Unlike
+    // ReadFromFile, buf is not null terminated.
+    int ReadAt(int fd, long offset, char* buf, int len) {
+        shared_lock<shared_mutex> guard(fs_lock);
+        if (!isDiskFormatted())
+            return -1;
+
+        fsInode* fsi = lookupFd(fd);
+        if (fsi == nullptr)
+            return -1;
+
+        return readFileAt(fsi, offset, buf, len);
+    }
+
+    // ------------------------------------------------------------------------
+    // Fills the iovcnt buffers of iov in turn from offset, like preadv(2),
+    // under one hold of the file. Returns the amount read, short at the end
+    // of the file.
+    int ReadVAt(int fd, long offset, const struct iovec* iov, int iovcnt) {
+        shared_lock<shared_mutex> guard(fs_lock);
+        if (!isDiskFormatted())
+            return -1;
+
+        fsInode* fsi = lookupFd(fd);
+        if (fsi == nullptr)
+            return -1;
+
+        return readFileVAt(fsi, offset, iov, iovcnt);
+    }
+
+    // Like ReadVAt, at the file position, which moves past what was read.
+    int ReadV(int fd, const struct iovec* iov, int iovcnt) {
+        shared_lock<shared_mutex> guard(fs_lock);
+        if (!isDiskFormatted())
+            return -1;
+
+        fsInode* fsi = lookupFd(fd);
+        if (fsi == nullptr)
+            return -1;
+
+        long position = getPosition(fd);
+        int res = readFileVAt(fsi, position, iov, iovcnt);
+        if (res > 0)
+            setPosition(fd, position + res);
+        return res;
+    }
+
+    // ------------------------------------------------------------------------
+    // Reads without copying: appends to spans the pieces of [offset,
+    // offset + len), one per block, each pointing into the block cache.
+    // The blocks stay cached and in place until ReleaseSpans, a call covers
+    // at most half the cache and returns the amount of bytes its spans
+    // cover, 0 at the end of the file. A span shows what its block holds,
+    // writes to the file meanwhile show through, but a span of a compressed
+    // cluster keeps the cluster as it was read. Spans must be released
+    // before fsFormat and before the fsDisk is deleted.
+    int ReadSpans(int fd, long offset, int len, vector<fsSpan>& spans) {
+        shared_lock<shared_mutex> guard(fs_lock);
+        if (!isDiskFormatted())
+            return -1;
+
+        fsInode* fsi = lookupFd(fd);
+        if (fsi == nullptr)
+            return -1;
+
+        if (offset < 0 || len < 0) {
+            cerr << "ERR - illegal offset or length" << endl;
+            return -1;
+        }
+
+        shared_lock<shared_mutex> inodeGuard = lockForRead(fsi);
+        return readSpans(fsi, offset, len, spans);
+    }
+
+    // Lets the cache have the blocks of the spans back, and empties spans.
+    void ReleaseSpans(vector<fsSpan>& spans) {
+        for (fsSpan& span : spans) {
+            if (span.block >= 0)
+                cache.release(span.block);
+        }
+        spans.clear();
+    }
+
+    // ------------------------------------------------------------------------
+    // Read and Write work at the file position of the descriptor, and move
+    // it past the bytes they transferred.
+    int Read(int fd, char* buf, int len) {
+        shared_lock<shared_mutex> guard(fs_lock);
+        if (!isDiskFormatted())
+            return -1;
+
+        fsInode* fsi = lookupFd(fd);
+        if (fsi == nullptr)
+            return -1;
+
+        long position = getPosition(fd);
+        int res = readFileAt(fsi, position, buf, len);
+        if (res > 0)
+            setPosition(fd, position + res);
+        return res;
+    }
+
+    int Write(int fd, char* buf, int len) {
+        shared_lock<shared_mutex> guard(fs_lock);
+        if (!isDiskFormatted())
+            return -1;
+
+        fsInode* fsi = lookupFd(fd);
+        if (fsi == nullptr)
+            return -1;
+
+        long position = getPosition(fd);
+        int res = writeFileAt(fsi, position, buf, len);
+        if (res > 0)
+            setPosition(fd, position + res);
+        return res;
+    }
+
+    // ------------------------------------------------------------------------
+    // whence is SEEK_SET, SEEK_CUR or SEEK_END. The position may go past the
+    // end of the file. Returns the new position.
+    long Seek(int fd, long offset, int whence) {
+        shared_lock<shared_mutex> guard(fs_lock);
+        if (!isDiskFormatted())
+            return -1;
+
+        fsInode* fsi = lookupFd(fd);
+        if (fsi == nullptr)
+            return -1;
+
+        long base;
+        switch (whence) {
+        case SEEK_SET:
+            base = 0;
+            break;
+        case SEEK_CUR:
+            base = getPosition(fd);
+            break;
+        case SEEK_END:
+            base = fileSizeOf(fsi);
+            break;
+        default:
+            cerr << "ERR - illegal seek origin" << endl;
+            return -1;
+        }
+
+        if (base + offset < 0) {
+            cerr << "ERR - illegal offset" << endl;
+            return -1;
+        }
+
+        setPosition(fd, base + offset);
+        return base + offset;
+    }
+
+    long Tell(int fd) {
+        shared_lock<shared_mutex> guard(fs_lock);
+        if (!isDiskFormatted() || lookupFd(fd) == nullptr)
+            return -1;
+
+        return getPosition(fd);
+    }
+
+    // ------------------------------------------------------------------------
+    int DelFile(string fileName) {
+        unique_lock<shared_mutex> guard(fs_lock);
+        Operation op(this);
+        if (!isDiskFormatted())
+            return -1;
+
+        fsInode* dir;
+        int slot = lookupEntry(fileName, dir);
+        if (slot < 0) {
+            cerr << "ERR - file does not exist" << endl;
+            return -1;
+        }
+
+        fsInode* fsi = getInode(readDirEntry(slot).inode);
+        if (fsi->isDirectory()) {
+            cerr << "ERR - is a directory" << endl;
+            return -1;
+        }
+
+        if (isOpen(fsi)) {
+            cerr << "ERR - file is open" << endl;
+            return -1;
+        }
+
+        removeEntry(dir, slot);
+        releaseFileBlocks(fsi);
+        releaseInode(fsi);
+        return 1;
+    }
+
+    // ------------------------------------------------------------------------
+    int ReadFromFile(int fd, char* buf, int len) {
+        shared_lock<shared_mutex> guard(fs_lock);
+        if (!isDiskFormatted())
+            return -1;
+
+        fsInode* fsi = lookupFd(fd);
+        if (fsi == nullptr)
+            return -1;
+
+        shared_lock<shared_mutex> inodeGuard = lockForRead(fsi);
+        int res = readDataFromFile(fsi, buf, len);
+        if (res < 0) {
+            return -1;
+        }
+        return res;
+    }
+
+    // ------------------------------------------------------------------------
+    // Tells the disk image how the blocks the file has now are going to be
+    // read, DEVICE_ADVISE_SEQUENTIAL or DEVICE_ADVISE_RANDOM (or _NORMAL),
+    // so the kernel reads ahead for them or doesn't.
+    int AdviseFile(int fd, int advice) {
+        shared_lock<shared_mutex> guard(fs_lock);
+        if (!isDiskFormatted())
+            return -1;
+
+        fsInode* fsi = lookupFd(fd);
+        if (fsi == nullptr)
+            return -1;
+
+        shared_lock<shared_mutex> inodeGuard = lockForRead(fsi);
+        for (fsExtent& run : dataRuns(fsi))
+            sim_disk.advise(dataRegionOffset() + (long)run.physical * block_size, (long)run.length * block_size, advice);
+        return 1;
+    }
+
+    // ------------------------------------------------------------------------
+    long getFileSize(int fd) {
+        shared_lock<shared_mutex> guard(fs_lock);
+        if (!isDiskFormatted())
+            return -1;
+
+        fsInode* fsi = lookupFd(fd);
+        if (fsi == nullptr) {
+            cerr << "ERR - file descriptor doesn't exis" << endl;
+            return -1;
+        }
+
+        return fileSizeOf(fsi);
+    }
+
+    // ------------------------------------------------------------------------
+    int CopyFile(string srcFileName, string destFileName) {
+        unique_lock<shared_mutex> guard(fs_lock);
+        Operation op(this);
+        if (!isDiskFormatted())
+            return -1;
+
+        fsInode* srcFsi = lookupPath(srcFileName);
+        if (srcFsi == nullptr || srcFsi->isDirectory()) {
+            cerr << "ERR - no source file" << endl;
+            return -1;
+        }
+
+        if (!flushDelayed(srcFsi))
+            return -1;
+
+        string destName;
+        fsInode* destDir = lookupParent(destFileName, destName);
+        if (destDir == nullptr)
+            return -1;
+
+        if (findEntry(destDir, destName) >= 0) {
+            cerr << "ERR - destination file already exists" << endl;
+            return -1;
+        }
+
+        if (!isLegalFileName(destName))
+            return -1;
+
+        fsInode* destFsi = allocateInode(FS_INODE_FILE);
+        if (destFsi == nullptr)
+            return -1;
+
+        // blocks shared by too many files already are copied the old way,
+        // and so is inline data, it has no blocks to share.
+        bool copied = !srcFsi->isInline() && canShareBlocks(srcFsi) ? shareBlocks(srcFsi, destFsi)
+            : copyFileData(srcFsi, destFsi);
+        if (!copied) {
+            cerr << "ERR - not enough space" << endl;
+            releaseFileBlocks(destFsi);
+            return releaseInode(destFsi);
+        }
+
+        addEntry(destDir, destName, destFsi);
+        return 1;
+    }
+
+    // ------------------------------------------------------------------------
+    int RenameFile(string oldFileName, string newFileName) {
+        unique_lock<shared_mutex> guard(fs_lock);
+        Operation op(this);
+        if (!isDiskFormatted())
+            return -1;
+
+        fsInode* oldDir;
+        int oldSlot = lookupEntry(oldFileName, oldDir);
+        if (oldSlot < 0) {
+            cerr << "ERR - file doesn't exist" << endl;
+            return -1;
+        }
+
+        string newName;
+        fsInode* newDir = lookupParent(newFileName, newName);
+        if (newDir == nullptr)
+            return -1;
+
+        if (findEntry(newDir, newName) >= 0) {
+            cerr << "ERR - new file name already in use" << endl;
+            return -1;
+        }
+
+        if (!isLegalFileName(newName))
+            return -1;
+
+        fsInode* fsi = getInode(readDirEntry(oldSlot).inode);
+        if (isOpen(fsi)) {
+            cerr << "ERR - cannot change name of open file" << endl;
+            return -1;
+        }
+
+        // a directory can't move into itself or below itself.
+        if (fsi->isDirectory()) {
+            for (fsInode* dir = newDir; ; dir = parentOf(dir)) {
+                if (dir == fsi) {
+                    cerr << "ERR - cannot move a directory into itself" << endl;
+                    return -1;
+                }
+                if (dir->getInodeNumber() == FS_ROOT_INODE)
+                    break;
+            }
+        }
+
+        removeEntry(oldDir, oldSlot);
+        addEntry(newDir, newName, fsi);
+        return 1;
+    }
+
+private:
+    // ------------------------------------------------------------------------
+    // Metadata - the superblock, free bitmap, inode table and directory are
+    // written through the block cache as soon as they change in memory.
+    int blocksFor(long bytes) {
+        return (bytes + block_size - 1) / block_size;
+    }
+
+    void initSuperBlock(int features, int inlineSize) {
+        memset(&superBlock, 0, sizeof(superBlock));
+        superBlock.magic = FS_MAGIC;
+        superBlock.version = FS_VERSION;
+        superBlock.block_size = block_size;
+        superBlock.features = features;
+        superBlock.disk_size = disk_size;
+        superBlock.data_blocks = BitVectorSize;
+        superBlock.max_inodes = max((long)min(BitVectorSize, FS_MIN_INODES), disk_size / FS_BYTES_PER_INODE);
+
+        superBlock.pointer_size = pointerSizeFor(BitVectorSize);
+        superBlock.dir_slots = 1;
+        while (superBlock.dir_slots < 2 * superBlock.max_inodes)
+            superBlock.dir_slots *= 2;
+
+        int block = blocksFor(FS_SUPERBLOCK_SIZE);
+        superBlock.bitmap_block = block;
+        block += blocksFor(bitmapBytes());
+        superBlock.inode_table_block = block;
+        block += blocksFor((long)superBlock.max_inodes * FS_INODE_SIZE);
+        superBlock.directory_block = block;
+        block += blocksFor((long)superBlock.dir_slots * FS_DIR_ENTRY_SIZE);
+        superBlock.refcount_block = block;
+        block += blocksFor((long)BitVectorSize * sizeof(uint16_t));
+        if (features & FS_FEATURE_DEDUP) {
+            superBlock.fingerprint_block = block;
+            block += blocksFor((long)BitVectorSize * sizeof(uint64_t));
+        }
+        if (features & FS_FEATURE_COMPRESS) {
+            superBlock.cluster_block = block;
+            block += blocksFor((long)clusterWords() * sizeof(uint64_t));
+        }
+        superBlock.journal_block = block;
+        if (features & FS_FEATURE_JOURNAL) {
+            long size = min(FS_MAX_JOURNAL_SIZE, max(FS_MIN_JOURNAL_SIZE, disk_size / 16));
+            superBlock.journal_size = (long)blocksFor(size) * block_size;
+        }
+        block += blocksFor(superBlock.journal_size);
+        superBlock.data_block = block;
+        superBlock.inline_size = (features & FS_FEATURE_INLINE) ? inlineSize : 0;
+    }
+
+    // entries of pointer blocks hold the block number plus one.
+    int pointerSizeFor(long dataBlocks) {
+        if (dataBlocks < (1 << 8))
+            return 1;
+        if (dataBlocks < (1 << 16))
+            return 2;
+        return 4;
+    }
+
+    long bitmapBytes() {
+        return (long)(BitVectorSize + BITMAP_WORD_BITS - 1) / BITMAP_WORD_BITS * sizeof(uint64_t);
+    }
+
+    long bitmapOffset() {
+        return (long)superBlock.bitmap_block * block_size;
+    }
+
+    long inodeOffset(int inode) {
+        return (long)superBlock.inode_table_block * block_size + (long)inode * FS_INODE_SIZE;
+    }
+
+    long dirEntryOffset(int slot) {
+        return (long)superBlock.directory_block * block_size + (long)slot * FS_DIR_ENTRY_SIZE;
+    }
+
+    long refCountOffset(int block) {
+        return (long)superBlock.refcount_block * block_size + (long)block * sizeof(uint16_t);
+    }
+
+    long fingerprintOffset(int block) {
+        return (long)superBlock.fingerprint_block * block_size + (long)block * sizeof(uint64_t);
+    }
+
+    int clusterWords() {
+        return (BitVectorSize + 63) / 64;
+    }
+
+    // of the word of the cluster bitmap holding the bit of block.
+    long clusterOffset(int block) {
+        return (long)superBlock.cluster_block * block_size + (long)(block / 64) * sizeof(uint64_t);
+    }
+
+    long journalOffset() {
+        return (long)superBlock.journal_block * block_size;
+    }
+
+    long dataRegionOffset() {
+        return (long)superBlock.data_block * block_size;
+    }
+
+    long imageSize() {
+        return dataRegionOffset() + disk_size;
+    }
+
+    // offset is in bytes from the start of the image, the range may cross blocks.
+    bool readMeta(long offset, char* buf, long len) {
+        while (len > 0) {
+            int inBlock = offset % block_size;
+            int chunk = min((long)block_size - inBlock, len);
+            if (!cache.read(offset / block_size, inBlock, buf, chunk))
+                return false;
+            offset += chunk;
+            buf += chunk;
+            len -= chunk;
+        }
+        return true;
+    }
+
+    bool writeMeta(long offset, const char* buf, long len) {
+        lock_guard<recursive_mutex> guard(meta_lock);
+        while (len > 0) {
+            int inBlock = offset % block_size;
+            int chunk = min((long)block_size - inBlock, len);
+            if (journal.isActive() && !journal.hasRoomFor(offset / block_size) && !splitTransaction())
+                return false;
+            if (!cache.write(offset / block_size, inBlock, buf, chunk, journal.isActive()))
+                return false;
+            if (journal.isActive() && !logBlock(offset / block_size))
+                return false;
+            offset += chunk;
+            buf += chunk;
+            len -= chunk;
+        }
+        return true;
+    }
+
+    // Pointer blocks and extent tree blocks are metadata in the data region.
+    bool writeMetaBlockRange(int block, int offset, const char* buf, int len) {
+        assert(offset >= 0 && len >= 0 && offset + len <= block_size);
+        return writeMeta(dataRegionOffset() + (long)block * block_size + offset, buf, len);
+    }
+
+    // ------------------------------------------------------------------------
+    // Journal - public calls that change metadata are operations. The
+    // changes of an operation are committed together with those of the
+    // operations around it, never split over two commits, unless they
+    // don't fit into the journal (see splitTransaction()).
+    class Operation {
+        fsDisk* fs;
+
+        // operations of this thread in progress, they nest.
+        inline static thread_local int nesting = 0;
+
+    public:
+        // once the batch is due, a new operation waits for the ones of
+        // other threads in progress to end and the batch to be committed,
+        // so overlapping operations don't keep the batch growing.
+        Operation(fsDisk* _fs) {
+            fs = _fs;
+            unique_lock<recursive_mutex> guard(fs->meta_lock);
+            while (nesting == 0 && fs->journal.isDue() && fs->journal.inProgress())
+                fs->journal_idle.wait(guard);
+            nesting++;
+            fs->journal.begin();
+        }
+
+        // the batch is committed once no operation of any thread is in
+        // progress, meta_lock keeps new ones from starting meanwhile.
+        ~Operation() {
+            lock_guard<recursive_mutex> guard(fs->meta_lock);
+            nesting--;
+            if (fs->journal.end() && !fs->commitJournal())
+                cerr << "ERR - could not commit the journal" << endl;
+            if (!fs->journal.inProgress())
+                fs->journal_idle.notify_all();
+        }
+    };
+
+    // Copies the block, as it is in the cache now, into the running
+    // transaction. writeMeta pinned it, so it isn't written in place before
+    // that is committed.
+    bool logBlock(long block) {
+        return cache.read(block, 0, journal.log(block), block_size);
+    }
+
+    // When the transaction doesn't fit behind the committed ones, those are
+    // checkpointed first: written in place, synced, and dropped from the
+    // journal. splitTransaction() keeps the blocks of a transaction within
+    // the journal; should its revokes still push it past the end, it is
+    // written in place without the journal.
+    bool commitJournal() {
+        lock_guard<recursive_mutex> guard(meta_lock);
+        if (!journal.isActive())
+            return true;
+
+        // the frees of the transaction go into it, a run at a time. Taken
+        // out first, the bitmap words may split the transaction, which
+        // commits them too.
+        vector<pair<int, int> > freed;
+        freed.swap(FreedBlocks);
+        sort(freed.begin(), freed.end());
+        for (size_t i = 0; i < freed.size();) {
+            int start = freed[i].first;
+            int end = start + freed[i].second;
+            for (i++; i < freed.size() && freed[i].first <= end; i++)
+                end = max(end, freed[i].first + freed[i].second);
+            BitVector.clearRange(start, end - start);
+            writeBitVectorRange(start, end - start);
+        }
+        if (!journal.hasPending())
+            return true;
+
+        if (!journal.fits() && (!cache.sync() || !journal.restart()))
+            return false;
+
+        if (!journal.canFit()) {
+            cerr << "ERR - transaction bigger than the journal, written in place without it" << endl;
+            journal.discard();
+            return cache.unpinAll() && cache.sync();
+        }
+        return journal.commit() && cache.unpinAll();
+    }
+
+    // Operations in progress, of this thread or of several, changed more
+    // blocks than the journal holds. What the transaction has so far is
+    // committed before the next block joins it, and the rest goes into the
+    // next one, so every change is still journaled before it is written in
+    // place. After a crash the disk may hold the first part of such an
+    // operation without the rest.
+    bool splitTransaction() {
+        if (!journal.hasPending())
+            return true;
+        journal.countSplit();
+        return commitJournal();
+    }
+
+    // Writes every dirty cached block back to the disk. With a journal, the
+    // running transaction is committed first, and the journal starts over
+    // once everything is in place.
+    bool syncDisk() {
+        lock_guard<recursive_mutex> guard(meta_lock);
+        if (!commitJournal() || !cache.sync() || (journal.isActive() && !journal.restart())) {
+            cerr << "ERR - could not write back to disk" << endl;
+            return false;
+        }
+        return true;
+    }
+
+    // Journaled blocks among the ones just freed must not be replayed over
+    // whatever they hold next.
+    void revokeFreedBlocks(int start, int length) {
+        long first = superBlock.data_block + (long)start;
+        for (long block : journal.loggedBetween(first, first + length)) {
+            if (!BitVector.test(block - superBlock.data_block))
+                journal.revoke(block);
+        }
+    }
+
+    void writeInode(fsInode* fsi) {
+        fsInodeRecord record;
+        fsi->toRecord(record);
+        int ret_val = writeMeta(inodeOffset(fsi->getInodeNumber()), (char*)&record, sizeof(record));
+        assert(ret_val);
+    }
+
+    fsDirEntry readDirEntry(int slot) {
+        fsDirEntry entry;
+        int ret_val = readMeta(dirEntryOffset(slot), (char*)&entry, sizeof(entry));
+        assert(ret_val);
+        return entry;
+    }
+
+    void writeDirEntry(int slot, const fsDirEntry& entry) {
+        int ret_val = writeMeta(dirEntryOffset(slot), (const char*)&entry, sizeof(entry));
+        assert(ret_val);
+    }
+
+    // Writes the bitmap word holding the block.
+    void writeBitVector(int block) {
+        writeBitVectorRange(block, 1);
+    }
+
+    // Writes the bitmap words holding blocks [start, start + length).
+    void writeBitVectorRange(int start, int length) {
+        if (length <= 0)
+            return;
+
+        int first = start / BITMAP_WORD_BITS;
+        int last = (start + length - 1) / BITMAP_WORD_BITS;
+        int ret_val = writeMeta(bitmapOffset() + (long)first * sizeof(uint64_t),
+            (char*)(BitVector.data() + first), (long)(last - first + 1) * sizeof(uint64_t));
+        assert(ret_val);
+        if (journal.isActive())
+            revokeFreedBlocks(start, length);
+    }
+
+    fsInode* allocateInode(int type) {
+        if (FreeInodes.empty()) {
+            cerr << "ERR - no free inodes" << endl;
+            return nullptr;
+        }
+
+        int inode = FreeInodes.back();
+        FreeInodes.pop_back();
+        int flags = type == FS_INODE_FILE && (superBlock.features & FS_FEATURE_EXTENTS) ? FS_INODE_EXTENTS : 0;
+        if (type == FS_INODE_FILE && superBlock.inline_size > 0)
+            flags |= FS_INODE_INLINE;
+        // any block of a dedup disk may end up shared.
+        if (type == FS_INODE_FILE && isDedupEnabled())
+            flags |= FS_INODE_SHARED;
+        if (type == FS_INODE_FILE && isCompressEnabled())
+            flags |= FS_INODE_COMPRESSED;
+        Inodes[inode] = new fsInode(block_size, inode, flags, type);
+        return Inodes[inode];
+    }
+
+    // Loads the inode from the inode table on first use.
+    fsInode* getInode(int inode) {
+        lock_guard<mutex> guard(inode_lock);
+        if (Inodes[inode] == nullptr) {
+            fsInodeRecord record;
+            int ret_val = readMeta(inodeOffset(inode), (char*)&record, sizeof(record));
+            assert(ret_val);
+            Inodes[inode] = new fsInode(block_size, inode, record);
+        }
+        return Inodes[inode];
+    }
+
+    // Frees the inode and its record, always returns -1 for error paths.
+    int releaseInode(fsInode* fsi) {
+        if (fsi == nullptr)
+            return -1;
+
+        fsInodeRecord record;
+        memset(&record, 0, sizeof(record));
+        int ret_val = writeMeta(inodeOffset(fsi->getInodeNumber()), (char*)&record, sizeof(record));
+        assert(ret_val);
+
+        FreeInodes.push_back(fsi->getInodeNumber());
+        Inodes[fsi->getInodeNumber()] = nullptr;
+        delete fsi;
+        return -1;
+    }
+
+    // a single path component.
+    bool isLegalFileName(string fileName) {
+        if (fileName.empty() || fileName.size() >= FS_NAME_LEN || fileName.find('/') != string::npos
+            || fileName == "." || fileName == "..") {
+            cerr << "ERR - illegal file name" << endl;
+            return false;
+        }
+        return true;
+    }
+
+    // ------------------------------------------------------------------------
+    // Directories - every lookup goes through the dentry cache first, and
+    // only probes the directory hash table on a miss.
+    uint32_t dirHash(int parent, const string& name) {
+        // FNV-1a, it is part of the disk format so it can't be std::hash.
+        uint32_t hash = 2166136261u;
+        for (int i = 0; i < 4; i++)
+            hash = (hash ^ ((parent >> (8 * i)) & 0xff)) * 16777619u;
+        for (unsigned char c : name)
+            hash = (hash ^ c) * 16777619u;
+        return hash;
+    }
+
+    int homeSlot(int parent, const string& name) {
+        return dirHash(parent, name) & (superBlock.dir_slots - 1);
+    }
+
+    int nextSlot(int slot) {
+        return (slot + 1) & (superBlock.dir_slots - 1);
+    }
+
+    bool entryMatches(const fsDirEntry& entry, int parent, const string& name) {
+        return entry.state == FS_DIR_SLOT_USED && entry.parent == parent
+            && strncmp(entry.name, name.c_str(), FS_NAME_LEN) == 0;
+    }
+
+    // Slot of the entry `name` in the directory, or -1.
+    int findEntry(fsInode* dir, const string& name) {
+        int parent = dir->getInodeNumber();
+        if (name.size() >= FS_NAME_LEN)
+            return -1;
+
+        int slot;
+        if (dentries.lookup(parent, name, slot))
+            return slot;
+
+        for (slot = homeSlot(parent, name); ; slot = nextSlot(slot)) {
+            fsDirEntry entry = readDirEntry(slot);
+            if (entry.state == FS_DIR_SLOT_FREE)
+                return -1;
+            if (entryMatches(entry, parent, name)) {
+                dentries.insert(parent, name, slot);
+                return slot;
+            }
+        }
+    }
+
+    // Adds the entry to the table and to the front of the directory's list.
+    // The table has more slots than there are inodes, so there is always
+    // a free one.
+    int addEntry(fsInode* dir, const string& name, fsInode* fsi) {
+        int parent = dir->getInodeNumber();
+        int slot = homeSlot(parent, name);
+        while (readDirEntry(slot).state != FS_DIR_SLOT_FREE)
+            slot = nextSlot(slot);
+
+        fsDirRoot& root = dir->getDir();
+        fsDirEntry entry;
+        memset(&entry, 0, sizeof(entry));
+        strncpy(entry.name, name.c_str(), FS_NAME_LEN - 1);
+        entry.state = FS_DIR_SLOT_USED;
+        entry.parent = parent;
+        entry.inode = fsi->getInodeNumber();
+        entry.next = root.first_entry;
+        entry.prev = -1;
+        writeDirEntry(slot, entry);
+
+        if (root.first_entry >= 0) {
+            fsDirEntry next = readDirEntry(root.first_entry);
+            next.prev = slot;
+            writeDirEntry(root.first_entry, next);
+        }
+        root.first_entry = slot;
+        root.entries++;
+        writeInode(dir);
+
+        fsi->setDirSlot(slot);
+        writeInode(fsi);
+        dentries.insert(parent, name, slot);
+        return slot;
+    }
+
+    // Unlinks the entry from its directory and frees its slot. Entries after
+    // it that would no longer be found from their home slot are moved back.
+    void removeEntry(fsInode* dir, int slot) {
+        fsDirEntry entry = readDirEntry(slot);
+        if (entry.prev >= 0) {
+            fsDirEntry prev = readDirEntry(entry.prev);
+            prev.next = entry.next;
+            writeDirEntry(entry.prev, prev);
+        }
+        else
+            dir->getDir().first_entry = entry.next;
+
+        if (entry.next >= 0) {
+            fsDirEntry next = readDirEntry(entry.next);
+            next.prev = entry.prev;
+            writeDirEntry(entry.next, next);
+        }
+        dir->getDir().entries--;
+        writeInode(dir);
+        dentries.erase(entry.parent, string(entry.name, strnlen(entry.name, FS_NAME_LEN)));
+
+        int hole = slot;
+        for (int cur = nextSlot(hole); ; cur = nextSlot(cur)) {
+            fsDirEntry moved = readDirEntry(cur);
+            if (moved.state == FS_DIR_SLOT_FREE)
+                break;
+
+            // the entry stays if its home is cyclically in (hole, cur].
+            int home = homeSlot(moved.parent, string(moved.name, strnlen(moved.name, FS_NAME_LEN)));
+            bool stays = hole <= cur ? (hole < home && home <= cur) : (hole < home || home <= cur);
+            if (stays)
+                continue;
+
+            moveEntry(moved, hole);
+            hole = cur;
+        }
+
+        fsDirEntry free;
+        memset(&free, 0, sizeof(free));
+        writeDirEntry(hole, free);
+    }
+
+    // Writes the entry at `slot`, and points everything that refers to
+    // its old slot at the new one.
+    void moveEntry(fsDirEntry& entry, int slot) {
+        writeDirEntry(slot, entry);
+
+        fsInode* dir = getInode(entry.parent);
+        if (entry.prev >= 0) {
+            fsDirEntry prev = readDirEntry(entry.prev);
+            prev.next = slot;
+            writeDirEntry(entry.prev, prev);
+        }
+        else {
+            dir->getDir().first_entry = slot;
+            writeInode(dir);
+        }
+
+        if (entry.next >= 0) {
+            fsDirEntry next = readDirEntry(entry.next);
+            next.prev = slot;
+            writeDirEntry(entry.next, next);
+        }
+
+        fsInode* fsi = getInode(entry.inode);
+        fsi->setDirSlot(slot);
+        writeInode(fsi);
+        dentries.insert(entry.parent, string(entry.name, strnlen(entry.name, FS_NAME_LEN)), slot);
+    }
+
+    string entryName(fsInode* fsi) {
+        if (fsi->getDirSlot() < 0)
+            return "/";
+        fsDirEntry entry = readDirEntry(fsi->getDirSlot());
+        return string(entry.name, strnlen(entry.name, FS_NAME_LEN));
+    }
+
+    // The path of the file from the root directory.
+    string pathOf(fsInode* fsi) {
+        string path = entryName(fsi);
+        for (fsInode* dir = parentOf(fsi); dir->getDirSlot() >= 0; dir = parentOf(dir))
+            path = entryName(dir) + "/" + path;
+        return path;
+    }
+
+    fsInode* parentOf(fsInode* dir) {
+        if (dir->getDirSlot() < 0)
+            return dir;
+        return getInode(readDirEntry(dir->getDirSlot()).parent);
+    }
+
+    vector<string> splitPath(const string& path) {
+        vector<string> parts;
+        size_t start = 0;
+        while (start <= path.size()) {
+            size_t end = path.find('/', start);
+            if (end == string::npos)
+                end = path.size();
+            if (end > start)
+                parts.push_back(path.substr(start, end - start));
+            start = end + 1;
+        }
+        return parts;
+    }
+
+    // Walks the components from the root, nullptr if one of them is missing.
+    fsInode* walkPath(const vector<string>& parts, int count) {
+        fsInode* cur = getInode(FS_ROOT_INODE);
+        for (int i = 0; i < count; i++) {
+            if (!cur->isDirectory())
+                return nullptr;
+            if (parts[i] == ".")
+                continue;
+            if (parts[i] == "..") {
+                cur = parentOf(cur);
+                continue;
+            }
+
+            int slot = findEntry(cur, parts[i]);
+            if (slot < 0)
+                return nullptr;
+            cur = getInode(readDirEntry(slot).inode);
+        }
+        return cur;
+    }
+
+    fsInode* lookupPath(const string& path) {
+        vector<string> parts = splitPath(path);
+        return walkPath(parts, parts.size());
+    }
+
+    // The directory that holds, or would hold, the last component of the
+    // path. The component itself goes to `name`.
+    fsInode* lookupParent(const string& path, string& name) {
+        vector<string> parts = splitPath(path);
+        fsInode* dir = parts.empty() ? nullptr : walkPath(parts, parts.size() - 1);
+        if (dir == nullptr || !dir->isDirectory()) {
+            cerr << "ERR - no such directory" << endl;
+            return nullptr;
+        }
+
+        name = parts.back();
+        return dir;
+    }
+
+    // Slot of the path's own directory entry, or -1. The directory holding
+    // it goes to `dir`.
+    int lookupEntry(const string& path, fsInode*& dir) {
+        vector<string> parts = splitPath(path);
+        if (parts.empty())
+            return -1;
+
+        dir = walkPath(parts, parts.size() - 1);
+        if (dir == nullptr || !dir->isDirectory())
+            return -1;
+        return findEntry(dir, parts.back());
+    }
+
+    // Gives every block of the file, data and mapping, back to the BitVector.
+    // Blocks other files still refer to only lose a reference.
+    void releaseFileBlocks(fsInode* fsi) {
+        if (!fsi->isExtentMapped()) {
+            queue<int> blocks = gatherAllAllocatedBlocks(fsi);
+            if (!fsi->isShared()) {
+                freeBlocks(blocks);
+                return;
+            }
+            for (pair<int, int>& run : blockRuns(blocks))
+                dropBlocks(run.first, run.second);
+            return;
+        }
+
+        loadExtents(fsi);
+        for (fsExtent& extent : fsi->getExtents()) {
+            if (fsi->isShared()) {
+                dropBlocks(extent.physical, extent.length);
+                continue;
+            }
+            releaseBlocks(extent.physical, extent.length);
+        }
+
+        queue<int> treeBlocks;
+        for (int block : fsi->getExtentTreeBlocks())
+            treeBlocks.push(block);
+        freeBlocks(treeBlocks);
+    }
+
+    queue<int> gatherAllAllocatedBlocks(fsInode* fsi) {
+        queue<int> blocks;
+        loadBlockMap(fsi);
+        for (int i = 0; i < fsi->getDataBlocks(); i++) {
+            gatherBlocksByIndex(fsi, i, blocks);
+        }
+        return blocks;
+    }
+
+    void gatherBlocksByIndex(fsInode* fsi, int index, queue<int>& blocks) {
+        int tempBlock;
+        int firstSingleIndirectIndex = DIRECT_BLOCKS;
+
+        int firstDoubleIndirectIndex = DIRECT_BLOCKS + pointersPerBlock();
+        int doubleIndirectIndex = index - firstDoubleIndirectIndex;
+
+        // holes, and the pointer blocks above nothing but holes, are -1.
+        auto push = [&blocks](int block) {
+            if (block >= 0)
+                blocks.push(block);
+        };
+
+        if (index < firstSingleIndirectIndex) {
+            push(fsi->getDirectBlock(index));
+            return;
+        }
+
+        if (index < firstDoubleIndirectIndex) {
+            if (index == firstSingleIndirectIndex)
+                push(fsi->getSingleIndirect());
+            push(getDataBlockByIndex(fsi, index));
+            return;
+        }
+
+        tempBlock = fsi->getDoubleIndirect();
+        if (index == firstDoubleIndirectIndex)
+            push(tempBlock);
+
+        // the inner pointer block is read only where it starts, the data
+        // block comes from the block map.
+        if (doubleIndirectIndex % pointersPerBlock() == 0 && tempBlock >= 0)
+            push(readPointer(tempBlock, doubleIndirectIndex / pointersPerBlock()));
+
+        push(getDataBlockByIndex(fsi, index));
+    }
+
+    // ------------------------------------------------------------------------
+    // Block level I/O - every disk access goes through these. Callers split
+    // byte ranges at block boundaries, so each call touches one cached block.
+    bool readBlock(int block, char* buf) {
+        return readBlockRange(block, 0, buf, block_size);
+    }
+
+    bool writeBlock(int block, const char* buf) {
+        return writeBlockRange(block, 0, buf, block_size);
+    }
+
+    bool readBlockRange(int block, int offset, char* buf, int len) {
+        assert(offset >= 0 && len >= 0 && offset + len <= block_size);
+        return cache.read(superBlock.data_block + block, offset, buf, len);
+    }
+
+    bool writeBlockRange(int block, int offset, const char* buf, int len) {
+        assert(offset >= 0 && len >= 0 && offset + len <= block_size);
+        return cache.write(superBlock.data_block + block, offset, buf, len);
+    }
+
+    // For a block whose old content is not used, the rest of it reads as zeros.
+    bool writeNewBlockRange(int block, int offset, const char* buf, int len) {
+        assert(offset >= 0 && len >= 0 && offset + len <= block_size);
+        return cache.writeNew(superBlock.data_block + block, offset, buf, len);
+    }
+
+    // Called before a read of the block `index` through the cache. A read
+    // of the block the last one stopped in, or of the one after, is
+    // sequential: once it gets past what was read ahead, the next window is
+    // fetched, twice the size of the last one. Any other read drops the
+    // window.
+    void readAhead(fsInode* fsi, int index) {
+        ReadAheadState& state = fsi->getReadAhead();
+        int next = state.next.exchange(index + 1);
+        if (index != next && index + 1 != next) {
+            state.window = 0;
+            state.end = index + 1;
+            return;
+        }
+        if (index < state.end)
+            return;
+
+        int maxWindow = max(1, min((int)(FS_READAHEAD_MAX_BYTES / block_size), cache.getCapacity() / 4));
+        int window = min(max(state.window * 2, FS_READAHEAD_MIN_BLOCKS), maxWindow);
+        window = min(window, dataBlocksForFileSize(fsi->getFileSize()) - index);
+        state.window = window;
+        state.end = index + window;
+
+        for (int done = 0; done < window;) {
+            int physical;
+            int run = mappedRun(fsi, index + done, window - done, physical);
+            if (physical < 0 || run <= 0) {
+                done++;
+                continue;
+            }
+            // only a hint, a failed read ahead shows up again on the read.
+            cache.prefetch(superBlock.data_block + physical, run);
+            done += run;
+        }
+    }
+
+    // ------------------------------------------------------------------------
+    // File I/O of the public calls, under the lock of the inode.
+    int readFileAt(fsInode* fsi, long offset, char* buf, int len) {
+        if (offset < 0 || len < 0) {
+            cerr << "ERR - illegal offset or length" << endl;
+            return -1;
+        }
+
+        shared_lock<shared_mutex> guard = lockForRead(fsi);
+        return readDataAt(fsi, offset, buf, len);
+    }
+
+    int readFileVAt(fsInode* fsi, long offset, const struct iovec* iov, int iovcnt) {
+        long total = 0;
+        for (int i = 0; i < iovcnt; i++)
+            total += iov[i].iov_len;
+        if (offset < 0 || iovcnt < 0 || total > INT32_MAX) {
+            cerr << "ERR - illegal offset or length" << endl;
+            return -1;
+        }
+
+        shared_lock<shared_mutex> guard = lockForRead(fsi);
+        if (offset >= fsi->getFileSize())
+            return 0;
+        total = min(total, fsi->getFileSize() - offset);
+
+        // whole-block runs that are contiguous on the disk go to the buffers
+        // with one preadv, the rest block by block through readDataAt.
+        int done = 0;
+        int current = 0;
+        size_t inBuffer = 0;
+        while (done < total) {
+            while (inBuffer == iov[current].iov_len) {
+                current++;
+                inBuffer = 0;
+            }
+            long charIndex = offset + done;
+            int inBlock = charIndex % block_size;
+            int physical;
+            int run = fsi->isInline() || fsi->isCompressed() ? 0
+                : directRun(fsi, charIndex / block_size, inBlock, total - done, physical);
+            if (run > 0) {
+                vector<struct iovec> parts;
+                for (long want = (long)run * block_size; want > 0; ) {
+                    size_t chunk = min((size_t)want, iov[current].iov_len - inBuffer);
+                    parts.push_back({ (char*)iov[current].iov_base + inBuffer, chunk });
+                    want -= chunk;
+                    inBuffer += chunk;
+                    if (want > 0) {
+                        current++;
+                        inBuffer = 0;
+                    }
+                }
+                if (!cache.readRunV(superBlock.data_block + physical, run, parts.data(), parts.size())) {
+                    cerr << "ERR - could not read from disk" << endl;
+                    return -1;
+                }
+                fsi->getReadAhead().next = charIndex / block_size + run;
+                done += run * block_size;
+                continue;
+            }
+
+            // a compressed file goes to readDataAt a buffer at a time, its
+            // clusters aren't read block by block.
+            long inChunk = fsi->isCompressed() ? total - done : block_size - inBlock;
+            int chunk = min(inChunk, (long)(iov[current].iov_len - inBuffer));
+            chunk = min(chunk, (int)total - done);
+            if (readDataAt(fsi, charIndex, (char*)iov[current].iov_base + inBuffer, chunk) < 0)
+                return -1;
+            done += chunk;
+            inBuffer += chunk;
+        }
+        return done;
+    }
+
+    int writeFileAt(fsInode* fsi, long offset, const char* buf, int len) {
+        if (offset < 0 || len < 0) {
+            cerr << "ERR - illegal offset or length" << endl;
+            return -1;
+        }
+
+        unique_lock<shared_mutex> guard(fsi->getLock());
+        Operation op(this);
+        if (maxFileSize(fsi) <= offset) {
+            cerr << "ERR - offset is past the maximum file size" << endl;
+            return -1;
+        }
+
+        if (offset == fsi->getSize())
+            return appendData(fsi, buf, len);
+        if (!flushDelayed(fsi))
+            return -1;
+        return writeDataAt(fsi, offset, buf, len);
+    }
+
+    // ------------------------------------------------------------------------
+    // Inline data - small files keep their bytes in the inode record, so
+    // they take no block and are read with the inode.
+    bool fitsInline(fsInode* fsi, long size) {
+        return fsi->isInline() && size <= superBlock.inline_size;
+    }
+
+    // Moves the data of an inline file to a block, the file is mapped by
+    // blocks from then on. The block is checked for and taken under one
+    // hold of meta_lock, so the data is never left without a place.
+    bool promoteInline(fsInode* fsi) {
+        lock_guard<recursive_mutex> guard(meta_lock);
+        long size = fsi->getFileSize();
+        // a compressed file stores the data as a cluster.
+        int needed = fsi->isCompressed() && size > 0 ? clusterWriteBlocks(fsi, 0, size) : 1;
+        if (size > 0 && !haveFreeBlocks(needed)) {
+            cerr << "ERR - could not allocate enough blocks" << endl;
+            return false;
+        }
+
+        char data[FS_INLINE_DATA_SIZE];
+        memcpy(data, fsi->getInlineData(), size);
+        fsi->clearInline();
+        if (size == 0) {
+            writeInode(fsi);
+            return true;
+        }
+        return writeDataAt(fsi, 0, data, size) == size;
+    }
+
+    // ------------------------------------------------------------------------
+    // Truncation and holes - blocks leave the middle or the end of a file.
+    // Extent mapped files split or trim their extents, pointer mapped files
+    // clear the pointers and free the pointer blocks left with no block
+    // under them. A compressed cluster is stored again without the bytes
+    // cut or punched. Delayed appends are dealt with by the callers.
+    bool truncateFile(fsInode* fsi, long size) {
+        long fileSize = fsi->getFileSize();
+        if (fsi->isInline()) {
+            if (size <= superBlock.inline_size) {
+                if (size < fileSize)
+                    memset(fsi->getInlineData() + size, 0, fileSize - size);
+                fsi->setFileSize(size);
+                writeInode(fsi);
+                return true;
+            }
+            if (!promoteInline(fsi))
+                return false;
+        }
+
+        int keep = dataBlocksForFileSize(min(size, fileSize));
+        if (size < fileSize) {
+            if (fsi->isCompressed() && !cutCluster(fsi, size))
+                return false;
+            // the rest of the new last block reads as zeros if the file grows.
+            if (!clearRange(fsi, size, (long)keep * block_size) || !unmapRange(fsi, keep, INT32_MAX))
+                return false;
+            if (!fsi->isExtentMapped())
+                fsi->setDataBlocks(min(fsi->getDataBlocks(), keep));
+        }
+        else {
+            // what grows is a hole, blocks preallocated there are given back.
+            if (!clearRange(fsi, fileSize, min(size, (long)keep * block_size))
+                || !unmapRange(fsi, keep, dataBlocksForFileSize(size)))
+                return false;
+        }
+
+        fsi->setFileSize(size);
+        writeInode(fsi);
+        return true;
+    }
+
+    bool punchRange(fsInode* fsi, long from, long to) {
+        long fileSize = fsi->getFileSize();
+        if (fsi->isInline()) {
+            if (from < fileSize)
+                memset(fsi->getInlineData() + from, 0, min(to, fileSize) - from);
+            writeInode(fsi);
+            return true;
+        }
+
+        if (fsi->isCompressed())
+            return punchClusters(fsi, from, to);
+        return punchBlocks(fsi, from, to);
+    }
+
+    // Blocks past the end go whole, only what the file shows of a partly
+    // covered block is zeroed.
+    bool punchBlocks(fsInode* fsi, long from, long to) {
+        long fileSize = fsi->getFileSize();
+        int first = dataBlocksForFileSize(from);
+        int end = min(to / block_size, (long)INT32_MAX);
+        if (first >= end)
+            return clearRange(fsi, from, min(to, fileSize));
+        return unmapRange(fsi, first, end) && clearRange(fsi, from, min((long)first * block_size, fileSize))
+            && clearRange(fsi, (long)end * block_size, min(to, fileSize));
+    }
+
+    // Zeroes [from, to), inside one block, in the file's own copy of it.
+    // Inside a compressed cluster, the cluster is stored again.
+    bool clearRange(fsInode* fsi, long from, long to) {
+        if (from >= to)
+            return true;
+        if (fsi->isCompressed() && isCompressedCluster(fsi, from / clusterBytes()))
+            return clearCluster(fsi, from, to);
+        if (fsi->isShared() && !unshareRange(fsi, from, to - from))
+            return false;
+        return zeroRange(fsi, from, to);
+    }
+
+    // Frees the blocks [first, end) of the file, the range becomes a hole.
+    bool unmapRange(fsInode* fsi, int first, int end) {
+        if (!fsi->isExtentMapped())
+            return unmapPointerRange(fsi, first, end);
+
+        loadExtents(fsi);
+        vector<fsExtent>& extents = fsi->getExtents();
+        vector<fsExtent> saved = extents;
+        vector<fsExtent> kept;
+        vector<fsExtent> removed;
+        int firstChanged = -1;
+        for (fsExtent& extent : saved) {
+            int start = max(extent.logical, first);
+            int stop = min((long)extent.logical + extent.length, (long)end);
+            if (start >= stop) {
+                kept.push_back(extent);
+                continue;
+            }
+
+            firstChanged = firstChanged < 0 ? kept.size() : firstChanged;
+            if (extent.logical < start)
+                kept.push_back(fsExtent{ extent.logical, extent.physical, start - extent.logical });
+            removed.push_back(fsExtent{ start, extent.physical + start - extent.logical, stop - start });
+            if (stop < extent.logical + extent.length)
+                kept.push_back(fsExtent{ stop, extent.physical + stop - extent.logical, extent.logical + extent.length - stop });
+        }
+        if (removed.empty())
+            return true;
+
+        // a hole in the middle of an extent splits it, the tree may need a
+        // block for that.
+        extents = kept;
+        if (!writeExtentTree(fsi, firstChanged)) {
+            extents = saved;
+            cerr << "ERR - not enough space" << endl;
+            return false;
+        }
+
+        for (fsExtent& extent : removed) {
+            if (fsi->isShared())
+                dropBlocks(extent.physical, extent.length);
+            else
+                releaseBlocks(extent.physical, extent.length);
+            fsi->addDataBlocks(-extent.length);
+        }
+        writeInode(fsi);
+        return true;
+    }
+
+    bool unmapPointerRange(fsInode* fsi, int first, int end) {
+        loadBlockMap(fsi);
+        vector<int>& map = fsi->getBlockMap();
+        end = min(end, (int)map.size());
+        int freed = 0;
+        for (int index = first; index < end; index++) {
+            int block = map[index];
+            if (block < 0)
+                continue;
+
+            setDataBlockByIndex(fsi, index, -1);
+            if (fsi->isShared())
+                dropBlocks(block, 1);
+            else
+                releaseBlocks(block, 1);
+            freed++;
+        }
+        if (freed == 0)
+            return true;
+
+        fsi->addTotalBlocks(-freed);
+        releaseEmptyPointerBlocks(fsi, first, end);
+        writeInode(fsi);
+        return true;
+    }
+
+    // Frees the pointer blocks over [first, end) with nothing but holes
+    // under them. Pointer blocks are never shared.
+    void releaseEmptyPointerBlocks(fsInode* fsi, int first, int end) {
+        vector<int>& map = fsi->getBlockMap();
+        auto allHoles = [&map](int from, int to) {
+            for (int i = from; i < min(to, (int)map.size()); i++) {
+                if (map[i] >= 0)
+                    return false;
+            }
+            return true;
+        };
+
+        int firstSingleIndirectIndex = DIRECT_BLOCKS;
+        int firstDoubleIndirectIndex = DIRECT_BLOCKS + pointersPerBlock();
+        queue<int> blocks;
+        if (first < firstDoubleIndirectIndex && end > firstSingleIndirectIndex && fsi->getSingleIndirect() >= 0
+            && allHoles(firstSingleIndirectIndex, firstDoubleIndirectIndex)) {
+            blocks.push(fsi->getSingleIndirect());
+            fsi->setSingleIndirect(-1);
+        }
+
+        int doubleIndirect = fsi->getDoubleIndirect();
+        if (end > firstDoubleIndirectIndex && doubleIndirect >= 0) {
+            int innerEnd = ((int)map.size() - firstDoubleIndirectIndex + pointersPerBlock() - 1) / pointersPerBlock();
+            int innerFirst = max(first - firstDoubleIndirectIndex, 0) / pointersPerBlock();
+            int innerLast = (end - 1 - firstDoubleIndirectIndex) / pointersPerBlock();
+            bool empty = true;
+            for (int inner = 0; inner < innerEnd; inner++) {
+                int block = readPointer(doubleIndirect, inner);
+                int start = firstDoubleIndirectIndex + inner * pointersPerBlock();
+                if (block >= 0 && inner >= innerFirst && inner <= innerLast
+                    && allHoles(start, start + pointersPerBlock())) {
+                    blocks.push(block);
+                    writePointer(doubleIndirect, inner, -1);
+                    block = -1;
+                }
+                empty = empty && block < 0;
+            }
+            if (empty) {
+                blocks.push(doubleIndirect);
+                fsi->setDoubleIndirect(-1);
+            }
+        }
+
+        fsi->addTotalBlocks(-(int)blocks.size());
+        freeBlocks(blocks);
+    }
+
+    // ------------------------------------------------------------------------
+    // Delayed allocation - appends stay in memory with the blocks they need
+    // set aside, but not chosen. They get their blocks all at once when they
+    // are flushed, so the allocator sees the whole range: once
+    // FS_DELAYED_MAX_BYTES pile up, and before anything but another append
+    // uses the file (reads, writes elsewhere, close, copy, sync).
+
+    // Appends to the file, under the lock of the inode held alone. Written
+    // right away instead when the blocks can't be set aside, so running out
+    // of space shows up as before. Returns the amount appended, or -1.
+    int appendData(fsInode* fsi, const char* buf, int len) {
+        int total = min((long)len, maxFileSize(fsi) - fsi->getSize());
+        if (total <= 0)
+            return 0;
+
+        // an inline file that stays inline needs no blocks to wait for.
+        if (fsi->getDelayed().empty() && fitsInline(fsi, fsi->getFileSize() + total))
+            return writeDataAt(fsi, fsi->getFileSize(), buf, total);
+
+        bool reserved = false;
+        {
+            lock_guard<recursive_mutex> guard(meta_lock);
+            int more = delayedBlocksFor(fsi, fsi->getSize() + total) - fsi->getReservedBlocks();
+            if (more <= 0 || BitVector.getFreeBlocks() - ReservedBlocks >= more) {
+                more = max(more, 0);
+                ReservedBlocks += more;
+                fsi->setReservedBlocks(fsi->getReservedBlocks() + more);
+                DelayedInodes.insert(fsi->getInodeNumber());
+                reserved = true;
+            }
+        }
+        if (!reserved) {
+            if (!flushDelayed(fsi))
+                return -1;
+            return writeDataAt(fsi, fsi->getFileSize(), buf, len);
+        }
+
+        vector<char>& delayed = fsi->getDelayed();
+        delayed.insert(delayed.end(), buf, buf + total);
+        if ((long)delayed.size() >= FS_DELAYED_MAX_BYTES && !flushDelayed(fsi))
+            return -1;
+        return total;
+    }
+
+    // Blocks the file needs beyond the mapped ones to be newSize bytes long,
+    // at most. Extent mapped files may need blocks for the tree, and the
+    // blocks a shared file has from its old last one on get copies first.
+    // The data of an inline file has no blocks yet.
+    int delayedBlocksFor(fsInode* fsi, long newSize) {
+        long mappedSize = fsi->isInline() ? 0 : fsi->getFileSize();
+        // the old last cluster of a compressed file is stored again, and the
+        // data of an inline one is stored as a cluster before that.
+        if (fsi->isCompressed()) {
+            int promoted = fsi->isInline() && fsi->getFileSize() > 0 ? clusterWriteBlocks(fsi, 0, fsi->getFileSize()) : 0;
+            return promoted + (newSize > mappedSize ? clusterWriteBlocks(fsi, mappedSize, newSize) : 0);
+        }
+        int unshared = 0;
+        if (fsi->isShared() && !fsi->isInline()) {
+            int first = mappedSize / block_size;
+            int end = dataBlocksForFileSize(newSize);
+            unshared = max(0, end - first - countHoles(fsi, first, end));
+        }
+        if (fsi->isExtentMapped() && fsi->isInline())
+            return dataBlocksForFileSize(newSize) + 1;
+        if (fsi->isExtentMapped()) {
+            // the old last block may be a hole as well, and on a fragmented
+            // disk every new block may become an extent of its own.
+            int added = countHoles(fsi, mappedSize / block_size, dataBlocksForFileSize(newSize));
+            int tree = extentTreeBlocksFor(fsi->getExtents().size() + 2 * unshared + added)
+                - (int)fsi->getExtentTreeBlocks().size();
+            return added + max(1, tree) + unshared;
+        }
+
+        mappedSize = (long)fsi->getDataBlocks() * block_size;
+        if (mappedSize >= fsi->getFileSize() && !hasHoles(fsi))
+            return max(0, neededBlocksFor(newSize) - neededBlocksFor(mappedSize)) + unshared;
+        // a sparse file may also miss the single or the double indirect
+        // block and an inner one in front of the new blocks.
+        long from = fsi->getFileSize() / block_size * block_size;
+        return max(0, neededBlocksFor(newSize) - neededBlocksFor(from)) + 2 + unshared;
+    }
+
+    // Writes the delayed appends of the file in one go. They are gone from
+    // memory even when that fails.
+    bool flushDelayed(fsInode* fsi) {
+        if (fsi->getDelayed().empty())
+            return true;
+
+        // the blocks set aside are given back and taken for real under one
+        // hold of meta_lock, so no other file gets them in between.
+        lock_guard<recursive_mutex> guard(meta_lock);
+        vector<char> data;
+        data.swap(fsi->getDelayed());
+        ReservedBlocks -= fsi->getReservedBlocks();
+        fsi->setReservedBlocks(0);
+        DelayedInodes.erase(fsi->getInodeNumber());
+        return writeDataAt(fsi, fsi->getFileSize(), data.data(), data.size()) == (int)data.size();
+    }
+
+    // Keeps the first `keep` bytes of the delayed appends. The blocks set
+    // aside stay until the rest is flushed, or go with the last byte.
+    void trimDelayed(fsInode* fsi, long keep) {
+        lock_guard<recursive_mutex> guard(meta_lock);
+        vector<char>& delayed = fsi->getDelayed();
+        delayed.resize(min(keep, (long)delayed.size()));
+        if (!delayed.empty())
+            return;
+
+        delayed.shrink_to_fit();
+        ReservedBlocks -= fsi->getReservedBlocks();
+        fsi->setReservedBlocks(0);
+        DelayedInodes.erase(fsi->getInodeNumber());
+    }
+
+    // Every file's delayed appends, with fs_lock held alone.
+    bool flushAllDelayed() {
+        set<int> inodes;
+        {
+            lock_guard<recursive_mutex> guard(meta_lock);
+            inodes.swap(DelayedInodes);
+        }
+        bool flushed = true;
+        for (int inode : inodes) {
+            Operation op(this);
+            flushed = flushDelayed(getInode(inode)) && flushed;
+        }
+        return flushed;
+    }
+
+    long fileSizeOf(fsInode* fsi) {
+        shared_lock<shared_mutex> guard(fsi->getLock());
+        return fsi->getSize();
+    }
+
+    // Reads share the lock of the inode, so what a read would load lazily,
+    // the extent tree or the block map, is loaded before, under the
+    // exclusive lock. Delayed appends get their blocks the same way.
+    shared_lock<shared_mutex> lockForRead(fsInode* fsi) {
+        while (true) {
+            shared_lock<shared_mutex> guard(fsi->getLock());
+            bool loaded = fsi->isExtentMapped() ? fsi->areExtentsLoaded() : fsi->isBlockMapLoaded();
+            if (loaded && fsi->getDelayed().empty())
+                return guard;
+            guard.unlock();
+
+            unique_lock<shared_mutex> exclusive(fsi->getLock());
+            if (fsi->isExtentMapped())
+                loadExtents(fsi);
+            else
+                loadBlockMap(fsi);
+            Operation op(this);
+            flushDelayed(fsi);
+        }
+    }
+
+    int readDataFromFile(fsInode* fsi, char* buf, int len) {
+        int total = readDataAt(fsi, 0, buf, len);
+        if (total >= 0)
+            buf[total] = '\0';
+        return total;
+    }
+
+    // Only the blocks covering [offset, offset + len) are looked up. Whole
+    // blocks that are contiguous on the disk, FS_DIRECT_IO_BYTES or more of
+    // them, move with a single disk request that bypasses the cache. Blocks
+    // in a hole read as zeros.
+    int readDataAt(fsInode* fsi, long offset, char* buf, int len) {
+        if (offset >= fsi->getFileSize())
+            return 0;
+        int total = min((long)len, fsi->getFileSize() - offset);
+
+        if (fsi->isInline()) {
+            memcpy(buf, fsi->getInlineData() + offset, total);
+            return total;
+        }
+
+        if (fsi->isCompressed())
+            return readClustersAt(fsi, offset, buf, total);
+        return readBlocksAt(fsi, offset, buf, total);
+    }
+
+    // Reads [offset, offset + total) from the blocks of the file, all
+    // inside the file.
+    int readBlocksAt(fsInode* fsi, long offset, char* buf, int total) {
+        int i = 0;
+        while (i < total) {
+            long charIndex = offset + i;
+            int inBlock = charIndex % block_size;
+            int chunk = min(block_size - inBlock, total - i);
+            int physical;
+            int run = directRun(fsi, charIndex / block_size, inBlock, total - i, physical);
+            if (run > 0) {
+                if (!cache.readRun(superBlock.data_block + physical, run, buf + i)) {
+                    cerr << "ERR - could not read from disk" << endl;
+                    return -1;
+                }
+                fsi->getReadAhead().next = charIndex / block_size + run;
+                i += run * block_size;
+                continue;
+            }
+
+            int currentBlock = getDataBlockByIndex(fsi, charIndex / block_size);
+            if (currentBlock >= 0)
+                readAhead(fsi, charIndex / block_size);
+            if (currentBlock < 0)
+                memset(buf + i, 0, chunk);
+            else if (!readBlockRange(currentBlock, inBlock, buf + i, chunk)) {
+                cerr << "ERR - could not read from disk" << endl;
+                return -1;
+            }
+            i += chunk;
+        }
+
+        return total;
+    }
+
+    // The blocks are held in the cache for the spans, a hole gets a span of
+    // zeroBlock and holds nothing. A span of a compressed cluster keeps the
+    // decompressed cluster instead. On a failed read the blocks held so far
+    // are let go.
+    int readSpans(fsInode* fsi, long offset, int len, vector<fsSpan>& spans) {
+        if (offset >= fsi->getFileSize())
+            return 0;
+        int total = min((long)len, fsi->getFileSize() - offset);
+
+        if (fsi->isInline()) {
+            fsSpan span = { nullptr, total, -1, {}, nullptr };
+            memcpy(span.bytes, fsi->getInlineData() + offset, total);
+            spans.push_back(span);
+            return total;
+        }
+
+        // the cache grows past its capacity to keep held blocks, a call
+        // doesn't take more than half of it.
+        long maxBytes = (long)max(1, cache.getCapacity() / 2) * block_size - offset % block_size;
+        total = min((long)total, maxBytes);
+        size_t first = spans.size();
+        int i = 0;
+        while (i < total) {
+            long charIndex = offset + i;
+            int inBlock = charIndex % block_size;
+            int chunk = min(block_size - inBlock, total - i);
+            fsSpan span = { zeroBlock.data() + inBlock, chunk, -1, {}, nullptr };
+            int found = fsi->isCompressed() ? loadCluster(fsi, charIndex / clusterBytes(), span.cluster) : 0;
+            int currentBlock = found == 0 ? getDataBlockByIndex(fsi, charIndex / block_size) : -1;
+            const char* cached = nullptr;
+            if (currentBlock >= 0) {
+                readAhead(fsi, charIndex / block_size);
+                cached = cache.hold(superBlock.data_block + currentBlock);
+            }
+            if (found < 0 || (currentBlock >= 0 && cached == nullptr)) {
+                vector<fsSpan> held(spans.begin() + first, spans.end());
+                spans.resize(first);
+                ReleaseSpans(held);
+                cerr << "ERR - could not read from disk" << endl;
+                return -1;
+            }
+
+            long inCluster = charIndex % clusterBytes();
+            if (found > 0 && inCluster < (long)span.cluster->size()) {
+                span.ptr = span.cluster->data() + inCluster;
+                span.len = min((long)chunk, (long)span.cluster->size() - inCluster);
+            }
+            else if (cached != nullptr) {
+                span.ptr = cached + inBlock;
+                span.block = superBlock.data_block + currentBlock;
+            }
+            spans.push_back(span);
+            i += span.len;
+        }
+        return total;
+    }
+
+    // Maps the blocks of the range, then writes it. Returns the amount of
+    // bytes written, cut short at the maximum file size, or -1.
+    int writeDataAt(fsInode* fsi, long offset, const char* buf, int len) {
+        int total = min((long)len, maxFileSize(fsi) - offset);
+        if (total <= 0)
+            return 0;
+
+        // the gap up to offset is zero in the record already.
+        if (fitsInline(fsi, offset + total)) {
+            memcpy(fsi->getInlineData() + offset, buf, total);
+            if (offset + total > fsi->getFileSize())
+                fsi->addFileSize(offset + total - fsi->getFileSize());
+            writeInode(fsi);
+            return total;
+        }
+
+        if (fsi->isInline() && !promoteInline(fsi))
+            return -1;
+
+        if (isDedupEnabled())
+            return writeDedupData(fsi, offset, buf, total);
+        if (fsi->isCompressed())
+            return writeClusters(fsi, offset, buf, total);
+        return writeBlocksAt(fsi, offset, buf, total);
+    }
+
+    // Writes to the blocks of the file, mapping those it doesn't have.
+    int writeBlocksAt(fsInode* fsi, long offset, const char* buf, int total) {
+        if (!mapRange(fsi, offset, total))
+            return -1;
+
+        int i = 0;
+        while (i < total) {
+            long charIndex = offset + i;
+            int inBlock = charIndex % block_size;
+            int chunk = min(block_size - inBlock, total - i);
+            int physical;
+            int run = directRun(fsi, charIndex / block_size, inBlock, total - i, physical);
+            if (run > 0) {
+                if (!cache.writeRun(superBlock.data_block + physical, run, buf + i)) {
+                    cerr << "ERR - could not write to disk" << endl;
+                    return -1;
+                }
+                i += run * block_size;
+                continue;
+            }
+
+            // a block past the end of the file holds nothing to keep, a
+            // small append starts it in the cache without reading it.
+            int currentBlock = getDataBlockByIndex(fsi, charIndex / block_size);
+            bool fresh = charIndex - inBlock >= fsi->getFileSize();
+            if (!(fresh ? writeNewBlockRange(currentBlock, inBlock, buf + i, chunk)
+                    : writeBlockRange(currentBlock, inBlock, buf + i, chunk))) {
+                cerr << "ERR - could not write to disk" << endl;
+                return -1;
+            }
+            i += chunk;
+        }
+
+        if (offset + total > fsi->getFileSize())
+            fsi->addFileSize(offset + total - fsi->getFileSize());
+        writeInode(fsi);
+        return total;
+    }
+
+    // Makes sure every block of [offset, offset + len) is mapped, and that
+    // whatever the file will expose between its old end and offset reads
+    // as zeros. The gap is left a hole.
+    bool mapRange(fsInode* fsi, long offset, int len) {
+        int first = offset / block_size;
+        int last = (offset + len - 1) / block_size;
+
+        // the shared blocks the write covers whole move uncopied, the rest
+        // of the mapping may not run out of room after that.
+        unique_lock<recursive_mutex> guard(meta_lock, defer_lock);
+        if (fsi->isShared()) {
+            guard.lock();
+            if (!unshareRange(fsi, offset, len, countHoles(fsi, first, last + 1)))
+                return false;
+        }
+
+        // blocks mapped ahead of the end (preallocated) hold stale data, and
+        // so may the old last block after the old end.
+        long fileSize = fsi->getFileSize();
+        if (offset > fileSize && !zeroRange(fsi, fileSize, offset))
+            return false;
+
+        bool firstNew = getDataBlockByIndex(fsi, first) < 0;
+        bool lastNew = getDataBlockByIndex(fsi, last) < 0;
+
+        bool mapped = fsi->isExtentMapped() ? mapExtentRange(fsi, first, last + 1)
+            : mapPointerRange(fsi, first, last + 1);
+        if (!mapped)
+            return false;
+
+        // new blocks only partly covered by the write start out zeroed.
+        bool partialFirst = offset % block_size != 0 || (first == last && (offset + len) % block_size != 0);
+        bool partialLast = last != first && (offset + len) % block_size != 0;
+        if (firstNew && partialFirst && !writeNewBlockRange(getDataBlockByIndex(fsi, first), 0, nullptr, 0))
+            return false;
+        if (lastNew && partialLast && !writeNewBlockRange(getDataBlockByIndex(fsi, last), 0, nullptr, 0))
+            return false;
+        return true;
+    }
+
+    // Zeroes the bytes of [from, to) in the blocks that are mapped there,
+    // holes read as zeros already. The blocks must not be shared.
+    bool zeroRange(fsInode* fsi, long from, long to) {
+        vector<char> zeros(block_size, 0);
+        int index = from / block_size;
+        int end = dataBlocksForFileSize(to);
+        if (!fsi->isExtentMapped())
+            end = min(end, fsi->getDataBlocks());
+
+        while (index < end) {
+            int run = 1;
+            int physical = fsi->isExtentMapped() ? mapExtent(fsi, index, run) : getDataBlockByIndex(fsi, index);
+            run = min(run, end - index);
+            for (int i = 0; physical >= 0 && i < run; i++) {
+                long blockStart = (long)(index + i) * block_size;
+                int first = max(from, blockStart) - blockStart;
+                int last = min(to, blockStart + block_size) - blockStart;
+                bool zeroed = first == 0 && last == block_size ? writeNewBlockRange(physical + i, 0, nullptr, 0)
+                    : writeBlockRange(physical + i, first, zeros.data(), last - first);
+                if (!zeroed)
+                    return false;
+            }
+            index += run;
+        }
+        return true;
+    }
+
+    // Fills the holes among the blocks [first, end) of an extent mapped file.
+    // When the space runs out on the way, the holes filled so far become
+    // holes again, their new blocks hold whatever they held before.
+    bool mapExtentRange(fsInode* fsi, int first, int end) {
+        vector<fsExtent> added;
+        int index = first;
+        while (index < end) {
+            int run;
+            int physical = mapExtent(fsi, index, run);
+            run = min(run, end - index);
+            if (physical < 0) {
+                if (!addExtentsToFile(fsi, index, run)) {
+                    unmapAdded(fsi, added);
+                    return false;
+                }
+                added.push_back(fsExtent{ index, -1, run });
+            }
+            index += run;
+        }
+        return true;
+    }
+    void unmapAdded(fsInode* fsi, vector<fsExtent>& added) {
+        for (fsExtent& hole : added) {
+            long from = (long)hole.logical * block_size;
+            long to = (long)(hole.logical + hole.length) * block_size;
+            // a run merged into the extents on both sides splits them again,
+            // when the tree has no room for that the blocks stay, zeroed.
+            if (!unmapRange(fsi, hole.logical, hole.logical + hole.length)) {
+                int ret_val = zeroRange(fsi, from, to);
+                assert(ret_val);
+            }
+        }
+    }
+
+    // Amount of whole blocks from the block `index` on that are contiguous on
+    // the disk, the first of them in `physical`, or 0 when the range is
+    // shorter than FS_DIRECT_IO_BYTES and should go through the cache.
+    int directRun(fsInode* fsi, int index, int offset, int len, int& physical) {
+        int wholeBlocks = len / block_size;
+        if (offset != 0 || (long)wholeBlocks * block_size < FS_DIRECT_IO_BYTES)
+            return 0;
+
+        int run = mappedRun(fsi, index, wholeBlocks, physical);
+        if ((long)run * block_size < FS_DIRECT_IO_BYTES)
+            return 0;
+        return run;
+    }
+
+    // Amount of blocks in [first, end) the file has no block for.
+    int countHoles(fsInode* fsi, int first, int end) {
+        int holes = 0;
+        int index = first;
+        while (index < end) {
+            int physical;
+            int run = mappedRun(fsi, index, end - index, physical);
+            if (run == 0) {
+                run = 1;
+                if (fsi->isExtentMapped())
+                    mapExtent(fsi, index, run);
+                run = min(run, end - index);
+                holes += run;
+            }
+            index += run;
+        }
+        return holes;
+    }
+
+    // Amount of blocks, at most maxBlocks, from the block `index` on that
+    // are contiguous on the disk. The first of them is returned in `physical`.
+    int mappedRun(fsInode* fsi, int index, int maxBlocks, int& physical) {
+        if (fsi->isExtentMapped()) {
+            int run;
+            physical = mapExtent(fsi, index, run);
+            return physical < 0 ? 0 : min(run, maxBlocks);
+        }
+
+        physical = getDataBlockByIndex(fsi, index);
+        if (physical < 0)
+            return 0;
+        int run = 1;
+        while (run < maxBlocks && getDataBlockByIndex(fsi, index + run) == physical + run)
+            run++;
+        return run;
+    }
+
+    int getDataBlockByIndex(fsInode* fsi, int index) {
+        if (fsi->isExtentMapped()) {
+            int run;
+            return mapExtent(fsi, index, run);
+        }
+
+        loadBlockMap(fsi);
+        vector<int>& map = fsi->getBlockMap();
+        return index < (int)map.size() ? map[index] : -1;
+    }
+
+    // Resolves every data block of a pointer mapped file, reading each of
+    // its pointer blocks once.
+    void loadBlockMap(fsInode* fsi) {
+        if (fsi->isBlockMapLoaded())
+            return;
+
+        int count = fsi->getDataBlocks();
+        vector<int>& map = fsi->getBlockMap();
+        map.assign(count, -1);
+
+        int index = 0;
+        for (; index < count && index < DIRECT_BLOCKS; index++)
+            map[index] = fsi->getDirectBlock(index);
+
+        if (index < count)
+            index = readPointerBlock(fsi->getSingleIndirect(), map, index);
+        for (int inner = 0; index < count; inner++) {
+            int doubleIndirect = fsi->getDoubleIndirect();
+            index = readPointerBlock(doubleIndirect < 0 ? -1 : readPointer(doubleIndirect, inner), map, index);
+        }
+
+        fsi->setBlockMapLoaded();
+    }
+
+    // Fills map from `index` on with the pointers of a pointer block, until
+    // the block or the map ends. Returns the index after the last one. A
+    // missing pointer block (-1) is all holes.
+    int readPointerBlock(int block, vector<int>& map, int index) {
+        if (block < 0)
+            return min(index + pointersPerBlock(), (int)map.size());
+
+        vector<unsigned char> bytes(block_size);
+        int ret_val = readBlock(block, (char*)bytes.data());
+        assert(ret_val);
+
+        for (int i = 0; i < pointersPerBlock() && index < (int)map.size(); i++, index++)
+            map[index] = decodePointer(&bytes[i * superBlock.pointer_size]);
+        return index;
+    }
+
+    // Points the block `index` of a pointer mapped file at another block.
+    void setDataBlockByIndex(fsInode* fsi, int index, int block) {
+        int firstSingleIndirectIndex = DIRECT_BLOCKS;
+        int firstDoubleIndirectIndex = DIRECT_BLOCKS + pointersPerBlock();
+
+        fsi->mapBlock(index, block);
+        if (index < firstSingleIndirectIndex) {
+            fsi->setDirectBlock(index, block);
+            return;
+        }
+
+        if (index < firstDoubleIndirectIndex) {
+            writePointer(fsi->getSingleIndirect(), index - firstSingleIndirectIndex, block);
+            return;
+        }
+
+        int doubleIndirectIndex = index - firstDoubleIndirectIndex;
+        int tempBlock = readPointer(fsi->getDoubleIndirect(), doubleIndirectIndex / pointersPerBlock());
+        writePointer(tempBlock, doubleIndirectIndex % pointersPerBlock(), block);
+    }
+
+    int getNextOpenFileDescriptor() {
+        if (FreeFileDescriptors.empty())
+            return OpenFileDescriptors.size();
+
+        int fd = FreeFileDescriptors.back();
+        FreeFileDescriptors.pop_back();
+        return fd;
+    }
+
+    bool isOpen(fsInode* fsi) {
+        lock_guard<mutex> guard(fd_lock);
+        return OpenInodes.count(fsi->getInodeNumber()) > 0;
+    }
+
+    // Opens the file with a new descriptor.
+    int addDescriptor(fsInode* fsi) {
+        lock_guard<mutex> guard(fd_lock);
+        if (OpenInodes.count(fsi->getInodeNumber()) > 0) {
+            cerr << "ERR - file already open" << endl;
+            return -1;
+        }
+
+        FileDescriptor fd(fsi->getInodeNumber());
+        int newFdNum = getNextOpenFileDescriptor();
+        if (newFdNum == (int)OpenFileDescriptors.size())
+            OpenFileDescriptors.push_back(fd);
+        else
+            OpenFileDescriptors[newFdNum] = fd;
+
+        OpenInodes[fd.getInodeNumber()] = newFdNum;
+        return newFdNum;
+    }
+
+    // The inode of an open descriptor, or nullptr. The inode stays valid
+    // while fs_lock is held, a file can't be deleted from under a call.
+    fsInode* lookupFd(int fd) {
+        lock_guard<mutex> guard(fd_lock);
+        if (!doesFdExist(fd))
+            return nullptr;
+        return fdInode(fd);
+    }
+
+    long getPosition(int fd) {
+        lock_guard<mutex> guard(fd_lock);
+        return OpenFileDescriptors[fd].getPosition();
+    }
+
+    void setPosition(int fd, long position) {
+        lock_guard<mutex> guard(fd_lock);
+        OpenFileDescriptors[fd].setPosition(position);
+    }
+
+    string findFileNameByFd(int fd) {
+        if (!doesFdExist(fd)) {
+            return "-1";
+        }
+        return entryName(fdInode(fd));
+    }
+
+    // call only with a descriptor that is in use.
+    fsInode* fdInode(int fd) {
+        return Inodes[OpenFileDescriptors[fd].getInodeNumber()];
+    }
+
+    long fdFileSize(int fd) {
+        if (!OpenFileDescriptors[fd].isInUse())
+            return 0;
+        return fdInode(fd)->getSize();
+    }
+
+    bool doesFdExist(int fd) {
+        if (fd < 0 || fd >= (int)OpenFileDescriptors.size() || !OpenFileDescriptors[fd].isInUse()) {
+            cerr << "ERR - no such file descriptor" << endl;
+            return false;
+        }
+        return true;
+    }
+
+    bool isDiskFormatted() {
+        if (!is_formated) {
+            cerr << "ERR - disk not formatted" << endl;
+            return false;
+        }
+        return true;
+    }
+
+    // Maps a block to every hole among the blocks [first, end) of a pointer
+    // mapped file, past the end of its block map too.
+    bool mapPointerRange(fsInode* fsi, int first, int end) {
+        loadBlockMap(fsi);
+        vector<int>& map = fsi->getBlockMap();
+        int holes = 0;
+        int firstHole = -1;
+        for (int i = first; i < end; i++) {
+            if (i >= (int)map.size() || map[i] < 0) {
+                holes++;
+                firstHole = firstHole < 0 ? i : firstHole;
+            }
+        }
+        if (holes == 0)
+            return true;
+
+        // the pointer blocks come out of the same runs, next to their data.
+        queue<int> blocks = allocateBlocks(holes + missingPointerBlocks(fsi, firstHole, end), pointerGoal(fsi, firstHole));
+        if (blocks.size() <= 0)
+            return false;
+
+        for (int i = firstHole; i < end; i++) {
+            if (i >= (int)map.size() || map[i] < 0)
+                addDataBlockToFileByIndex(fsi, i, blocks);
+        }
+        writeInode(fsi);
+        return true;
+    }
+
+    // Pointer blocks that mapping the holes among [first, end) needs and
+    // the file doesn't have. A pointer block is only missing when every
+    // block under it is a hole.
+    int missingPointerBlocks(fsInode* fsi, int first, int end) {
+        int firstSingleIndirectIndex = DIRECT_BLOCKS;
+        int firstDoubleIndirectIndex = DIRECT_BLOCKS + pointersPerBlock();
+        int missing = 0;
+
+        if (first < firstDoubleIndirectIndex && end > firstSingleIndirectIndex && fsi->getSingleIndirect() < 0)
+            missing++;
+        if (end <= firstDoubleIndirectIndex)
+            return missing;
+
+        int doubleIndirect = fsi->getDoubleIndirect();
+        if (doubleIndirect < 0)
+            missing++;
+        int innerEnd = (end - firstDoubleIndirectIndex + pointersPerBlock() - 1) / pointersPerBlock();
+        for (int inner = max(first - firstDoubleIndirectIndex, 0) / pointersPerBlock(); inner < innerEnd; inner++) {
+            if (doubleIndirect < 0 || readPointer(doubleIndirect, inner) < 0)
+                missing++;
+        }
+        return missing;
+    }
+
+    // Maps the hole `index` to the next block of `blocks`, taking the
+    // pointer blocks on its way that the file doesn't have from there too,
+    // in front of it. A hole past the end of the block map extends it.
+    void addDataBlockToFileByIndex(fsInode* fsi, int index, queue<int>& blocks) {
+        int tempBlock = 0;
+        int firstSingleIndirectIndex = DIRECT_BLOCKS;
+        int singleIndirectIndex = index - firstSingleIndirectIndex;
+
+        int firstDoubleIndirectIndex = DIRECT_BLOCKS + pointersPerBlock();
+        int doubleIndirectIndex = index - firstDoubleIndirectIndex;
+
+        if (index >= fsi->getDataBlocks())
+            fsi->setDataBlocks(index + 1);
+
+        if (index < firstSingleIndirectIndex) {
+            fsi->setDirectBlock(index, blocks.front());
+            fsi->mapBlock(index, blocks.front());
+            fsi->addTotalBlocks(1);
+            blocks.pop();
+            return;
+        }
+
+        if (index < firstDoubleIndirectIndex) {
+            if (fsi->getSingleIndirect() < 0) {
+                fsi->setSingleIndirect(blocks.front());
+                clearPointerBlock(blocks.front());
+                fsi->addTotalBlocks(1);
+                blocks.pop();
+            }
+            tempBlock = fsi->getSingleIndirect();
+            writePointer(tempBlock, singleIndirectIndex, blocks.front());
+            fsi->mapBlock(index, blocks.front());
+            fsi->addTotalBlocks(1);
+            blocks.pop();
+            return;
+        }
+
+        if (fsi->getDoubleIndirect() < 0) {
+            fsi->setDoubleIndirect(blocks.front());
+            clearPointerBlock(blocks.front());
+            fsi->addTotalBlocks(1);
+            blocks.pop();
+        }
+
+        tempBlock = readPointer(fsi->getDoubleIndirect(), doubleIndirectIndex / pointersPerBlock());
+        if (tempBlock < 0) {
+            tempBlock = blocks.front();
+            clearPointerBlock(tempBlock);
+            writePointer(fsi->getDoubleIndirect(), doubleIndirectIndex / pointersPerBlock(), tempBlock);
+            fsi->addTotalBlocks(1);
+            blocks.pop();
+        }
+
+        writePointer(tempBlock, doubleIndirectIndex % pointersPerBlock(), blocks.front());
+        fsi->mapBlock(index, blocks.front());
+        fsi->addTotalBlocks(1);
+        blocks.pop();
+    }
+
+    // Whether a pointer mapped file has holes: without, it has exactly the
+    // blocks neededBlocksFor counts for its block map.
+    bool hasHoles(fsInode* fsi) {
+        return fsi->getTotalBlocks() != neededBlocksFor((long)fsi->getDataBlocks() * block_size);
+    }
+
+    int dataBlocksForFileSize(long fileSize) {
+        int dataBlocks = fileSize / block_size;
+        dataBlocks += (fileSize % block_size > 0) ? 1 : 0;
+        return dataBlocks;
+    }
+
+    int neededBlocksFor(long fileSize) {
+        int dataBlocksNeeded = dataBlocksForFileSize(fileSize);
+        int indirectBlocksNeeded = 0;
+
+        if (dataBlocksNeeded <= DIRECT_BLOCKS)
+            goto RETURN;
+
+        indirectBlocksNeeded++;
+        if (dataBlocksNeeded <= DIRECT_BLOCKS + pointersPerBlock())
+            goto RETURN;
+
+        // the double indirect block, and one inner block per pointersPerBlock data blocks.
+        indirectBlocksNeeded++;
+        indirectBlocksNeeded += (dataBlocksNeeded - DIRECT_BLOCKS - pointersPerBlock() + pointersPerBlock() - 1)
+            / pointersPerBlock();
+
+    RETURN:
+        return dataBlocksNeeded + indirectBlocksNeeded;
+    }
+
+    long maxFileSize(fsInode* fsi) {
+        return maxDataBlockAmount(fsi) * block_size;
+    }
+
+    long maxDataBlockAmount(fsInode* fsi) {
+        if (fsi->isExtentMapped())
+            return min((long)INT32_MAX, (long)BitVectorSize);
+
+        long fanout = pointersPerBlock();
+        return min((long)DIRECT_BLOCKS + fanout * (1 + fanout), (long)INT32_MAX);
+    }
+
+    int pointersPerBlock() {
+        return block_size / superBlock.pointer_size;
+    }
+
+    // Entries of pointer blocks hold the block number plus one, -1 is returned
+    // for an unused entry.
+    int readPointer(int block, int index) {
+        unsigned char bytes[4] = { 0 };
+        int ret_val = readBlockRange(block, index * superBlock.pointer_size, (char*)bytes, superBlock.pointer_size);
+        assert(ret_val);
+        return decodePointer(bytes);
+    }
+
+    int decodePointer(const unsigned char* bytes) {
+        uint32_t value = 0;
+        for (int i = superBlock.pointer_size - 1; i >= 0; i--)
+            value = (value << 8) | bytes[i];
+        return (int)value - 1;
+    }
+
+    // A new pointer block starts out with every entry unused, whatever the
+    // block held before.
+    void clearPointerBlock(int block) {
+        vector<char> zeros(block_size, 0);
+        int ret_val = writeMetaBlockRange(block, 0, zeros.data(), block_size);
+        assert(ret_val);
+    }
+
+    void writePointer(int block, int index, int target) {
+        unsigned char bytes[4];
+        uint32_t value = target + 1;
+        for (int i = 0; i < superBlock.pointer_size; i++)
+            bytes[i] = (value >> (8 * i)) & 0xff;
+
+        int ret_val = writeMetaBlockRange(block, index * superBlock.pointer_size, (char*)bytes, superBlock.pointer_size);
+        assert(ret_val);
+    }
+
+    // ------------------------------------------------------------------------
+    // Extents - an extent mapped inode keeps its extents sorted by logical
+    // block in memory, and rewrites the part of the tree that changed.
+    int extentsPerBlock() {
+        return (block_size - sizeof(fsExtentHeader)) / sizeof(fsExtent);
+    }
+
+    // Tree blocks needed below the root for `count` extents.
+    int extentTreeBlocksFor(int count) {
+        int blocks = 0;
+        while (count > FS_ROOT_EXTENTS) {
+            count = (count + extentsPerBlock() - 1) / extentsPerBlock();
+            blocks += count;
+        }
+        return blocks;
+    }
+
+    // Reads the tree level by level, so the tree blocks end up in the order
+    // writeExtentTree hands them out: the leaves first, the top level last.
+    void loadExtents(fsInode* fsi) {
+        if (fsi->areExtentsLoaded())
+            return;
+
+        fsExtentRoot& root = fsi->getExtentRoot();
+        vector<fsExtent> entries(root.entries, root.entries + root.header.entries);
+        vector< vector<int> > levels(root.header.depth);
+        vector<char> node(block_size);
+
+        for (int depth = root.header.depth - 1; depth >= 0; depth--) {
+            vector<fsExtent> children;
+            for (fsExtent& entry : entries) {
+                levels[depth].push_back(entry.physical);
+                int ret_val = readBlock(entry.physical, node.data());
+                assert(ret_val);
+
+                fsExtentHeader header;
+                memcpy(&header, node.data(), sizeof(header));
+                size_t first = children.size();
+                children.resize(first + header.entries);
+                memcpy(&children[first], node.data() + sizeof(header), header.entries * sizeof(fsExtent));
+            }
+            entries.swap(children);
+        }
+
+        fsi->getExtents() = entries;
+        vector<int>& treeBlocks = fsi->getExtentTreeBlocks();
+        treeBlocks.clear();
+        for (vector<int>& level : levels)
+            treeBlocks.insert(treeBlocks.end(), level.begin(), level.end());
+        fsi->setExtentsLoaded();
+    }
+
+    // Physical block of the block `index`, or -1 if no extent maps it. `run`
+    // gets the amount of blocks from `index` on that are mapped the same way:
+    // the rest of the extent, or the hole up to the next extent.
+    int mapExtent(fsInode* fsi, int index, int& run) {
+        loadExtents(fsi);
+        vector<fsExtent>& extents = fsi->getExtents();
+        auto it = upper_bound(extents.begin(), extents.end(), index,
+            [](int logical, const fsExtent& extent) { return logical < extent.logical; });
+
+        run = it == extents.end() ? INT32_MAX - index : it->logical - index;
+        if (it == extents.begin())
+            return -1;
+
+        --it;
+        if (index >= it->logical + it->length)
+            return -1;
+
+        run = it->logical + it->length - index;
+        return it->physical + index - it->logical;
+    }
+
+    // Where a block at `index` should go to be contiguous with the blocks
+    // mapped before it, or -1 if there are none.
+    int extentGoal(fsInode* fsi, int index) {
+        vector<fsExtent>& extents = fsi->getExtents();
+        auto it = upper_bound(extents.begin(), extents.end(), index,
+            [](int logical, const fsExtent& extent) { return logical < extent.logical; });
+        if (it == extents.begin())
+            return spreadGoal(fsi, groupStart(fsi));
+
+        --it;
+        return spreadGoal(fsi, it->physical + index - it->logical);
+    }
+
+    // The first block of the allocation group of the file.
+    int groupStart(fsInode* fsi) {
+        int groups = (BitVectorSize + FS_GROUP_BLOCKS - 1) / FS_GROUP_BLOCKS;
+        return fsi->getInodeNumber() % groups * FS_GROUP_BLOCKS;
+    }
+
+    // Where the block `index` of a pointer mapped file should go: right
+    // after the block before it, or at the start of the file's group.
+    int pointerGoal(fsInode* fsi, int index) {
+        int previous = index > 0 ? getDataBlockByIndex(fsi, index - 1) : -1;
+        return spreadGoal(fsi, previous >= 0 ? previous + 1 : groupStart(fsi));
+    }
+
+    // The goal itself while it is free. Otherwise the middle of the longest
+    // free run of the file's group, leaving the first half of the run to
+    // whoever grows in front of it.
+    int spreadGoal(fsInode* fsi, int goal) {
+        lock_guard<recursive_mutex> guard(meta_lock);
+        if (goal < BitVectorSize && !BitVector.test(goal))
+            return goal;
+
+        int first = groupStart(fsi);
+        int start;
+        int length = BitVector.longestRun(first, min(first + FS_GROUP_BLOCKS, BitVectorSize), start);
+        if (length < FS_SPREAD_BLOCKS)
+            return goal;
+        return start + length / 2;
+    }
+
+    // Adds an extent of unmapped blocks, merged into its neighbours when it
+    // continues them both logically and physically. Returns the position of
+    // the first extent that changed.
+    int insertExtent(fsInode* fsi, fsExtent extent) {
+        vector<fsExtent>& extents = fsi->getExtents();
+        auto it = upper_bound(extents.begin(), extents.end(), extent.logical,
+            [](int logical, const fsExtent& e) { return logical < e.logical; });
+        int pos = it - extents.begin();
+
+        if (pos > 0) {
+            fsExtent& prev = extents[pos - 1];
+            if (prev.logical + prev.length == extent.logical && prev.physical + prev.length == extent.physical
+                && (long)prev.length + extent.length <= INT32_MAX) {
+                prev.length += extent.length;
+                pos--;
+                mergeWithNext(extents, pos);
+                return pos;
+            }
+        }
+
+        extents.insert(extents.begin() + pos, extent);
+        mergeWithNext(extents, pos);
+        return pos;
+    }
+
+    void mergeWithNext(vector<fsExtent>& extents, int pos) {
+        if (pos + 1 >= (int)extents.size())
+            return;
+
+        fsExtent& cur = extents[pos];
+        fsExtent& next = extents[pos + 1];
+        if (cur.logical + cur.length == next.logical && cur.physical + cur.length == next.physical
+            && (long)cur.length + next.length <= INT32_MAX) {
+            cur.length += next.length;
+            extents.erase(extents.begin() + pos + 1);
+        }
+    }
+
+    // Maps `amount` new blocks from the block `index` on, in as few and as
+    // long runs as the BitVector has.
+    bool addExtentsToFile(fsInode* fsi, int index, int amount) {
+        if (amount <= 0)
+            return true;
+
+        lock_guard<recursive_mutex> guard(meta_lock);
+        if (!haveFreeBlocks(amount)) {
+            cerr << "ERR - could not allocate enough blocks" << endl;
+            return false;
+        }
+
+        loadExtents(fsi);
+        vector<fsExtent> saved = fsi->getExtents();
+        vector<fsExtent> runs;
+        int firstChanged = saved.size();
+
+        int goal = extentGoal(fsi, index);
+        while (amount > 0) {
+            int start;
+            int length = BitVector.allocateRun(goal, amount, start);
+            assert(length > 0);
+            writeBitVectorRange(start, length);
+            runs.push_back(fsExtent{ index, start, length });
+
+            firstChanged = min(firstChanged, insertExtent(fsi, runs.back()));
+            fsi->addDataBlocks(length);
+            index += length;
+            amount -= length;
+            goal = start + length;
+        }
+
+        if (!writeExtentTree(fsi, firstChanged)) {
+            // no room left for the tree, give the new blocks back.
+            fsi->getExtents() = saved;
+            for (fsExtent& run : runs) {
+                releaseBlocks(run.physical, run.length);
+                fsi->addDataBlocks(-run.length);
+            }
+            return false;
+        }
+
+        writeInode(fsi);
+        return true;
+    }
+
+    // Brings the tree below the root in line with the extents. The tree is
+    // built bottom up, the extents split over full leaves in order, so
+    // full nodes that only hold extents before `firstChanged` stay as they
+    // are, unless the amount of tree blocks changed. The last node of a
+    // level may have lost entries past it, it is always written.
+    bool writeExtentTree(fsInode* fsi, int firstChanged) {
+        vector<fsExtent>& extents = fsi->getExtents();
+        vector<int>& treeBlocks = fsi->getExtentTreeBlocks();
+
+        int needed = extentTreeBlocksFor(extents.size());
+        int current = treeBlocks.size();
+        if (needed > current) {
+            queue<int> blocks = allocateBlocks(needed - current);
+            if (blocks.empty())
+                return false;
+            for (; !blocks.empty(); blocks.pop())
+                treeBlocks.push_back(blocks.front());
+        }
+        else if (needed < current) {
+            queue<int> blocks;
+            for (int i = needed; i < current; i++)
+                blocks.push(treeBlocks[i]);
+            treeBlocks.resize(needed);
+            freeBlocks(blocks);
+        }
+        fsi->addTotalBlocks(needed - current);
+        if (needed != current)
+            firstChanged = 0;
+
+        vector<fsExtent> level = extents;
+        vector<char> node(block_size);
+        int depth = 0;
+        int used = 0;
+        while (level.size() > FS_ROOT_EXTENTS) {
+            vector<fsExtent> parents;
+            for (int i = 0; i < (int)level.size(); i += extentsPerBlock()) {
+                int count = min(extentsPerBlock(), (int)level.size() - i);
+                int block = treeBlocks[used++];
+                parents.push_back(fsExtent{ level[i].logical, block, 0 });
+                if (i + count <= firstChanged && count == extentsPerBlock())
+                    continue;
+
+                fsExtentHeader header = { (uint16_t)count, (uint16_t)depth };
+                fill(node.begin(), node.end(), 0);
+                memcpy(node.data(), &header, sizeof(header));
+                memcpy(node.data() + sizeof(header), &level[i], count * sizeof(fsExtent));
+                int ret_val = writeMetaBlockRange(block, 0, node.data(), block_size);
+                assert(ret_val);
+            }
+            level.swap(parents);
+            firstChanged /= extentsPerBlock();
+            depth++;
+        }
+
+        fsExtentRoot& root = fsi->getExtentRoot();
+        memset(&root, 0, sizeof(root));
+        root.header.entries = level.size();
+        root.header.depth = depth;
+        copy(level.begin(), level.end(), root.entries);
+        return true;
+    }
+
+    // ------------------------------------------------------------------------
+    // Deduplication - with FS_FEATURE_DEDUP, the blocks a write covers whole
+    // are looked up by fingerprint in an index of the blocks written before.
+    // A block whose content is on the disk already is mapped to that block
+    // with a reference, as CopyFile shares blocks, and isn't written. The
+    // fingerprint table keeps the index on the disk, it is loaded at mount.
+    // A fingerprint only names a candidate, blocks are compared byte for
+    // byte before they are shared. Blocks leave the index when they are
+    // freed, and before a write changes them in place (see unshareRange).
+    bool isDedupEnabled() {
+        return superBlock.features & FS_FEATURE_DEDUP;
+    }
+
+    // A 64 bit hash of a block, a word at a time. Never 0, which marks a
+    // block without a fingerprint.
+    uint64_t blockFingerprint(const char* data) {
+        uint64_t hash = 0x9e3779b97f4a7c15ULL ^ block_size;
+        int i = 0;
+        for (; i + (int)sizeof(uint64_t) <= block_size; i += sizeof(uint64_t)) {
+            uint64_t word;
+            memcpy(&word, data + i, sizeof(word));
+            word *= 0xc2b2ae3d27d4eb4fULL;
+            hash ^= (word << 31) | (word >> 33);
+            hash = ((hash << 27) | (hash >> 37)) * 0x9e3779b97f4a7c15ULL + 0x85ebca77c2b2ae63ULL;
+        }
+        for (; i < block_size; i++)
+            hash = (hash ^ (unsigned char)data[i]) * 0x100000001b3ULL;
+        hash ^= hash >> 33;
+        hash *= 0xff51afd7ed558ccdULL;
+        hash ^= hash >> 33;
+        return hash == 0 ? 1 : hash;
+    }
+
+    bool loadFingerprints() {
+        BlockFingerprints.assign(BitVectorSize, 0);
+        long chunk = LIST_CHUNK_SIZE / sizeof(uint64_t);
+        for (long first = 0; first < BitVectorSize; first += chunk) {
+            long count = min(chunk, BitVectorSize - first);
+            if (!readMeta(fingerprintOffset(first), (char*)&BlockFingerprints[first], count * sizeof(uint64_t)))
+                return false;
+        }
+        for (int block = 0; block < BitVectorSize; block++) {
+            if (BlockFingerprints[block] != 0)
+                Fingerprints[BlockFingerprints[block]] = block;
+        }
+        return true;
+    }
+
+    // Puts a block that was just written whole into the index. A block
+    // already there for the fingerprint stays in the table, but the index
+    // names the newest one.
+    void indexBlock(int block, uint64_t fingerprint) {
+        lock_guard<recursive_mutex> guard(meta_lock);
+        forgetBlocks(block, 1);
+        Fingerprints[fingerprint] = block;
+        BlockFingerprints[block] = fingerprint;
+        int ret_val = writeMeta(fingerprintOffset(block), (const char*)&fingerprint, sizeof(fingerprint));
+        assert(ret_val);
+    }
+
+    // Takes the blocks [start, start + length) out of the index, their table
+    // entries are cleared a stretch at a time.
+    void forgetBlocks(int start, int length) {
+        if (!isDedupEnabled())
+            return;
+
+        lock_guard<recursive_mutex> guard(meta_lock);
+        int stretch = 0;
+        for (int block = start; block <= start + length; block++) {
+            uint64_t fingerprint = block < start + length ? BlockFingerprints[block] : 0;
+            if (fingerprint != 0) {
+                auto it = Fingerprints.find(fingerprint);
+                if (it != Fingerprints.end() && it->second == block)
+                    Fingerprints.erase(it);
+                BlockFingerprints[block] = 0;
+                stretch++;
+                continue;
+            }
+
+            if (stretch > 0) {
+                vector<char> zeros((long)stretch * sizeof(uint64_t), 0);
+                int ret_val = writeMeta(fingerprintOffset(block - stretch), zeros.data(), zeros.size());
+                assert(ret_val);
+                stretch = 0;
+            }
+        }
+    }
+
+    // The write of [offset, offset + total) with FS_FEATURE_DEDUP. Runs of
+    // whole blocks whose content is on the disk already are shared, the
+    // rest is written as usual and its whole blocks go into the index.
+    // Holds meta_lock throughout, so no block found in the index can change
+    // before it is shared.
+    int writeDedupData(fsInode* fsi, long offset, const char* buf, int total) {
+        lock_guard<recursive_mutex> guard(meta_lock);
+        if (fsi->isExtentMapped())
+            loadExtents(fsi);
+        else
+            loadBlockMap(fsi);
+
+        long end = offset + total;
+        int first = dataBlocksForFileSize(offset);
+        vector<uint64_t> fingerprints;
+        for (long start = (long)first * block_size; start + block_size <= end; start += block_size)
+            fingerprints.push_back(blockFingerprint(buf + (start - offset)));
+
+        long done = offset;
+        for (int i = 0; i < (int)fingerprints.size(); ) {
+            int index = first + i;
+            long start = (long)index * block_size;
+            int physical;
+            bool inPlace;
+            int run = findDuplicates(fsi, index, fingerprints, i, buf + (start - offset), physical, inPlace);
+            if (run == 0) {
+                i++;
+                continue;
+            }
+
+            // the blocks written before the run may be the ones it was
+            // found in, it is looked up again after them.
+            if (start > done) {
+                if (!writeIndexedData(fsi, done, buf + (done - offset), start - done, fingerprints, first))
+                    return -1;
+                done = start;
+                run = findDuplicates(fsi, index, fingerprints, i, buf + (start - offset), physical, inPlace);
+                if (run == 0) {
+                    i++;
+                    continue;
+                }
+            }
+            // what the file shows between its end and the run reads as zeros.
+            if (start > fsi->getFileSize() && !clearRange(fsi, fsi->getFileSize(), start))
+                return -1;
+            if (!inPlace && !shareDuplicates(fsi, index, run, physical)) {
+                i++;
+                continue;
+            }
+
+            done = start + (long)run * block_size;
+            if (done > fsi->getFileSize()) {
+                fsi->addFileSize(done - fsi->getFileSize());
+                writeInode(fsi);
+            }
+            DedupedBlocks += run;
+            i += run;
+        }
+
+        if (!writeIndexedData(fsi, done, buf + (done - offset), end - done, fingerprints, first))
+            return -1;
+        return total;
+    }
+
+    // Amount of blocks from the block `index` on that the data, the whole
+    // blocks of the write from fingerprints[pos] on, can be mapped to: a
+    // run of consecutive blocks of the index, the first of them in
+    // `physical`, that hold the same bytes and may take one more reference.
+    // inPlace tells that the file has them at `index` already.
+    int findDuplicates(fsInode* fsi, int index, const vector<uint64_t>& fingerprints, int pos, const char* data,
+        int& physical, bool& inPlace) {
+        auto it = Fingerprints.find(fingerprints[pos]);
+        if (it == Fingerprints.end())
+            return 0;
+
+        physical = it->second;
+        inPlace = getDataBlockByIndex(fsi, index) == physical;
+        int run = 1;
+        while (pos + run < (int)fingerprints.size() && physical + run < BitVectorSize) {
+            it = Fingerprints.find(fingerprints[pos + run]);
+            if (it == Fingerprints.end() || it->second != physical + run
+                || (getDataBlockByIndex(fsi, index + run) == physical + run) != inPlace)
+                break;
+            run++;
+        }
+
+        vector<char> onDisk((long)run * block_size);
+        bool read = true;
+        if ((long)run * block_size >= FS_DIRECT_IO_BYTES)
+            read = cache.readRun(superBlock.data_block + physical, run, onDisk.data());
+        for (int i = 0; read && (long)run * block_size < FS_DIRECT_IO_BYTES && i < run; i++)
+            read = readBlock(physical + i, &onDisk[(long)i * block_size]);
+        if (!read)
+            return 0;
+
+        vector<uint16_t> refs = readRefCounts(physical, run);
+        int same = 0;
+        while (same < run && (inPlace || refs[same] < FS_MAX_EXTRA_REFS)
+            && memcmp(&onDisk[(long)same * block_size], data + (long)same * block_size, block_size) == 0)
+            same++;
+        return same;
+    }
+
+    // Maps the blocks [index, index + run) of the file to the blocks from
+    // `physical` on, whatever they were mapped to loses a reference. False,
+    // with nothing changed, when the mapping needs blocks the disk doesn't
+    // have.
+    bool shareDuplicates(fsInode* fsi, int index, int run, int physical) {
+        // unmapping may split an extent, the new run adds one more.
+        int needed = fsi->isExtentMapped()
+            ? max(0, extentTreeBlocksFor(fsi->getExtents().size() + 2) - (int)fsi->getExtentTreeBlocks().size())
+            : missingPointerBlocks(fsi, index, index + run);
+        if (!haveFreeBlocks(needed))
+            return false;
+
+        // the references are taken first, so a block of the run the file
+        // had at another index isn't freed on the way.
+        addRefCounts(physical, run, 1);
+        if (fsi->isExtentMapped()) {
+            int ret_val = unmapRange(fsi, index, index + run);
+            assert(ret_val);
+            ret_val = writeExtentTree(fsi, insertExtent(fsi, fsExtent{ index, physical, run }));
+            assert(ret_val);
+            fsi->addDataBlocks(run);
+        }
+        else {
+            queue<int> pointerBlocks = allocateBlocks(needed, pointerGoal(fsi, index));
+            for (int i = 0; i < run; i++) {
+                int old = getDataBlockByIndex(fsi, index + i);
+                if (old >= 0) {
+                    setDataBlockByIndex(fsi, index + i, physical + i);
+                    dropBlocks(old, 1);
+                    continue;
+                }
+
+                queue<int> blocks;
+                for (int missing = missingPointerBlocks(fsi, index + i, index + i + 1); missing > 0; missing--) {
+                    blocks.push(pointerBlocks.front());
+                    pointerBlocks.pop();
+                }
+                blocks.push(physical + i);
+                addDataBlockToFileByIndex(fsi, index + i, blocks);
+            }
+        }
+        writeInode(fsi);
+        return true;
+    }
+
+    // Writes [from, from + len) of the write as usual, then puts the blocks
+    // it covers whole into the index.
+    bool writeIndexedData(fsInode* fsi, long from, const char* data, long len, const vector<uint64_t>& fingerprints,
+        int first) {
+        if (len <= 0)
+            return true;
+        if (writeBlocksAt(fsi, from, data, len) != len)
+            return false;
+
+        for (int index = dataBlocksForFileSize(from); (long)(index + 1) * block_size <= from + len; index++)
+            indexBlock(getDataBlockByIndex(fsi, index), fingerprints[index - first]);
+        return true;
+    }
+
+    // ------------------------------------------------------------------------
+    // Compression - with FS_FEATURE_COMPRESS, files are read and written a
+    // cluster of FS_CLUSTER_BLOCKS blocks at a time. A cluster is stored
+    // compressed when that saves a block, as it is otherwise, and a write
+    // to part of a cluster reads the rest of it first. A compressed cluster
+    // is decompressed whole once and kept in clusterCache, so reads of its
+    // other blocks don't go to the disk.
+    bool isCompressEnabled() {
+        return superBlock.features & FS_FEATURE_COMPRESS;
+    }
+
+    long clusterBytes() {
+        return (long)FS_CLUSTER_BLOCKS * block_size;
+    }
+
+    bool isClusterStart(int block) {
+        lock_guard<recursive_mutex> guard(meta_lock);
+        return ClusterStarts[block / 64] >> (block % 64) & 1;
+    }
+
+    void markClusterStart(int block) {
+        lock_guard<recursive_mutex> guard(meta_lock);
+        ClusterStarts[block / 64] |= 1ULL << (block % 64);
+        int ret_val = writeMeta(clusterOffset(block), (const char*)&ClusterStarts[block / 64], sizeof(uint64_t));
+        assert(ret_val);
+    }
+
+    // Clears the bits of the blocks [start, start + length) as they are
+    // freed, a word at a time, and drops the clusters that started there.
+    void forgetClusters(int start, int length) {
+        if (!isCompressEnabled() || length <= 0)
+            return;
+
+        lock_guard<recursive_mutex> guard(meta_lock);
+        for (int word = start / 64; word <= (start + length - 1) / 64; word++) {
+            int first = max(start - word * 64, 0);
+            int last = min(start + length - word * 64, 64);
+            uint64_t mask = (last - first == 64 ? ~0ULL : ((1ULL << (last - first)) - 1)) << first;
+            uint64_t bits = ClusterStarts[word] & mask;
+            if (bits == 0)
+                continue;
+
+            for (; bits != 0; bits &= bits - 1)
+                clusterCache.erase(word * 64 + __builtin_ctzll(bits));
+            ClusterStarts[word] &= ~mask;
+            int ret_val = writeMeta(clusterOffset(word * 64), (const char*)&ClusterStarts[word], sizeof(uint64_t));
+            assert(ret_val);
+        }
+    }
+
+    bool isCompressedCluster(fsInode* fsi, int index) {
+        int physical = getDataBlockByIndex(fsi, index * FS_CLUSTER_BLOCKS);
+        return physical >= 0 && isClusterStart(physical);
+    }
+
+    // The content of the cluster `index` of the file, when it is stored
+    // compressed: raw_bytes of it, the rest of the cluster is zeros.
+    // Returns 1 with the cluster, 0 for a cluster that isn't compressed, or
+    // -1 when it can't be read.
+    int loadCluster(fsInode* fsi, int index, shared_ptr<const vector<char> >& cluster) {
+        int first = index * FS_CLUSTER_BLOCKS;
+        int physical = getDataBlockByIndex(fsi, first);
+        if (physical < 0)
+            return 0;
+        cluster = clusterCache.lookup(physical);
+        if (cluster != nullptr)
+            return 1;
+        if (!isClusterStart(physical))
+            return 0;
+
+        // the packed blocks go around the block cache, the cluster is cached
+        // decompressed. The run the cluster starts with is read whole, it
+        // usually holds all of it.
+        vector<char> packed((long)(FS_CLUSTER_BLOCKS - 1) * block_size);
+        int block;
+        int done = mappedRun(fsi, first, FS_CLUSTER_BLOCKS - 1, block);
+        if (!cache.readRun(superBlock.data_block + block, done, packed.data())) {
+            cerr << "ERR - could not read from disk" << endl;
+            return -1;
+        }
+        fsClusterHeader header;
+        memcpy(&header, packed.data(), sizeof(header));
+        int blocks = blocksFor(sizeof(header) + (long)header.packed_bytes);
+        if (header.raw_bytes > clusterBytes() || blocks >= FS_CLUSTER_BLOCKS) {
+            cerr << "ERR - corrupt compressed cluster" << endl;
+            return -1;
+        }
+        while (done < blocks) {
+            int run = mappedRun(fsi, first + done, blocks - done, block);
+            if (run == 0 || !cache.readRun(superBlock.data_block + block, run, &packed[(long)done * block_size])) {
+                cerr << "ERR - could not read from disk" << endl;
+                return -1;
+            }
+            done += run;
+        }
+
+        shared_ptr<vector<char> > data = make_shared<vector<char> >(header.raw_bytes);
+        int size = lzDecompress(packed.data() + sizeof(header), header.packed_bytes, data->data(), data->size());
+        if (size != (int)header.raw_bytes) {
+            cerr << "ERR - corrupt compressed cluster" << endl;
+            return -1;
+        }
+        cluster = data;
+        clusterCache.insert(physical, cluster);
+        return 1;
+    }
+
+    // Reads [offset, offset + total) of a compressed file, all inside the
+    // file, a cluster at a time.
+    int readClustersAt(fsInode* fsi, long offset, char* buf, int total) {
+        int i = 0;
+        while (i < total) {
+            long charIndex = offset + i;
+            int index = charIndex / clusterBytes();
+            long inCluster = charIndex - index * clusterBytes();
+            int chunk = min(clusterBytes() - inCluster, (long)total - i);
+            shared_ptr<const vector<char> > cluster;
+            int found = loadCluster(fsi, index, cluster);
+            if (found < 0)
+                return -1;
+            if (found == 0) {
+                if (readBlocksAt(fsi, charIndex, buf + i, chunk) < 0)
+                    return -1;
+                i += chunk;
+                continue;
+            }
+
+            int stored = max(0L, min((long)chunk, (long)cluster->size() - inCluster));
+            memcpy(buf + i, cluster->data() + inCluster, stored);
+            memset(buf + i + stored, 0, chunk - stored);
+            i += chunk;
+        }
+        return total;
+    }
+
+    // Stores the first len bytes of the cluster `index` of the file, of
+    // which [changedFrom, changedTo) changed. Compressed when that takes
+    // fewer blocks than len, the blocks of the cluster past those it takes
+    // become a hole. A cluster that stays uncompressed only has the changed
+    // bytes written. Otherwise the cluster is unmapped and mapped again, all
+    // under meta_lock, after checking there are the blocks for it.
+    bool storeCluster(fsInode* fsi, int index, const char* data, int len, int changedFrom, int changedTo) {
+        int first = index * FS_CLUSTER_BLOCKS;
+        long start = (long)first * block_size;
+        int rawBlocks = blocksFor(len);
+        vector<char> packed;
+        int packedBytes = 0;
+        if (rawBlocks > 1) {
+            packed.assign((long)(rawBlocks - 1) * block_size, 0);
+            packedBytes = lzCompress(data, len, packed.data() + sizeof(fsClusterHeader),
+                packed.size() - sizeof(fsClusterHeader));
+        }
+
+        if (packedBytes == 0 && !isCompressedCluster(fsi, index)) {
+            int changed = changedTo - changedFrom;
+            return writeBlocksAt(fsi, start + changedFrom, data + changedFrom, changed) == changed;
+        }
+
+        lock_guard<recursive_mutex> guard(meta_lock);
+        int blocks = packedBytes == 0 ? rawBlocks : blocksFor(sizeof(fsClusterHeader) + (long)packedBytes);
+        // the mapping may take a tree block for every new extent, or get
+        // back the pointer blocks the unmapping frees: the single and the
+        // double indirect and two inner ones.
+        int needed = blocks + (fsi->isExtentMapped()
+            ? max(0, extentTreeBlocksFor(fsi->getExtents().size() + blocks + 2) - (int)fsi->getExtentTreeBlocks().size())
+            : 4);
+        if (!haveFreeBlocks(needed)) {
+            cerr << "ERR - not enough space" << endl;
+            return false;
+        }
+
+        if (!unmapRange(fsi, first, first + FS_CLUSTER_BLOCKS))
+            return false;
+        if (packedBytes == 0)
+            return writeBlocksAt(fsi, start, data, len) == len;
+
+        fsClusterHeader header = { (uint32_t)len, (uint32_t)packedBytes };
+        memcpy(packed.data(), &header, sizeof(header));
+        int size = blocks * block_size;
+        if (writeBlocksAt(fsi, start, packed.data(), size) != size)
+            return false;
+        int physical = getDataBlockByIndex(fsi, first);
+        markClusterStart(physical);
+        clusterCache.insert(physical, make_shared<const vector<char> >(data, data + len));
+        return true;
+    }
+
+    // The write of [offset, offset + total) to a compressed file. Every
+    // cluster it touches is stored again, with the bytes of the write in it.
+    int writeClusters(fsInode* fsi, long offset, const char* buf, int total) {
+        if (fsi->isExtentMapped())
+            loadExtents(fsi);
+        else
+            loadBlockMap(fsi);
+
+        // blocks mapped ahead of the end hold stale data, as in mapRange. A
+        // compressed cluster holds zeros past the end already, and its
+        // blocks are all in front of it.
+        long fileSize = fsi->getFileSize();
+        if (offset > fileSize) {
+            if (fsi->isShared() && !unshareRange(fsi, offset, total))
+                return -1;
+            if (!zeroRange(fsi, fileSize, offset))
+                return -1;
+        }
+
+        // the clusters are stored one at a time, there must be room for all
+        // of them before the first one changes.
+        long end = offset + total;
+        lock_guard<recursive_mutex> guard(meta_lock);
+        if (!haveFreeBlocks(clusterWriteBlocks(fsi, offset, end))) {
+            cerr << "ERR - not enough space" << endl;
+            return -1;
+        }
+
+        vector<char> data;
+        for (int index = offset / clusterBytes(); (long)index * clusterBytes() < end; index++) {
+            long start = (long)index * clusterBytes();
+            int len = min(clusterBytes(), max(fileSize, end) - start);
+            int from = max(offset, start) - start;
+            int to = min(end - start, (long)len);
+
+            // a write of the whole cluster stores straight from buf.
+            if (from == 0 && to == len) {
+                if (!storeCluster(fsi, index, buf + (start - offset), len, from, to))
+                    return -1;
+                continue;
+            }
+
+            data.assign(len, 0);
+            int stored = min((long)len, fileSize - start);
+            if (stored > 0 && readClustersAt(fsi, start, data.data(), stored) < 0)
+                return -1;
+            memcpy(data.data() + from, buf + (start + from - offset), to - from);
+            if (!storeCluster(fsi, index, data.data(), len, from, to))
+                return -1;
+        }
+
+        if (end > fsi->getFileSize())
+            fsi->addFileSize(end - fsi->getFileSize());
+        writeInode(fsi);
+        return total;
+    }
+
+    // Blocks storeCluster may take for every cluster [offset, end) touches:
+    // each of them stored raw, with the tree blocks of an extent per block,
+    // or the pointer blocks around them besides the four it asks for.
+    int clusterWriteBlocks(fsInode* fsi, long offset, long end) {
+        int firstCluster = offset / clusterBytes();
+        int lastCluster = (end - 1) / clusterBytes();
+        long stored = min(max(fsi->getFileSize(), end), (lastCluster + 1) * clusterBytes());
+        int blocks = dataBlocksForFileSize(stored) - firstCluster * FS_CLUSTER_BLOCKS;
+        if (fsi->isExtentMapped()) {
+            int clusters = lastCluster - firstCluster + 1;
+            return blocks + max(0, extentTreeBlocksFor(fsi->getExtents().size() + blocks + 2 * clusters + 2)
+                - (int)fsi->getExtentTreeBlocks().size());
+        }
+        return blocks + blocks / pointersPerBlock() + 8;
+    }
+
+    // Zeroes [from, to), inside the compressed cluster the byte `from` is
+    // in, by storing the cluster again.
+    bool clearCluster(fsInode* fsi, long from, long to) {
+        int index = from / clusterBytes();
+        long start = (long)index * clusterBytes();
+        shared_ptr<const vector<char> > cluster;
+        if (loadCluster(fsi, index, cluster) <= 0)
+            return false;
+
+        int first = from - start;
+        int last = min(to - start, (long)cluster->size());
+        if (first >= last)
+            return true;
+        vector<char> data(cluster->begin(), cluster->end());
+        memset(data.data() + first, 0, last - first);
+        return storeCluster(fsi, index, data.data(), data.size(), first, last);
+    }
+
+    // Before the file is cut short at `size`: a compressed cluster that
+    // size ends inside of is stored again without the bytes past it, so
+    // they don't come back if the file grows.
+    bool cutCluster(fsInode* fsi, long size) {
+        int index = size / clusterBytes();
+        long start = (long)index * clusterBytes();
+        if (size == start || !isCompressedCluster(fsi, index))
+            return true;
+
+        shared_ptr<const vector<char> > cluster;
+        if (loadCluster(fsi, index, cluster) <= 0)
+            return false;
+        if (size - start >= (long)cluster->size())
+            return true;
+        return storeCluster(fsi, index, cluster->data(), size - start, 0, size - start);
+    }
+
+    // Punches [from, to) out of a compressed file. The clusters it covers
+    // whole are unmapped, a compressed cluster it covers in part is zeroed
+    // there, and the rest goes block by block.
+    bool punchClusters(fsInode* fsi, long from, long to) {
+        long first = (from + clusterBytes() - 1) / clusterBytes() * clusterBytes();
+        long last = to / clusterBytes() * clusterBytes();
+        if (first > last)
+            return punchClusterPart(fsi, from, to);
+        return punchClusterPart(fsi, from, first) && punchClusterPart(fsi, last, to)
+            && unmapRange(fsi, first / block_size, min(last / block_size, (long)INT32_MAX));
+    }
+
+    bool punchClusterPart(fsInode* fsi, long from, long to) {
+        if (from >= to)
+            return true;
+        if (isCompressedCluster(fsi, from / clusterBytes()))
+            return clearCluster(fsi, from, to);
+        return punchBlocks(fsi, from, to);
+    }
+
+    // ------------------------------------------------------------------------
+    // Shared blocks - only files flagged FS_INODE_SHARED can have blocks
+    // other files refer to, every other file skips the reference counts.
+    vector<uint16_t> readRefCounts(int start, int length) {
+        vector<uint16_t> refs(length);
+        int ret_val = readMeta(refCountOffset(start), (char*)refs.data(), (long)length * sizeof(uint16_t));
+        assert(ret_val);
+        return refs;
+    }
+
+    void writeRefCounts(int start, const vector<uint16_t>& refs) {
+        int ret_val = writeMeta(refCountOffset(start), (const char*)refs.data(), (long)refs.size() * sizeof(uint16_t));
+        assert(ret_val);
+    }
+
+    void addRefCounts(int start, int length, int add) {
+        lock_guard<recursive_mutex> guard(meta_lock);
+        vector<uint16_t> refs = readRefCounts(start, length);
+        for (uint16_t& ref : refs)
+            ref += add;
+        writeRefCounts(start, refs);
+    }
+
+    // The data blocks of the file as runs of (logical, physical, length).
+    vector<fsExtent> dataRuns(fsInode* fsi) {
+        if (fsi->isExtentMapped()) {
+            loadExtents(fsi);
+            return fsi->getExtents();
+        }
+
+        vector<fsExtent> runs;
+        int index = 0;
+        while (index < fsi->getDataBlocks()) {
+            int physical;
+            int run = mappedRun(fsi, index, fsi->getDataBlocks() - index, physical);
+            if (run == 0) {
+                index++;
+                continue;
+            }
+            runs.push_back(fsExtent{ index, physical, run });
+            index += run;
+        }
+        return runs;
+    }
+
+    bool canShareBlocks(fsInode* fsi) {
+        // shareBlocks gives the copy the pointer blocks of a file without holes.
+        if (!fsi->isExtentMapped() && hasHoles(fsi))
+            return false;
+
+        for (fsExtent& run : dataRuns(fsi)) {
+            for (uint16_t ref : readRefCounts(run.physical, run.length)) {
+                if (ref == FS_MAX_EXTRA_REFS)
+                    return false;
+            }
+        }
+        return true;
+    }
+
+    // Makes dest a copy of src that refers to the same data blocks. Only the
+    // mapping is new: pointer blocks, or the extent tree.
+    bool shareBlocks(fsInode* src, fsInode* dest) {
+        if (dest->isInline() && !promoteInline(dest))
+            return false;
+
+        if (src->isExtentMapped()) {
+            loadExtents(src);
+            dest->getExtents() = src->getExtents();
+            if (!writeExtentTree(dest, 0)) {
+                dest->getExtents().clear();
+                return false;
+            }
+            for (fsExtent& extent : dest->getExtents())
+                dest->addDataBlocks(extent.length);
+        }
+        else {
+            int dataBlocks = src->getDataBlocks();
+            queue<int> pointerBlocks = allocateBlocks(neededBlocksFor((long)dataBlocks * block_size) - dataBlocks);
+            if (neededBlocksFor((long)dataBlocks * block_size) > dataBlocks && pointerBlocks.empty())
+                return false;
+
+            // the same blocks addDataBlockToFileByIndex takes, in its order,
+            // with the pointer blocks swapped for dest's own.
+            for (int i = 0; i < dataBlocks; i++) {
+                queue<int> srcBlocks;
+                gatherBlocksByIndex(src, i, srcBlocks);
+                queue<int> destBlocks;
+                for (; srcBlocks.size() > 1; srcBlocks.pop()) {
+                    destBlocks.push(pointerBlocks.front());
+                    pointerBlocks.pop();
+                }
+                destBlocks.push(srcBlocks.front());
+                addDataBlockToFileByIndex(dest, i, destBlocks);
+            }
+        }
+
+        for (fsExtent& run : dataRuns(src))
+            addRefCounts(run.physical, run.length, 1);
+
+        dest->addFileSize(src->getFileSize());
+        src->setShared();
+        dest->setShared();
+        writeInode(src);
+        writeInode(dest);
+        return true;
+    }
+
+    // Copies the data through a bounded buffer, into blocks of dest's own.
+    bool copyFileData(fsInode* src, fsInode* dest) {
+        vector<char> buf(min(src->getFileSize(), (long)LIST_CHUNK_SIZE));
+        for (long done = 0; done < src->getFileSize(); done += buf.size()) {
+            int chunk = min(src->getFileSize() - done, (long)buf.size());
+            if (readDataAt(src, done, buf.data(), chunk) != chunk || writeDataAt(dest, done, buf.data(), chunk) != chunk)
+                return false;
+        }
+        return true;
+    }
+
+    // Gives the file blocks of its own for the shared blocks a write to
+    // [offset, offset + len) touches, including the old last block when the
+    // write starts past it. Blocks the write covers whole aren't copied, so
+    // the `holes` the write maps after this must have their room as well.
+    bool unshareRange(fsInode* fsi, long offset, int len, int holes = 0) {
+        // the reference counts read must not change before they are dropped.
+        lock_guard<recursive_mutex> guard(meta_lock);
+        int first = min(offset, fsi->getFileSize()) / block_size;
+        int end = dataBlocksForFileSize(offset + len);
+        if (!fsi->isExtentMapped())
+            end = min(end, fsi->getDataBlocks());
+
+        vector<fsExtent> shared;
+        int sharedBlocks = 0;
+        int index = first;
+        while (index < end) {
+            int physical;
+            int run = mappedRun(fsi, index, end - index, physical);
+            if (run == 0) {
+                run = 1;
+                if (fsi->isExtentMapped())
+                    mapExtent(fsi, index, run);
+                index += min(run, end - index);
+                continue;
+            }
+
+            vector<uint16_t> refs = readRefCounts(physical, run);
+            // blocks of the file's own are written in place, they leave the
+            // dedup index before they change.
+            for (int i = 0; isDedupEnabled() && i < run; i++) {
+                if (refs[i] == 0)
+                    forgetBlocks(physical + i, 1);
+            }
+            for (int i = 0; i < run; ) {
+                int j = i;
+                while (j < run && refs[j] > 0)
+                    j++;
+                if (j > i) {
+                    shared.push_back(fsExtent{ index + i, physical + i, j - i });
+                    sharedBlocks += j - i;
+                }
+                i = j + 1;
+            }
+            index += run;
+        }
+        if (shared.empty())
+            return true;
+
+        // every new run may split an extent in three, and every hole block
+        // may get an extent of its own.
+        int needed = sharedBlocks + holes;
+        if (fsi->isExtentMapped())
+            needed += max(0, extentTreeBlocksFor(fsi->getExtents().size() + 2 * sharedBlocks + holes)
+                - (int)fsi->getExtentTreeBlocks().size());
+        else if (holes > 0)
+            needed += missingPointerBlocks(fsi, offset / block_size, dataBlocksForFileSize(offset + len));
+        if (!haveFreeBlocks(needed)) {
+            cerr << "ERR - not enough space" << endl;
+            return false;
+        }
+
+        vector<char> data(block_size);
+        int firstChanged = INT32_MAX;
+        for (fsExtent& run : shared) {
+            for (int done = 0; done < run.length; ) {
+                int start = -1;
+                int length = 1;
+                if (fsi->isExtentMapped()) {
+                    length = BitVector.allocateRun(extentGoal(fsi, run.logical + done), run.length - done, start);
+                    writeBitVectorRange(start, length);
+                }
+                else
+                    start = allocateBlocks(1, pointerGoal(fsi, run.logical + done)).front();
+
+                for (int i = 0; i < length; i++) {
+                    long blockStart = (long)(run.logical + done + i) * block_size;
+                    if (blockStart >= offset && blockStart + block_size <= offset + len)
+                        continue;
+                    int ret_val = readBlock(run.physical + done + i, data.data()) && writeBlock(start + i, data.data());
+                    assert(ret_val);
+                }
+
+                if (fsi->isExtentMapped())
+                    firstChanged = min(firstChanged, remapExtent(fsi, run.logical + done, length, start));
+                else
+                    setDataBlockByIndex(fsi, run.logical + done, start);
+                done += length;
+            }
+            // with dedup a file can have a block at several places, the
+            // last of them to be copied frees it.
+            dropBlocks(run.physical, run.length);
+        }
+
+        if (fsi->isExtentMapped()) {
+            int ret_val = writeExtentTree(fsi, firstChanged);
+            assert(ret_val);
+        }
+        writeInode(fsi);
+        return true;
+    }
+
+    // Maps the blocks [index, index + length), all inside one extent, to
+    // the blocks from `physical` on. Returns the position of the first
+    // extent that changed.
+    int remapExtent(fsInode* fsi, int index, int length, int physical) {
+        vector<fsExtent>& extents = fsi->getExtents();
+        auto it = upper_bound(extents.begin(), extents.end(), index,
+            [](int logical, const fsExtent& extent) { return logical < extent.logical; });
+        int pos = --it - extents.begin();
+        fsExtent old = *it;
+
+        vector<fsExtent> pieces;
+        if (index > old.logical)
+            pieces.push_back(fsExtent{ old.logical, old.physical, index - old.logical });
+        pieces.push_back(fsExtent{ index, physical, length });
+        int tail = index + length;
+        if (tail < old.logical + old.length)
+            pieces.push_back(fsExtent{ tail, old.physical + tail - old.logical, old.logical + old.length - tail });
+
+        extents.erase(it);
+        extents.insert(extents.begin() + pos, pieces.begin(), pieces.end());
+
+        // the new piece may continue its neighbours.
+        int mid = pos + (index > old.logical ? 1 : 0);
+        mergeWithNext(extents, mid);
+        if (mid > 0)
+            mergeWithNext(extents, mid - 1);
+        return max(0, pos - 1);
+    }
+
+    // Drops a reference to each of the blocks, freeing those that had no
+    // other.
+    void dropBlocks(int start, int length) {
+        lock_guard<recursive_mutex> guard(meta_lock);
+        vector<uint16_t> refs = readRefCounts(start, length);
+        bool shared = false;
+        int unreferenced = 0;
+        for (int i = 0; i <= length; i++) {
+            if (i < length && refs[i] == 0) {
+                unreferenced++;
+                continue;
+            }
+            if (unreferenced > 0)
+                releaseBlocks(start + i - unreferenced, unreferenced);
+            unreferenced = 0;
+            if (i < length) {
+                refs[i]--;
+                shared = true;
+            }
+        }
+        if (shared)
+            writeRefCounts(start, refs);
+    }
+
+    // With a goal, the blocks are taken in runs from the goal on, as
+    // contiguous as the BitVector allows. Without one, next-fit.
+    queue<int> allocateBlocks(int amount, int goal = -1) {
+        lock_guard<recursive_mutex> guard(meta_lock);
+        queue<int> blocks;
+        if (!haveFreeBlocks(amount)) {
+            cerr << "ERR - could not allocate enough blocks" << endl;
+            return blocks;
+        }
+
+        while (goal >= 0 && (int)blocks.size() < amount) {
+            int start;
+            int length = BitVector.allocateRun(goal, amount - blocks.size(), start);
+            assert(length > 0);
+            writeBitVectorRange(start, length);
+            for (int i = 0; i < length; i++)
+                blocks.push(start + i);
+            goal = start + length;
+        }
+
+        while ((int)blocks.size() < amount) {
+            int block = BitVector.allocate();
+            assert(block >= 0);
+            writeBitVector(block);
+            blocks.push(block);
+        }
+        return blocks;
+    }
+
+    void freeBlocks(queue<int> blocks) {
+        for (pair<int, int>& run : blockRuns(blocks))
+            releaseBlocks(run.first, run.second);
+    }
+
+    // The blocks sorted and merged into runs of (first block, length), so
+    // the BitVector is changed a word at a time instead of a bit at a time.
+    vector<pair<int, int> > blockRuns(queue<int> blocks) {
+        vector<int> sorted;
+        sorted.reserve(blocks.size());
+        for (; !blocks.empty(); blocks.pop())
+            sorted.push_back(blocks.front());
+        sort(sorted.begin(), sorted.end());
+
+        vector<pair<int, int> > runs;
+        for (int block : sorted) {
+            if (!runs.empty() && runs.back().first + runs.back().second == block)
+                runs.back().second++;
+            else
+                runs.push_back(make_pair(block, 1));
+        }
+        return runs;
+    }
+
+    // Gives blocks back to the BitVector. With the journal they are only
+    // given back when the running transaction commits: until then a crash
+    // brings back the state that still uses them.
+    void releaseBlocks(int start, int length) {
+        lock_guard<recursive_mutex> guard(meta_lock);
+        forgetBlocks(start, length);
+        forgetClusters(start, length);
+        if (journal.isActive()) {
+            FreedBlocks.push_back(make_pair(start, length));
+            return;
+        }
+        BitVector.clearRange(start, length);
+        writeBitVectorRange(start, length);
+    }
+
+    // Whether `amount` blocks are free. Blocks waiting for a commit to be
+    // freed are freed by committing early when they are needed.
+    // Blocks set aside for delayed appends don't count as free.
+    bool haveFreeBlocks(int amount) {
+        lock_guard<recursive_mutex> guard(meta_lock);
+        if (BitVector.getFreeBlocks() - ReservedBlocks < amount && !FreedBlocks.empty())
+            commitJournal();
+        return BitVector.getFreeBlocks() - ReservedBlocks >= amount;
+    }
+};
+
+#endif
@@ -0,0 +1,493 @@
+#include "fs_disk.h"
+
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <random>
+#include <sstream>
+#include <thread>
+
+// ============================================================================
+// fs_workload - runs workloads against the fsDisk API in-process, in the
+//               manner of fio, and reports ops/s, MB/s (of the workloads
+//               that move file data) and the latency percentiles of each. Options are key=value arguments, the
+//               workloads run in the order given on one freshly formatted
+//               disk, so later ones find the files of earlier ones.
+//
+//   workload=  comma separated list of
+//              seqwrite   each thread appends `bs` chunks to its file until
+//                         it has `size` bytes
+//              seqread    reads the file from its start in `bs` chunks
+//              randwrite  `ops` WriteAt calls of `bs` bytes at random
+//                         offsets of the file, aligned to `bs`
+//              randread   the same with ReadAt
+//              create     `files` small files of `bs` bytes, each created,
+//                         written and closed (one op)
+//              delete     deletes the files of create
+//              append     `ops` appends of `bs` byte records to a log that
+//                         keeps its last `size` bytes, the older blocks are
+//                         punched out
+//              copy       `ops` of CopyFile, RenameFile and DelFile at random
+//                         over a pool of files of `bs` bytes
+//   bs=        size of one call (4k)
+//   size=      file size of every thread (64m)
+//   ops=       operations of the random workloads, split among the threads
+//              (100000)
+//   files=     files of create, split among the threads (10000)
+//   threads=   threads, each on its own files (1)
+//   sync=      sync() after every that many write ops, 0 for never (0)
+//   block=     block size (4096)
+//   disk=      disk size (1g)
+//   features=  pointers, or a comma separated list of extents, journal,
+//              inline, dedup and compress (pointers)
+//   backend=   pread, stdio or mmap (pread)
+//   cache=     blocks of the block cache (64)
+//   seed=      of the random offsets and choices (1)
+//   stats=     1 prints the block and dentry cache counters at the end (0)
+// Sizes take a k, m or g suffix.
+
+#define WORKLOAD_COPY_POOL 32
+
+struct WorkloadConfig {
+    vector<string> workloads;
+    long ioSize;
+    long fileSize;
+    long ops;
+    long files;
+    int threads;
+    int syncEvery;
+    int blockSize;
+    long diskSize;
+    int features;
+    int backend;
+    int cacheBlocks;
+    unsigned seed;
+    int stats;
+
+    // the files an earlier workload left, one entry per thread.
+    vector<char> dataFiles;
+    vector<char> logFiles;
+};
+
+// What one thread did in a workload. Latencies are in nanoseconds.
+struct WorkloadThread {
+    vector<long> latencies;
+    long bytes;
+    bool failed;
+};
+
+typedef function<bool(fsDisk*, WorkloadConfig&, int, mt19937&, WorkloadThread&)> WorkloadFunction;
+
+double secondsSince(chrono::steady_clock::time_point start) {
+    return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+// Runs op and records how long it took. op returns false on failure.
+bool timed(WorkloadThread& state, const function<bool()>& op) {
+    auto start = chrono::steady_clock::now();
+    bool done = op();
+    state.latencies.push_back(chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count());
+    return done;
+}
+
+// sync() after every cfg.syncEvery write ops, counted per thread.
+bool syncIfDue(fsDisk* fs, WorkloadConfig& cfg, long op) {
+    return cfg.syncEvery <= 0 || (op + 1) % cfg.syncEvery != 0 || fs->sync();
+}
+
+string dataFileName(int t) {
+    return "data" + to_string(t);
+}
+
+// ----------------------------------------------------------------------------
+// Workloads - one call per thread, on the files of thread t.
+
+// The data file of the thread, written in full without being timed when an
+// earlier workload didn't write it. Returns its descriptor, or -1.
+int openDataFile(fsDisk* fs, WorkloadConfig& cfg, int t) {
+    int fd = cfg.dataFiles[t] ? fs->OpenFile(dataFileName(t)) : fs->CreateFile(dataFileName(t));
+    if (fd < 0)
+        return -1;
+    cfg.dataFiles[t] = true;
+
+    vector<char> data(cfg.ioSize, 'a' + t % 26);
+    for (long done = fs->getFileSize(fd); done < cfg.fileSize; done += cfg.ioSize) {
+        if (fs->WriteAt(fd, done, data.data(), min(cfg.ioSize, cfg.fileSize - done)) < 0)
+            return -1;
+    }
+    return fd;
+}
+
+bool seqWrite(fsDisk* fs, WorkloadConfig& cfg, int t, mt19937&, WorkloadThread& state) {
+    if (cfg.dataFiles[t] && fs->DelFile(dataFileName(t)) < 0)
+        return false;
+    int fd = fs->CreateFile(dataFileName(t));
+    if (fd < 0)
+        return false;
+    cfg.dataFiles[t] = true;
+
+    vector<char> data(cfg.ioSize, 'a' + t % 26);
+    long op = 0;
+    for (long done = 0; done < cfg.fileSize; done += cfg.ioSize, op++) {
+        int len = min(cfg.ioSize, cfg.fileSize - done);
+        if (!timed(state, [&]() { return fs->WriteToFile(fd, data.data(), len) == len && syncIfDue(fs, cfg, op); }))
+            return false;
+        state.bytes += len;
+    }
+    return fs->CloseFile(fd) != "-1";
+}
+
+bool seqRead(fsDisk* fs, WorkloadConfig& cfg, int t, mt19937&, WorkloadThread& state) {
+    int fd = openDataFile(fs, cfg, t);
+    if (fd < 0 || fs->Seek(fd, 0, SEEK_SET) < 0)
+        return false;
+
+    vector<char> buf(cfg.ioSize);
+    for (long done = 0; done < cfg.fileSize; done += cfg.ioSize) {
+        int len = min(cfg.ioSize, cfg.fileSize - done);
+        if (!timed(state, [&]() { return fs->Read(fd, buf.data(), len) == len; }))
+            return false;
+        state.bytes += len;
+    }
+    return fs->CloseFile(fd) != "-1";
+}
+
+bool randomIO(fsDisk* fs, WorkloadConfig& cfg, int t, mt19937& rng, WorkloadThread& state, bool write) {
+    int fd = openDataFile(fs, cfg, t);
+    if (fd < 0)
+        return false;
+
+    vector<char> buf(cfg.ioSize, 'A' + t % 26);
+    long slots = max(cfg.fileSize / cfg.ioSize, 1L);
+    long ops = cfg.ops / cfg.threads;
+    for (long op = 0; op < ops; op++) {
+        long offset = rng() % slots * cfg.ioSize;
+        int len = min(cfg.ioSize, cfg.fileSize - offset);
+        bool done = timed(state, [&]() {
+            if (!write)
+                return fs->ReadAt(fd, offset, buf.data(), len) == len;
+            return fs->WriteAt(fd, offset, buf.data(), len) == len && syncIfDue(fs, cfg, op);
+        });
+        if (!done)
+            return false;
+        state.bytes += len;
+    }
+    return fs->CloseFile(fd) != "-1";
+}
+
+bool randWrite(fsDisk* fs, WorkloadConfig& cfg, int t, mt19937& rng, WorkloadThread& state) {
+    return randomIO(fs, cfg, t, rng, state, true);
+}
+
+bool randRead(fsDisk* fs, WorkloadConfig& cfg, int t, mt19937& rng, WorkloadThread& state) {
+    return randomIO(fs, cfg, t, rng, state, false);
+}
+
+bool createFiles(fsDisk* fs, WorkloadConfig& cfg, int t, mt19937&, WorkloadThread& state) {
+    string dir = "small" + to_string(t);
+    if (fs->MkDir(dir) < 0)
+        return false;
+
+    vector<char> data(cfg.ioSize, 'a' + t % 26);
+    long files = cfg.files / cfg.threads;
+    for (long i = 0; i < files; i++) {
+        bool done = timed(state, [&]() {
+            int fd = fs->CreateFile(dir + "/f" + to_string(i));
+            return fd >= 0 && fs->WriteToFile(fd, data.data(), cfg.ioSize) == cfg.ioSize && fs->CloseFile(fd) != "-1"
+                && syncIfDue(fs, cfg, i);
+        });
+        if (!done)
+            return false;
+        state.bytes += cfg.ioSize;
+    }
+    return true;
+}
+
+bool deleteFiles(fsDisk* fs, WorkloadConfig& cfg, int t, mt19937&, WorkloadThread& state) {
+    string dir = "small" + to_string(t);
+    long files = cfg.files / cfg.threads;
+    for (long i = 0; i < files; i++) {
+        if (!timed(state, [&]() { return fs->DelFile(dir + "/f" + to_string(i)) == 1 && syncIfDue(fs, cfg, i); }))
+            return false;
+    }
+    return fs->RmDir(dir) >= 0;
+}
+
+bool appendLog(fsDisk* fs, WorkloadConfig& cfg, int t, mt19937&, WorkloadThread& state) {
+    string name = "log" + to_string(t);
+    if (cfg.logFiles[t] && fs->DelFile(name) < 0)
+        return false;
+    int fd = fs->CreateFile(name);
+    if (fd < 0)
+        return false;
+    cfg.logFiles[t] = true;
+
+    // the log keeps its last cfg.fileSize bytes, whole blocks before those
+    // are punched out.
+    vector<char> record(cfg.ioSize, 'a' + t % 26);
+    long size = 0;
+    long punched = 0;
+    long ops = cfg.ops / cfg.threads;
+    for (long op = 0; op < ops; op++) {
+        bool done = timed(state, [&]() {
+            if (fs->WriteToFile(fd, record.data(), cfg.ioSize) != cfg.ioSize)
+                return false;
+            size += cfg.ioSize;
+            long oldest = (size - cfg.fileSize) / cfg.blockSize * cfg.blockSize;
+            if (oldest > punched) {
+                if (fs->PunchHole(fd, punched, oldest - punched) < 0)
+                    return false;
+                punched = oldest;
+            }
+            return syncIfDue(fs, cfg, op);
+        });
+        if (!done)
+            return false;
+        state.bytes += cfg.ioSize;
+    }
+    return fs->CloseFile(fd) != "-1";
+}
+
+bool copyMix(fsDisk* fs, WorkloadConfig& cfg, int t, mt19937& rng, WorkloadThread& state) {
+    string prefix = "mix" + to_string(t) + "_";
+    vector<int> present;
+    vector<int> absent;
+    for (int i = 1; i < WORKLOAD_COPY_POOL; i++)
+        absent.push_back(i);
+
+    int fd = fs->CreateFile(prefix + "0");
+    vector<char> data(cfg.ioSize, 'a' + t % 26);
+    if (fd < 0 || fs->WriteToFile(fd, data.data(), cfg.ioSize) != cfg.ioSize || fs->CloseFile(fd) == "-1")
+        return false;
+    present.push_back(0);
+
+    long ops = cfg.ops / cfg.threads;
+    for (long op = 0; op < ops; op++) {
+        int choice = rng() % 3;
+        int from = rng() % present.size();
+        int to = absent.empty() ? -1 : (int)(rng() % absent.size());
+        if ((to < 0 || choice == 2) && present.size() > 1) {
+            int victim = present[from];
+            if (!timed(state, [&]() { return fs->DelFile(prefix + to_string(victim)) == 1 && syncIfDue(fs, cfg, op); }))
+                return false;
+            present.erase(present.begin() + from);
+            absent.push_back(victim);
+            continue;
+        }
+
+        string source = prefix + to_string(present[from]);
+        string dest = prefix + to_string(absent[to]);
+        bool done = timed(state, [&]() {
+            int ret_val = choice == 0 ? fs->RenameFile(source, dest) : fs->CopyFile(source, dest);
+            return ret_val >= 0 && syncIfDue(fs, cfg, op);
+        });
+        if (!done)
+            return false;
+        present.push_back(absent[to]);
+        absent.erase(absent.begin() + to);
+        if (choice == 0) {
+            absent.push_back(present[from]);
+            present.erase(present.begin() + from);
+        }
+    }
+
+    for (int i : present) {
+        if (fs->DelFile(prefix + to_string(i)) < 0)
+            return false;
+    }
+    return true;
+}
+
+// ----------------------------------------------------------------------------
+// Runs a workload on every thread at once and prints what it did.
+bool runWorkload(fsDisk* fs, WorkloadConfig& cfg, const string& name, WorkloadFunction workload) {
+    vector<WorkloadThread> states(cfg.threads, WorkloadThread{ vector<long>(), 0, false });
+    vector<thread> workers;
+    auto start = chrono::steady_clock::now();
+    for (int t = 0; t < cfg.threads; t++) {
+        workers.emplace_back([&, t]() {
+            mt19937 rng(cfg.seed + t);
+            states[t].failed = !workload(fs, cfg, t, rng, states[t]);
+        });
+    }
+    for (thread& worker : workers)
+        worker.join();
+    bool synced = fs->sync();
+    double seconds = secondsSince(start);
+
+    vector<long> latencies;
+    long bytes = 0;
+    for (WorkloadThread& state : states) {
+        if (state.failed || !synced) {
+            cerr << "ERR - workload " << name << " failed" << endl;
+            return false;
+        }
+        latencies.insert(latencies.end(), state.latencies.begin(), state.latencies.end());
+        bytes += state.bytes;
+    }
+    sort(latencies.begin(), latencies.end());
+
+    auto percentile = [&latencies](double p) {
+        if (latencies.empty())
+            return 0.0;
+        return latencies[min((long)latencies.size() - 1, (long)(p * latencies.size()))] / 1000.0;
+    };
+    // copies share their blocks and deletes move no data, they only get ops/s.
+    cout << name << ": " << latencies.size() << " ops in " << seconds << " s, " << latencies.size() / seconds << " ops/s";
+    if (bytes > 0)
+        cout << ", " << bytes / seconds / (1024 * 1024) << " MB/s";
+    cout << endl;
+    cout << name << " latency (us): p50 " << percentile(0.5) << ", p90 " << percentile(0.9) << ", p99 "
+        << percentile(0.99) << ", p99.9 " << percentile(0.999) << ", max " << percentile(1) << endl;
+    return true;
+}
+
+// ----------------------------------------------------------------------------
+// Options
+
+// "64m" -> 67108864. Returns -1 if it isn't a size.
+long parseSize(const string& value) {
+    size_t used = 0;
+    long size;
+    try {
+        size = stol(value, &used);
+    }
+    catch (...) {
+        return -1;
+    }
+
+    string suffix = value.substr(used);
+    if (suffix == "k" || suffix == "K")
+        size <<= 10;
+    else if (suffix == "m" || suffix == "M")
+        size <<= 20;
+    else if (suffix == "g" || suffix == "G")
+        size <<= 30;
+    else if (!suffix.empty())
+        return -1;
+    return size;
+}
+
+vector<string> splitList(const string& value) {
+    vector<string> items;
+    stringstream stream(value);
+    string item;
+    while (getline(stream, item, ','))
+        items.push_back(item);
+    return items;
+}
+
+bool parseOption(WorkloadConfig& cfg, const string& arg) {
+    size_t eq = arg.find('=');
+    if (eq == string::npos)
+        return false;
+    string key = arg.substr(0, eq);
+    string value = arg.substr(eq + 1);
+
+    if (key == "workload") {
+        cfg.workloads = splitList(value);
+        return !cfg.workloads.empty();
+    }
+    if (key == "features") {
+        cfg.features = 0;
+        for (string& feature : splitList(value)) {
+            if (feature == "extents")
+                cfg.features |= FS_FEATURE_EXTENTS;
+            else if (feature == "journal")
+                cfg.features |= FS_FEATURE_JOURNAL;
+            else if (feature == "inline")
+                cfg.features |= FS_FEATURE_INLINE;
+            else if (feature == "dedup")
+                cfg.features |= FS_FEATURE_DEDUP;
+            else if (feature == "compress")
+                cfg.features |= FS_FEATURE_COMPRESS;
+            else if (feature != "pointers")
+                return false;
+        }
+        return true;
+    }
+    if (key == "backend") {
+        cfg.backend = value == "pread" ? DEVICE_PREAD : value == "stdio" ? DEVICE_STDIO
+            : value == "mmap" ? DEVICE_MMAP : -1;
+        return cfg.backend >= 0;
+    }
+
+    long number = parseSize(value);
+    if (number < 0)
+        return false;
+    if (key == "bs")
+        cfg.ioSize = number;
+    else if (key == "size")
+        cfg.fileSize = number;
+    else if (key == "ops")
+        cfg.ops = number;
+    else if (key == "files")
+        cfg.files = number;
+    else if (key == "threads")
+        cfg.threads = number;
+    else if (key == "sync")
+        cfg.syncEvery = number;
+    else if (key == "block")
+        cfg.blockSize = number;
+    else if (key == "disk")
+        cfg.diskSize = number;
+    else if (key == "cache")
+        cfg.cacheBlocks = number;
+    else if (key == "seed")
+        cfg.seed = number;
+    else if (key == "stats")
+        cfg.stats = number;
+    else
+        return false;
+    return true;
+}
+
+// usage: fs_workload [workload=seqwrite,seqread,...] [bs=4k] [size=64m] [ops=100000] [files=10000]
+//                    [threads=1] [sync=0] [block=4096] [disk=1g] [features=pointers] [backend=pread]
+//                    [cache=64] [seed=1] [stats=0]
+int main(int argc, char* argv[]) {
+    WorkloadConfig cfg = { splitList("seqwrite,seqread,randwrite,randread"), 4096, 64L << 20, 100000, 10000,
+        1, 0, 4096, 1L << 30, 0, DEVICE_PREAD, DEFAULT_CACHE_BLOCKS, 1, 0, {}, {} };
+    for (int i = 1; i < argc; i++) {
+        if (!parseOption(cfg, argv[i])) {
+            cerr << "ERR - illegal option " << argv[i] << endl;
+            return 1;
+        }
+    }
+    if (cfg.ioSize <= 0 || cfg.ioSize > INT32_MAX || cfg.fileSize <= 0 || cfg.threads <= 0) {
+        cerr << "ERR - bs, size and threads must be positive" << endl;
+        return 1;
+    }
+
+    map<string, WorkloadFunction> workloads = {
+        { "seqwrite", seqWrite }, { "seqread", seqRead }, { "randwrite", randWrite }, { "randread", randRead },
+        { "create", createFiles }, { "delete", deleteFiles }, { "append", appendLog }, { "copy", copyMix },
+    };
+    cfg.dataFiles.assign(cfg.threads, false);
+    cfg.logFiles.assign(cfg.threads, false);
+    for (string& name : cfg.workloads) {
+        if (!workloads.count(name)) {
+            cerr << "ERR - unknown workload " << name << endl;
+            return 1;
+        }
+    }
+
+    fsDisk* fs = new fsDisk(cfg.cacheBlocks, cfg.backend);
+    fs->fsFormat(cfg.blockSize, cfg.diskSize, cfg.features);
+    if (!fs->isFormatted()) {
+        delete fs;
+        return 1;
+    }
+
+    int ret_val = 0;
+    for (string& name : cfg.workloads) {
+        if (!runWorkload(fs, cfg, name, workloads[name])) {
+            ret_val = 1;
+            break;
+        }
+    }
+    if (cfg.stats)
+        fs->printCacheStats();
+    delete fs;
+    return ret_val;
+}
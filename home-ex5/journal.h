@@ -0,0 +1,345 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdint.h>
+#include <string.h>
+#include <map>
+#include <set>
+#include <vector>
+
+#include "block_device.h"
+
+#define JOURNAL_MAGIC 0x4c4e524a
+#define JOURNAL_TX_MAGIC 0x5854524a
+#define JOURNAL_HEADER_SIZE 64
+#define JOURNAL_BATCH_OPS 64
+
+// The start of the journal region. Transactions are written one after the
+// other behind it, the first with first_sequence.
+struct JournalHeader {
+    uint32_t magic;
+    uint32_t reserved;
+    uint64_t first_sequence;
+};
+
+// A transaction is this header, `revokes` block numbers (int64) and
+// `blocks` records of a block number (int64) and the block's content.
+struct JournalTxHeader {
+    uint32_t magic;
+    uint32_t blocks;
+    uint32_t revokes;
+    uint32_t reserved;
+    uint64_t sequence;
+    uint64_t checksum;      // of the sequence and everything after the header
+};
+
+// ============================================================================
+// Journal - redo log of metadata blocks, kept in a region of the disk image.
+//           Operations add the blocks they change to the running
+//           transaction, and the operations of a batch are committed
+//           together (group commit): one write and one fdatasync. Blocks
+//           are written in place only after that, and a mount replays the
+//           committed transactions that may not have reached their place.
+//           A block that was journaled and then freed is revoked, so a
+//           replay doesn't overwrite whatever the block holds later.
+class Journal {
+    BlockDevice* device;
+
+    long start;             // offset of the region in the image
+    long size;              // 0 when the journal is off
+    int block_size;
+
+    uint64_t sequence;      // of the running transaction
+    long head;              // where it goes, from the end of the header
+    int ops;                // finished operations in the running transaction
+    int depth;              // nesting of operations in progress
+    int batch;
+
+    std::map<long, std::vector<char> > blocks;     // image block -> content
+    std::set<long> revokes;
+    std::set<long> logged;  // blocks of committed transactions since the
+                            // last checkpoint
+
+    long commits;
+    long splits;            // transactions committed before their
+                            // operations ended, they outgrew the journal
+
+public:
+    Journal(BlockDevice* _device) {
+        device = _device;
+        batch = JOURNAL_BATCH_OPS;
+        commits = 0;
+        splits = 0;
+        disable();
+    }
+
+    void disable() {
+        start = 0;
+        size = 0;
+        block_size = 0;
+        sequence = 1;
+        head = 0;
+        ops = 0;
+        depth = 0;
+        blocks.clear();
+        revokes.clear();
+        logged.clear();
+    }
+
+    bool isActive() {
+        return size > 0;
+    }
+
+    // An empty journal over [_start, _start + _size), for a new disk.
+    bool reset(long _start, long _size, int _block_size) {
+        disable();
+        start = _start;
+        size = _size;
+        block_size = _block_size;
+        return restart();
+    }
+
+    // Replays the committed transactions of the journal into place, then
+    // empties it. `replayed` gets the amount of transactions replayed.
+    bool recover(long _start, long _size, int _block_size, int& replayed) {
+        disable();
+        start = _start;
+        size = _size;
+        block_size = _block_size;
+        replayed = 0;
+
+        JournalHeader header;
+        if (!device->readAt(start, &header, sizeof(header)))
+            return false;
+        if (header.magic != JOURNAL_MAGIC)
+            return restart();
+
+        // collect the chain of valid transactions first, the revokes of a
+        // later one apply to the blocks of the earlier ones.
+        std::vector< std::vector<char> > payloads;
+        std::vector<JournalTxHeader> txs;
+        std::map<long, uint64_t> revokedAt;
+        sequence = header.first_sequence;
+        while (true) {
+            JournalTxHeader tx;
+            if (head + (long)sizeof(tx) > capacity() || !device->readAt(regionOffset(head), &tx, sizeof(tx)))
+                break;
+            if (tx.magic != JOURNAL_TX_MAGIC || tx.sequence != sequence)
+                break;
+
+            long length = payloadSize(tx.blocks, tx.revokes);
+            if (length < 0 || head + (long)sizeof(tx) + length > capacity())
+                break;
+
+            std::vector<char> payload(length);
+            if (!device->readAt(regionOffset(head + sizeof(tx)), payload.data(), length))
+                return false;
+            if (checksum(tx.sequence, payload.data(), length) != tx.checksum)
+                break;
+
+            for (uint32_t i = 0; i < tx.revokes; i++) {
+                int64_t block;
+                memcpy(&block, payload.data() + i * sizeof(block), sizeof(block));
+                revokedAt[block] = tx.sequence;
+            }
+            txs.push_back(tx);
+            payloads.push_back(payload);
+            head += sizeof(tx) + length;
+            sequence++;
+        }
+
+        for (size_t t = 0; t < txs.size(); t++) {
+            const char* record = payloads[t].data() + txs[t].revokes * sizeof(int64_t);
+            for (uint32_t i = 0; i < txs[t].blocks; i++, record += sizeof(int64_t) + block_size) {
+                int64_t block;
+                memcpy(&block, record, sizeof(block));
+                auto it = revokedAt.find(block);
+                if (it != revokedAt.end() && it->second > txs[t].sequence)
+                    continue;
+                if (!device->writeAt((off_t)block * block_size, record + sizeof(block), block_size))
+                    return false;
+            }
+        }
+
+        replayed = txs.size();
+        if (replayed > 0 && !device->sync())
+            return false;
+        return restart();
+    }
+
+    // ------------------------------------------------------------------------
+    // Operations nest, the batch only counts the outermost ones. end()
+    // returns true when the batch is due to be committed.
+    void begin() {
+        depth++;
+    }
+
+    bool end() {
+        depth--;
+        if (depth > 0 || !isActive())
+            return false;
+
+        ops++;
+        return isDue();
+    }
+
+    bool inProgress() {
+        return depth > 0;
+    }
+
+    // Whether the batch is due to be committed, it is once the operations
+    // in progress end.
+    bool isDue() {
+        return isActive() && (ops >= batch || pendingBytes() > size / 4);
+    }
+
+    void setBatch(int _batch) {
+        batch = _batch > 0 ? _batch : 1;
+    }
+
+    // The buffer to hold the new content of a block in the running
+    // transaction, block_size bytes.
+    char* log(long block) {
+        std::vector<char>& content = blocks[block];
+        content.resize(block_size);
+        return content.data();
+    }
+
+    // The block was freed, older copies of it must not be replayed.
+    void revoke(long block) {
+        blocks.erase(block);
+        if (logged.count(block))
+            revokes.insert(block);
+    }
+
+    // Blocks in [first, end) the journal has a copy of.
+    std::vector<long> loggedBetween(long first, long end) {
+        std::vector<long> found;
+        for (auto it = logged.lower_bound(first); it != logged.end() && *it < end; ++it)
+            found.push_back(*it);
+        for (auto it = blocks.lower_bound(first); it != blocks.end() && it->first < end; ++it) {
+            if (!logged.count(it->first))
+                found.push_back(it->first);
+        }
+        return found;
+    }
+
+    bool hasPending() {
+        return !blocks.empty() || !revokes.empty();
+    }
+
+    // Whether the block can go into the running transaction without it
+    // outgrowing the journal.
+    bool hasRoomFor(long block) {
+        return blocks.count(block) || pendingBytes() + (long)sizeof(int64_t) + block_size <= capacity();
+    }
+
+    // Whether the running transaction fits behind the committed ones.
+    bool fits() {
+        return head + pendingBytes() <= capacity();
+    }
+
+    // Whether it would fit into an empty journal.
+    bool canFit() {
+        return pendingBytes() <= capacity();
+    }
+
+    // Writes the running transaction behind the committed ones and makes
+    // it durable. Call only when it fits().
+    bool commit() {
+        uint32_t revokeCount = revokes.size();
+        uint32_t blockCount = blocks.size();
+        std::vector<char> buf(pendingBytes());
+        char* out = buf.data() + sizeof(JournalTxHeader);
+        for (long block : revokes) {
+            int64_t number = block;
+            memcpy(out, &number, sizeof(number));
+            out += sizeof(number);
+        }
+        for (auto& entry : blocks) {
+            int64_t number = entry.first;
+            memcpy(out, &number, sizeof(number));
+            memcpy(out + sizeof(number), entry.second.data(), block_size);
+            out += sizeof(number) + block_size;
+        }
+
+        JournalTxHeader tx = { JOURNAL_TX_MAGIC, blockCount, revokeCount, 0, sequence, 0 };
+        tx.checksum = checksum(sequence, buf.data() + sizeof(tx), buf.size() - sizeof(tx));
+        memcpy(buf.data(), &tx, sizeof(tx));
+        if (!device->writeAt(regionOffset(head), buf.data(), buf.size()) || !device->sync())
+            return false;
+
+        head += buf.size();
+        sequence++;
+        for (auto& entry : blocks)
+            logged.insert(entry.first);
+        discard();
+        commits++;
+        return true;
+    }
+
+    // Drops the running transaction, its blocks were written in place
+    // some other way.
+    void discard() {
+        blocks.clear();
+        revokes.clear();
+        ops = 0;
+    }
+
+    // Every committed transaction reached its place (the cache was flushed
+    // and synced), the journal starts over. The new header becomes durable
+    // with the next commit, a replay of the old transactions meanwhile
+    // only repeats what is in place already.
+    bool restart() {
+        JournalHeader header;
+        memset(&header, 0, sizeof(header));
+        header.magic = JOURNAL_MAGIC;
+        header.first_sequence = sequence;
+        head = 0;
+        logged.clear();
+        return device->writeAt(start, &header, sizeof(header));
+    }
+
+    long getCommits() {
+        return commits;
+    }
+
+    void countSplit() {
+        splits++;
+    }
+
+    long getSplits() {
+        return splits;
+    }
+
+private:
+    long capacity() {
+        return size - JOURNAL_HEADER_SIZE;
+    }
+
+    long regionOffset(long position) {
+        return start + JOURNAL_HEADER_SIZE + position;
+    }
+
+    long payloadSize(long blockCount, long revokeCount) {
+        if (blockCount < 0 || revokeCount < 0)
+            return -1;
+        return revokeCount * sizeof(int64_t) + blockCount * (sizeof(int64_t) + block_size);
+    }
+
+    long pendingBytes() {
+        return sizeof(JournalTxHeader) + payloadSize(blocks.size(), revokes.size());
+    }
+
+    // FNV-1a, a torn transaction doesn't match it.
+    uint64_t checksum(uint64_t seq, const char* data, long len) {
+        uint64_t hash = 14695981039346656037ULL;
+        for (int i = 0; i < 8; i++)
+            hash = (hash ^ ((seq >> (8 * i)) & 0xff)) * 1099511628211ULL;
+        for (long i = 0; i < len; i++)
+            hash = (hash ^ (unsigned char)data[i]) * 1099511628211ULL;
+        return hash;
+    }
+};
+
+#endif
@@ -0,0 +1,195 @@
+#ifndef LZ_CODEC_H
+#define LZ_CODEC_H
+
+#include <stdint.h>
+#include <string.h>
+
+// matches are at least this long, and the last bytes of the input are
+// always literals, so the compressor can read a word past a match start.
+#define LZ_MIN_MATCH 4
+#define LZ_LAST_LITERALS 8
+#define LZ_MAX_OFFSET 65535
+#define LZ_HASH_BITS 12
+
+// ============================================================================
+// LZ codec - a byte oriented LZ77 in the manner of LZ4. The output is a
+//            list of sequences: a token byte (literal length in the high
+//            nibble, match length - LZ_MIN_MATCH in the low one, 15 meaning
+//            more length bytes follow, each adding up to 255), the
+//            literals, then a 2 byte little endian offset back into the
+//            output. The last sequence has literals only. Matches are found
+//            through a hash table of the last position of every 4 byte
+//            sequence; the further the compressor gets without a match, the
+//            more positions it skips, so data that doesn't compress costs
+//            little time.
+
+inline uint32_t lzRead32(const char* p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+inline uint64_t lzRead64(const char* p) {
+    uint64_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+inline int lzHash(uint32_t sequence) {
+    return (sequence * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+// Writes a length past the 15 of its nibble. False when it doesn't fit.
+inline bool lzWriteLength(char* dst, int& out, int capacity, int length) {
+    for (; length >= 255; length -= 255) {
+        if (out >= capacity)
+            return false;
+        dst[out++] = (char)255;
+    }
+    if (out >= capacity)
+        return false;
+    dst[out++] = (char)length;
+    return true;
+}
+
+// Compresses len bytes of src into dst. Returns the compressed size, or 0
+// when it would take more than capacity bytes.
+inline int lzCompress(const char* src, int len, char* dst, int capacity) {
+    int table[1 << LZ_HASH_BITS];
+    for (int& position : table)
+        position = -1;
+
+    int in = 0;
+    int anchor = 0;
+    int out = 0;
+    int limit = len - LZ_LAST_LITERALS;
+    while (in < limit - LZ_MIN_MATCH) {
+        uint32_t sequence = lzRead32(src + in);
+        int h = lzHash(sequence);
+        int candidate = table[h];
+        table[h] = in;
+        if (candidate < 0 || in - candidate > LZ_MAX_OFFSET || lzRead32(src + candidate) != sequence) {
+            in += 1 + ((in - anchor) >> 6);
+            continue;
+        }
+
+        // 8 bytes at a time, the first differing byte ends the match.
+        int match = LZ_MIN_MATCH;
+        while (in + match + 8 <= limit) {
+            uint64_t diff = lzRead64(src + candidate + match) ^ lzRead64(src + in + match);
+            if (diff != 0) {
+                match += __builtin_ctzll(diff) / 8;
+                break;
+            }
+            match += 8;
+        }
+        if (in + match + 8 > limit) {
+            while (in + match < limit && src[candidate + match] == src[in + match])
+                match++;
+        }
+
+        int literals = in - anchor;
+        if (out + 1 + literals + 2 > capacity)
+            return 0;
+        char* token = dst + out++;
+        *token = (char)((literals < 15 ? literals : 15) << 4);
+        if (literals >= 15 && !lzWriteLength(dst, out, capacity, literals - 15))
+            return 0;
+        if (out + literals + 2 > capacity)
+            return 0;
+        memcpy(dst + out, src + anchor, literals);
+        out += literals;
+
+        int offset = in - candidate;
+        dst[out++] = (char)(offset & 0xff);
+        dst[out++] = (char)(offset >> 8);
+        int extra = match - LZ_MIN_MATCH;
+        *token |= (char)(extra < 15 ? extra : 15);
+        if (extra >= 15 && !lzWriteLength(dst, out, capacity, extra - 15))
+            return 0;
+
+        in += match;
+        anchor = in;
+        if (in - 2 > candidate)
+            table[lzHash(lzRead32(src + in - 2))] = in - 2;
+    }
+
+    int literals = len - anchor;
+    if (out + 1 > capacity)
+        return 0;
+    dst[out++] = (char)((literals < 15 ? literals : 15) << 4);
+    if (literals >= 15 && !lzWriteLength(dst, out, capacity, literals - 15))
+        return 0;
+    if (out + literals > capacity)
+        return 0;
+    memcpy(dst + out, src + anchor, literals);
+    return out + literals;
+}
+
+// Reads a length past the 15 of its nibble. False when the input ends.
+inline bool lzReadLength(const char* src, int& in, int len, int& length) {
+    while (true) {
+        if (in >= len)
+            return false;
+        unsigned char byte = src[in++];
+        length += byte;
+        if (byte != 255)
+            return true;
+    }
+}
+
+// Decompresses len bytes of src into dst. Returns the size of the
+// original, or -1 when src is not a valid stream or it doesn't fit in
+// capacity bytes. Short copies go 16 bytes at a time, so the bytes of dst
+// past the size returned may be overwritten too.
+inline int lzDecompress(const char* src, int len, char* dst, int capacity) {
+    int in = 0;
+    int out = 0;
+    while (in < len) {
+        unsigned char token = src[in++];
+        int literals = token >> 4;
+        if (literals == 15 && !lzReadLength(src, in, len, literals))
+            return -1;
+        if (literals > len - in || literals > capacity - out)
+            return -1;
+        // short literals are copied 16 bytes at once where both sides have
+        // room for it.
+        if (literals <= 16 && len - in >= 16 && capacity - out >= 16)
+            memcpy(dst + out, src + in, 16);
+        else
+            memcpy(dst + out, src + in, literals);
+        in += literals;
+        out += literals;
+        if (in == len)
+            return out;
+
+        if (len - in < 2)
+            return -1;
+        int offset = (unsigned char)src[in] | ((unsigned char)src[in + 1] << 8);
+        in += 2;
+        int match = token & 15;
+        if (match == 15 && !lzReadLength(src, in, len, match))
+            return -1;
+        match += LZ_MIN_MATCH;
+        if (offset == 0 || offset > out || match > capacity - out)
+            return -1;
+
+        // a match may overlap the bytes it produces, a run of them. From 8
+        // bytes back on, every 8 bytes copied were produced before.
+        int i = 0;
+        if (offset >= 16 && match <= 16 && capacity - out >= 16) {
+            memcpy(dst + out, dst + out - offset, 16);
+            i = match;
+        }
+        else if (offset >= 8) {
+            for (; i + 8 <= match; i += 8)
+                memcpy(dst + out + i, dst + out + i - offset, 8);
+        }
+        for (; i < match; i++)
+            dst[out + i] = dst[out + i - offset];
+        out += match;
+    }
+    return out;
+}
+
+#endif